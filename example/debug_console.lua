@@ -138,6 +138,8 @@ function COMMAND.help()
 		logon = "logon address",
 		logoff = "logoff address",
 		debug = "debug address : debug a lua service",
+		socket = "socket [address] : socket counters, of one service only with address",
+		netstat = "netstat : socket thread wakeups, events and requests",
 	}
 end
 
@@ -218,6 +220,23 @@ function COMMAND.debug(address, fd)
 	stop = true
 end
 
+function COMMAND.socket(address)
+	address = tonumber(address)
+	local list = {}
+	for _, info in ipairs(socket.info()) do
+		if address == nil or info.service == address then
+			list[info.id] = info
+		end
+	end
+	return list
+end
+
+function COMMAND.netstat()
+	local stat = socket.stat()
+	stat.event_per_wakeup = string.format("%.2f", stat.event / math.max(stat.wakeup, 1))
+	return stat
+end
+
 function COMMAND.logon(address)
 	address = tonumber(address)
 	c.logon(address)
@@ -44,7 +44,7 @@ function gated.login_handler(uid, secret)
 	users[uid] = u
 	username_map[username] = u
 
-	gate.login(username, secret)
+	gate.login(username, secret, agent)
 
 	-- you should return unique subid
 	return id
@@ -91,20 +91,6 @@ function gated.auth_handler(username, fd, addr)
 	end
 end
 
-service.protocol {
-	name = "client",
-	id = service.proto_client,
-	pack = function(...)
-		return ...
-	end,
-}
-
---call by self when recv a request from client
-function gated.request_handler(username, msg, sz)
-	local u = username_map[username]
-	return service.send(u.agent, "client", msg, sz)
-end
-
 --call by self when gate open
 function gated.register_handler(name)
 	servername = name
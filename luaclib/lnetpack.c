@@ -11,6 +11,14 @@
 #define QUEUESIZE 1024
 #define HASHSIZE 4096
 #define SMALLSTRING 2048
+// packages this big are sliced out of the read buffer, smaller ones are copied
+#define SLICESIZE 512
+#define MAXPACKAGE (16*1024*1024)
+
+// the size in front of a package: 2 or 4 bytes big endian, or a varint of
+// 7 bits a byte, low bits first
+#define HEADER_VARINT 0
+#define MAXHEADER 5
 
 #define TYPE_DATA 1
 #define TYPE_MORE 2
@@ -25,27 +33,33 @@ struct netpack {
 	char * buffer;
 };
 
-struct uncomplete {
-	struct netpack pack;
-	struct uncomplete * next;
+// What is left of a connection between two reads: a part of the header, or a
+// package being filled in place.
+struct netconn {
+	struct netconn * next;
+	int id;
+	int head;
+	int size;
 	int read;
-	int header;
+	char * buffer;
+	uint8_t header[MAXHEADER];
 };
 
 struct queue {
 	int cap;
 	int head;
 	int tail;
-	struct uncomplete * hash[HASHSIZE];
+	int header;
+	struct netconn * hash[HASHSIZE];
 	struct netpack queue[QUEUESIZE];
 };
 
-static void clear_list(struct uncomplete * uc) {
-	while (uc) {
-		void * tmp = uc;
-		service_alloc(uc->pack.buffer, 0);
-		uc = uc->next;
-		service_alloc(tmp, 0);
+static void clear_list(struct netconn * nc) {
+	while (nc) {
+		struct netconn * next = nc->next;
+		service_alloc(nc->buffer, 0);
+		service_alloc(nc, 0);
+		nc = next;
 	}
 }
 
@@ -77,50 +91,46 @@ static inline int hash_fd(int fd) {
 	return (int)(((uint32_t)(a + b + c)) % HASHSIZE);
 }
 
-static struct uncomplete *find_uncomplete(struct queue *q, int fd) {
+static struct netconn *find_conn(struct queue *q, int fd) {
 	if (q == NULL)
 		return NULL;
-	int h = hash_fd(fd);
-	struct uncomplete * uc = q->hash[h];
-	if (uc == NULL)
-		return NULL;
-	if (uc->pack.id == fd) {
-		q->hash[h] = uc->next;
-		return uc;
-	}
-	struct uncomplete * last = uc;
-	while (last->next) {
-		uc = last->next;
-		if (uc->pack.id == fd) {
-			last->next = uc->next;
-			return uc;
-		}
-		last = uc;
+	struct netconn * nc = q->hash[hash_fd(fd)];
+	while (nc && nc->id != fd) {
+		nc = nc->next;
 	}
-	return NULL;
+	return nc;
+}
+
+static struct queue *new_queue(lua_State *L, int header) {
+	struct queue *q = lua_newuserdata(L, sizeof(struct queue));
+	q->cap = QUEUESIZE;
+	q->head = 0;
+	q->tail = 0;
+	q->header = header;
+	int i;
+	for (i=0;i<HASHSIZE;i++) {
+		q->hash[i] = NULL;
+	}
+	return q;
 }
 
 static struct queue *get_queue(lua_State *L) {
 	struct queue *q = lua_touserdata(L,1);
 	if (q == NULL) {
-		q = lua_newuserdata(L, sizeof(struct queue));
-		q->cap = QUEUESIZE;
-		q->head = 0;
-		q->tail = 0;
-		int i;
-		for (i=0;i<HASHSIZE;i++) {
-			q->hash[i] = NULL;
-		}
+		q = new_queue(L, 2);
 		lua_replace(L, 1);
 	}
 	return q;
 }
 
+// The queue doubles, so a burst of packages moves it a few times at most.
 static void expand_queue(lua_State *L, struct queue *q) {
-	struct queue *nq = lua_newuserdata(L, sizeof(struct queue) + q->cap * sizeof(struct netpack));
-	nq->cap = q->cap + QUEUESIZE;
+	int cap = q->cap * 2;
+	struct queue *nq = lua_newuserdata(L, sizeof(struct queue) + (cap - QUEUESIZE) * sizeof(struct netpack));
+	nq->cap = cap;
 	nq->head = 0;
 	nq->tail = q->cap;
+	nq->header = q->header;
 	memcpy(nq->hash, q->hash, sizeof(nq->hash));
 	memset(q->hash, 0, sizeof(q->hash));
 	int i;
@@ -132,12 +142,7 @@ static void expand_queue(lua_State *L, struct queue *q) {
 	lua_replace(L,1);
 }
 
-static void push_data(lua_State *L, int fd, void *buffer, int size, int clone) {
-	if (clone) {
-		void * tmp = service_alloc(0, size);
-		memcpy(tmp, buffer, size);
-		buffer = tmp;
-	}
+static void push_data(lua_State *L, int fd, void *buffer, int size) {
 	struct queue *q = get_queue(L);
 	struct netpack *np = &q->queue[q->tail];
 	if (++q->tail >= q->cap)
@@ -150,135 +155,238 @@ static void push_data(lua_State *L, int fd, void *buffer, int size, int clone) {
 	}
 }
 
-static struct uncomplete *save_uncomplete(lua_State *L, int fd) {
+static struct netconn *save_conn(lua_State *L, int fd) {
 	struct queue *q = get_queue(L);
-	int h = hash_fd(fd);
-	struct uncomplete * uc = service_alloc(0, sizeof(struct uncomplete));
-	memset(uc, 0, sizeof(*uc));
-	uc->next = q->hash[h];
-	uc->pack.id = fd;
-	q->hash[h] = uc;
-	return uc;
+	struct netconn * nc = find_conn(q, fd);
+	if (nc == NULL) {
+		int h = hash_fd(fd);
+		nc = service_alloc(0, sizeof(struct netconn));
+		memset(nc, 0, sizeof(*nc));
+		nc->id = fd;
+		nc->next = q->hash[h];
+		q->hash[h] = nc;
+	}
+	return nc;
 }
 
-static inline int read_size(uint8_t * buffer) {
-	int r = (int)buffer[0] << 8 | (int)buffer[1];
-	return r;
+static void close_conn(lua_State *L, int fd) {
+	struct queue *q = lua_touserdata(L,1);
+	if (q == NULL)
+		return;
+	struct netconn ** p = &q->hash[hash_fd(fd)];
+	while (*p) {
+		struct netconn * nc = *p;
+		if (nc->id == fd) {
+			*p = nc->next;
+			service_alloc(nc->buffer, 0);
+			service_alloc(nc, 0);
+			return;
+		}
+		p = &nc->next;
+	}
 }
 
-static void push_more(lua_State *L, int fd, uint8_t *buffer, int size) {
-	if (size == 1) {
-		struct uncomplete * uc = save_uncomplete(L, fd);
-		uc->read = -1;
-		uc->header = *buffer;
-		return;
+// Returns the bytes of the header, 0 if more are needed, -1 for a bad one.
+static int read_header(const uint8_t * buffer, int size, int header, int *len) {
+	uint64_t v = 0;
+	int i;
+	switch (header) {
+	case 2:
+		if (size < 2)
+			return 0;
+		*len = (int)buffer[0] << 8 | (int)buffer[1];
+		return 2;
+	case 4:
+		if (size < 4)
+			return 0;
+		v = (uint32_t)buffer[0] << 24 | (uint32_t)buffer[1] << 16 | (uint32_t)buffer[2] << 8 | buffer[3];
+		if (v > MAXPACKAGE)
+			return -1;
+		*len = (int)v;
+		return 4;
+	default:
+		for (i=0;i<MAXHEADER && i<size;i++) {
+			v |= (uint64_t)(buffer[i] & 0x7f) << (7 * i);
+			if ((buffer[i] & 0x80) == 0) {
+				if (v > MAXPACKAGE)
+					return -1;
+				*len = (int)v;
+				return i + 1;
+			}
+		}
+		return i == MAXHEADER ? -1 : 0;
 	}
-	int pack_size = read_size(buffer);
-	buffer += 2;
-	size -= 2;
-	if (size < pack_size) {
-		struct uncomplete * uc = save_uncomplete(L, fd);
-		uc->read = size;
-		uc->pack.size = pack_size;
-		uc->pack.buffer = service_alloc(0, pack_size);
-		memcpy(uc->pack.buffer, buffer, size);
-		return;
+}
+
+static int write_header(uint8_t * buffer, int header, size_t len) {
+	int i;
+	switch (header) {
+	case 2:
+		buffer[0] = (len >> 8) & 0xff;
+		buffer[1] = len & 0xff;
+		return 2;
+	case 4:
+		buffer[0] = (len >> 24) & 0xff;
+		buffer[1] = (len >> 16) & 0xff;
+		buffer[2] = (len >> 8) & 0xff;
+		buffer[3] = len & 0xff;
+		return 4;
+	default:
+		for (i=0;len >= 0x80;i++) {
+			buffer[i] = (len & 0x7f) | 0x80;
+			len >>= 7;
+		}
+		buffer[i] = (uint8_t)len;
+		return i + 1;
+	}
+}
+
+// The first package of a read is returned as it is, the queue takes the rest.
+struct output {
+	int n;
+	struct netpack first;
+};
+
+static void output(lua_State *L, struct output *out, int fd, void *buffer, int size) {
+	if (out->n == 0) {
+		out->first.id = fd;
+		out->first.buffer = buffer;
+		out->first.size = size;
+	} else {
+		if (out->n == 1) {
+			push_data(L, out->first.id, out->first.buffer, out->first.size);
+		}
+		push_data(L, fd, buffer, size);
 	}
-	push_data(L, fd, buffer, pack_size, 1);
-	buffer += pack_size;
-	size -= pack_size;
-	if (size > 0) {
-		push_more(L, fd, buffer, size);
+	out->n++;
+}
+
+static void *copy_data(const uint8_t *buffer, int size) {
+	void * tmp = service_alloc(0, size);
+	memcpy(tmp, buffer, size);
+	return tmp;
+}
+
+// Keeps the tail of a read that isn't a whole package.
+static void save_partial(lua_State *L, int fd, const uint8_t *buffer, int size, int header) {
+	struct netconn * nc = save_conn(L, fd);
+	int len = 0;
+	int r = read_header(buffer, size, header, &len);
+	if (r == 0) {
+		memcpy(nc->header, buffer, size);
+		nc->head = size;
+		return;
 	}
+	nc->size = len;
+	nc->read = size - r;
+	nc->buffer = service_alloc(0, len);
+	memcpy(nc->buffer, buffer + r, nc->read);
 }
 
-static void close_uncomplete(lua_State *L, int fd) {
-	struct queue *q = lua_touserdata(L,1);
-	struct uncomplete * uc = find_uncomplete(q, fd);
-	if (uc) {
-		service_alloc(uc->pack.buffer, 0);
-		service_alloc(uc, 0);
+// Finishes the package left by the last read, returns the bytes taken from
+// buffer or -1 for a bad header.
+static int fill_partial(lua_State *L, struct output *out, struct netconn *nc, const uint8_t *buffer, int size, int header) {
+	int taken = 0;
+	while (nc->buffer == NULL && taken < size) {
+		int len = 0;
+		int r;
+		nc->header[nc->head++] = buffer[taken++];
+		r = read_header(nc->header, nc->head, header, &len);
+		if (r < 0)
+			return -1;
+		if (r > 0) {
+			nc->head = 0;
+			if (len == 0) {
+				output(L, out, nc->id, NULL, 0);
+				return taken;
+			}
+			nc->size = len;
+			nc->read = 0;
+			nc->buffer = service_alloc(0, len);
+		}
 	}
+	if (nc->buffer) {
+		int need = nc->size - nc->read;
+		if (need > size - taken)
+			need = size - taken;
+		memcpy(nc->buffer + nc->read, buffer + taken, need);
+		nc->read += need;
+		taken += need;
+		if (nc->read == nc->size) {
+			output(L, out, nc->id, nc->buffer, nc->size);
+			nc->buffer = NULL;
+		}
+	}
+	return taken;
 }
 
+// Whole packages are taken from the read buffer itself when they are big. A
+// slice overwrites the 4 bytes in front of it, they must not belong to the
+// buffer tag or a slice before.
 static int filter_data_(lua_State *L, int fd, uint8_t * buffer, int size) {
 	struct queue *q = lua_touserdata(L,1);
-	struct uncomplete * uc = find_uncomplete(q, fd);
-	if (uc) {
-		// fill uncomplete
-		if (uc->read < 0) {
-			// read size
-			assert(uc->read == -1);
-			int pack_size = *buffer;
-			pack_size |= uc->header << 8 ;
-			++buffer;
-			--size;
-			uc->pack.size = pack_size;
-			uc->pack.buffer = service_alloc(0, pack_size);
-			uc->read = 0;
-		}
-		int need = uc->pack.size - uc->read;
-		if (size < need) {
-			memcpy(uc->pack.buffer + uc->read, buffer, size);
-			uc->read += size;
-			int h = hash_fd(fd);
-			uc->next = q->hash[h];
-			q->hash[h] = uc;
-			return 1;
-		}
-		memcpy(uc->pack.buffer + uc->read, buffer, need);
-		buffer += need;
-		size -= need;
-		if (size == 0) {
-			lua_pushvalue(L, lua_upvalueindex(TYPE_DATA));
-			lua_pushinteger(L, fd);
-			lua_pushlightuserdata(L, uc->pack.buffer);
-			lua_pushinteger(L, uc->pack.size);
-			service_alloc(uc, 0);
-			return 5;
-		}
-		// more data
-		push_data(L, fd, uc->pack.buffer, uc->pack.size, 0);
-		service_alloc(uc, 0);
-		push_more(L, fd, buffer, size);
-		lua_pushvalue(L, lua_upvalueindex(TYPE_MORE));
-		return 2;
-	} else {
-		if (size == 1) {
-			struct uncomplete * uc = save_uncomplete(L, fd);
-			uc->read = -1;
-			uc->header = *buffer;
-			return 1;
+	int header = q ? q->header : 2;
+	struct netconn * nc = find_conn(q, fd);
+	struct output out;
+	uint8_t * base = buffer;
+	uint8_t * sliced = buffer;
+	out.n = 0;
+	if (nc && (nc->head > 0 || nc->buffer)) {
+		int taken = fill_partial(L, &out, nc, buffer, size, header);
+		if (taken < 0)
+			goto _error;
+		buffer += taken;
+		size -= taken;
+	}
+	while (size > 0) {
+		int len = 0;
+		int r = read_header(buffer, size, header, &len);
+		if (r < 0)
+			goto _error;
+		if (r == 0 || size - r < len) {
+			save_partial(L, fd, buffer, size, header);
+			break;
 		}
-		int pack_size = read_size(buffer);
-		buffer+=2;
-		size-=2;
-		if (size < pack_size) {
-			struct uncomplete * uc = save_uncomplete(L, fd);
-			uc->read = size;
-			uc->pack.size = pack_size;
-			uc->pack.buffer = service_alloc(0, pack_size);
-			memcpy(uc->pack.buffer, buffer, size);
-			return 1;
+		uint8_t * pack = buffer + r;
+		if (len >= SLICESIZE && pack - 4 >= sliced) {
+			service_share(base, pack);
+			output(L, &out, fd, pack, len);
+			sliced = pack + len;
+		} else {
+			output(L, &out, fd, len > 0 ? copy_data(pack, len) : NULL, len);
 		}
-		if (size == pack_size) {
-			// just one package
-			lua_pushvalue(L, lua_upvalueindex(TYPE_DATA));
-			lua_pushinteger(L, fd);
-			void * result = service_alloc(0, pack_size);
-			memcpy(result, buffer, size);
-			lua_pushlightuserdata(L, result);
-			lua_pushinteger(L, size);
-			return 5;
+		buffer += r + len;
+		size -= r + len;
+	}
+	if (out.n == 0)
+		return 1;
+	if (out.n == 1) {
+		lua_pushvalue(L, lua_upvalueindex(TYPE_DATA));
+		lua_pushinteger(L, fd);
+		lua_pushlightuserdata(L, out.first.buffer);
+		lua_pushinteger(L, out.first.size);
+		return 5;
+	}
+	lua_pushvalue(L, lua_upvalueindex(TYPE_MORE));
+	return 2;
+_error:
+	// drop the packages before the bad header, the fd is dead anyway
+	if (out.n == 1) {
+		service_alloc(out.first.buffer, 0);
+	} else if (out.n > 1) {
+		struct queue *q = lua_touserdata(L,1);
+		int i;
+		for (i=0;i<out.n;i++) {
+			if (--q->tail < 0)
+				q->tail += q->cap;
+			service_alloc(q->queue[q->tail].buffer, 0);
 		}
-		// more data
-		push_data(L, fd, buffer, pack_size, 1);
-		buffer += pack_size;
-		size -= pack_size;
-		push_more(L, fd, buffer, size);
-		lua_pushvalue(L, lua_upvalueindex(TYPE_MORE));
-		return 2;
 	}
+	close_conn(L, fd);
+	lua_pushvalue(L, lua_upvalueindex(TYPE_ERROR));
+	lua_pushinteger(L, fd);
+	lua_pushliteral(L, "invalid package size");
+	return 4;
 }
 
 static inline int filter_data(lua_State *L, int fd, uint8_t * buffer, int size) {
@@ -310,7 +418,7 @@ static int lfilter(lua_State *L) {
 			return 1;
 		case SOCKET_CLOSE:
 			// no more data in fd (message->id)
-			close_uncomplete(L, message->id);
+			close_conn(L, message->id);
 			lua_pushvalue(L, lua_upvalueindex(TYPE_CLOSE));
 			lua_pushinteger(L, message->id);
 			return 3;
@@ -322,7 +430,7 @@ static int lfilter(lua_State *L) {
 			return 4;
 		case SOCKET_ERR:
 			// no more data in fd (message->id)
-			close_uncomplete(L, message->id);
+			close_conn(L, message->id);
 			lua_pushvalue(L, lua_upvalueindex(TYPE_ERROR));
 			lua_pushinteger(L, message->id);
 			pushstring(L, buffer, size);
@@ -352,6 +460,33 @@ static int lpop(lua_State *L) {
 	return 3;
 }
 
+// 2, 4 or "varint", 2 when none
+static int check_header(lua_State *L, int index) {
+	if (lua_type(L, index) == LUA_TSTRING) {
+		if (strcmp(lua_tostring(L, index), "varint") != 0) {
+			luaL_argerror(L, index, "invalid header");
+		}
+		return HEADER_VARINT;
+	}
+	int header = (int)luaL_optinteger(L, index, 2);
+	if (header != 2 && header != 4) {
+		luaL_argerror(L, index, "invalid header");
+	}
+	return header;
+}
+
+static void check_size(lua_State *L, int header, size_t len) {
+	if (len > (header == 2 ? 0xffff : MAXPACKAGE)) {
+		luaL_error(L, "Invalid size (too long) of data : %d", (int)len);
+	}
+}
+
+// queue([header]) starts a queue for packages with that size header
+static int lqueue(lua_State *L) {
+	new_queue(L, check_header(L, 1));
+	return 1;
+}
+
 static const char *tolstring(lua_State *L, size_t *sz, int index) {
 	const char * ptr;
 	if (lua_isuserdata(L,index)) {
@@ -363,64 +498,61 @@ static const char *tolstring(lua_State *L, size_t *sz, int index) {
 	return ptr;
 }
 
-static inline void write_size(uint8_t * buffer, int len) {
-	buffer[0] = (len >> 8) & 0xff;
-	buffer[1] = len & 0xff;
+// the argument after the data, which is a string or a pointer and a size
+static inline int next_arg(lua_State *L, int index) {
+	return lua_isuserdata(L, index) ? index + 2 : index + 1;
 }
 
 static int lpack(lua_State *L) {
 	size_t len;
 	const char * ptr = tolstring(L, &len, 1);
-	if (len > 0x10000) {
-		return luaL_error(L, "Invalid size (too long) of data : %d", (int)len);
-	}
-	uint8_t * buffer = service_alloc(0, len + 2);
-	write_size(buffer, len);
-	memcpy(buffer+2, ptr, len);
+	int header = check_header(L, next_arg(L, 1));
+	check_size(L, header, len);
+	uint8_t * buffer = service_alloc(0, len + MAXHEADER);
+	int n = write_header(buffer, header, len);
+	memcpy(buffer+n, ptr, len);
 	lua_pushlightuserdata(L, buffer);
-	lua_pushinteger(L, len + 2);
+	lua_pushinteger(L, len + n);
 	return 2;
 }
 
 static int lpack_string(lua_State *L) {
-	uint8_t tmp[SMALLSTRING+2];
+	uint8_t tmp[SMALLSTRING+MAXHEADER];
 	size_t len;
 	uint8_t *buffer;
 	const char * ptr = tolstring(L, &len, 1);
-	if (len > 0x10000) {
-		return luaL_error(L, "Invalid size (too long) of data : %d", (int)len);
-	}
+	int header = check_header(L, next_arg(L, 1));
+	check_size(L, header, len);
 	if (len <= SMALLSTRING) {
 		buffer = tmp;
 	} else {
-		buffer = lua_newuserdata(L, len + 2);
+		buffer = lua_newuserdata(L, len + MAXHEADER);
 	}
-	write_size(buffer, len);
-	memcpy(buffer+2, ptr, len);
-	lua_pushlstring(L, (const char *)buffer, len+2);
+	int n = write_header(buffer, header, len);
+	memcpy(buffer+n, ptr, len);
+	lua_pushlstring(L, (const char *)buffer, len+n);
 	return 1;
 }
 
 static int lpack_padding(lua_State *L) {
-	uint8_t tmp[SMALLSTRING+2];
+	uint8_t tmp[SMALLSTRING+MAXHEADER];
 	size_t content_sz;
 	uint8_t *buffer;
 	const char * ptr = tolstring(L, &content_sz, 2);
+	int header = check_header(L, next_arg(L, 2));
 	size_t cookie_sz = 0;
 	const char * cookie = luaL_checklstring(L,1,&cookie_sz);
 	size_t len = cookie_sz + content_sz;
-	if (len > 0x10000) {
-		return luaL_error(L, "Invalid size (too long) of data : %d", (int)len);
-	}
+	check_size(L, header, len);
 	if (len <= SMALLSTRING) {
 		buffer = tmp;
 	} else {
-		buffer = lua_newuserdata(L, len + 2);
+		buffer = lua_newuserdata(L, len + MAXHEADER);
 	}
-	write_size(buffer, len);
-	memcpy(buffer+2, ptr, content_sz);
-	memcpy(buffer+2+content_sz, cookie, cookie_sz);
-	lua_pushlstring(L, (const char *)buffer, len+2);
+	int n = write_header(buffer, header, len);
+	memcpy(buffer+n, ptr, content_sz);
+	memcpy(buffer+n+content_sz, cookie, cookie_sz);
+	lua_pushlstring(L, (const char *)buffer, len+n);
 	return 1;
 }
 
@@ -447,9 +579,10 @@ static int ltostring(lua_State *L) {
 	return 1;
 }
 
-int luaopen_netpack(lua_State *L) {	
+int luaopen_netpack(lua_State *L) {
 	luaL_Reg l[] = {
 		{ "pop", lpop },
+		{ "queue", lqueue },
 		{ "pack", lpack },
 		{ "pack_string", lpack_string },
 		{ "pack_padding", lpack_padding },
@@ -0,0 +1,303 @@
+#include <lua.h>
+#include <lauxlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+// RESP, the redis protocol: commands go out as arrays of bulk strings, replies
+// are parsed straight from the received bytes.
+
+#define MAXDEPTH 32
+#define MAXBULK (512 * 1024 * 1024)
+
+#define PARSE_OK 0
+#define PARSE_MORE 1
+#define PARSE_ERROR 2
+
+struct reader {
+	const char * data;
+	size_t size;
+	size_t pos;
+	size_t need;
+	const char * err;
+};
+
+// The i-th string of a command: argument i when t is 0, or element i of the
+// table at t, which is left on the stack.
+static const char * command_arg(lua_State *L, int t, int i, size_t *sz) {
+	const char * str;
+	if (t == 0) {
+		str = lua_tolstring(L, i, sz);
+	} else {
+		lua_rawgeti(L, t, i);
+		str = lua_tolstring(L, -1, sz);
+	}
+	if (str == NULL) {
+		luaL_error(L, "redis: argument %d is a %s", i, luaL_typename(L, t ? -1 : i));
+	}
+	return str;
+}
+
+static int header_size(size_t n) {
+	int sz = 3;
+	do {
+		++sz;
+		n /= 10;
+	} while (n);
+	return sz;
+}
+
+static size_t command_size(lua_State *L, int t, int n) {
+	size_t total = header_size(n);
+	int i;
+	for (i = 1; i <= n; i++) {
+		size_t sz;
+		command_arg(L, t, i, &sz);
+		if (t) {
+			lua_pop(L, 1);
+		}
+		total += header_size(sz) + sz + 2;
+	}
+	return total;
+}
+
+static char * write_header(char * p, char type, size_t n) {
+	char tmp[32];
+	int sz = snprintf(tmp, sizeof(tmp), "%c%d\r\n", type, (int)n);
+	memcpy(p, tmp, sz);
+	return p + sz;
+}
+
+static char * write_command(lua_State *L, char * p, int t, int n) {
+	int i;
+	p = write_header(p, '*', n);
+	for (i = 1; i <= n; i++) {
+		size_t sz;
+		const char * str = command_arg(L, t, i, &sz);
+		p = write_header(p, '$', sz);
+		memcpy(p, str, sz);
+		p[sz] = '\r';
+		p[sz + 1] = '\n';
+		p += sz + 2;
+		if (t) {
+			lua_pop(L, 1);
+		}
+	}
+	return p;
+}
+
+/*
+	string cmd, ... / table { cmd, ... }, ...
+	return string
+
+	Packs one command from the arguments, or one command from every table.
+ */
+static int lpack(lua_State *L) {
+	luaL_Buffer b;
+	int i;
+	int top = lua_gettop(L);
+	int tables = lua_type(L, 1) == LUA_TTABLE;
+	size_t total = 0;
+	char * p;
+	if (tables) {
+		for (i = 1; i <= top; i++) {
+			luaL_checktype(L, i, LUA_TTABLE);
+			total += command_size(L, i, (int)lua_rawlen(L, i));
+		}
+	} else {
+		luaL_checkstring(L, 1);
+		total = command_size(L, 0, top);
+	}
+	// the strings are sized and written between buffer calls, a table element
+	// on the stack never sits above the buffer box
+	p = luaL_buffinitsize(L, &b, total);
+	if (tables) {
+		for (i = 1; i <= top; i++) {
+			p = write_command(L, p, i, (int)lua_rawlen(L, i));
+		}
+	} else {
+		write_command(L, p, 0, top);
+	}
+	luaL_pushresultsize(&b, total);
+	return 1;
+}
+
+// Finds the \r\n ending the line at r->pos, returns the end of the line or NULL
+static const char * read_line(struct reader *r) {
+	const char * p = r->data + r->pos;
+	const char * end = r->data + r->size;
+	for (;;) {
+		p = (const char *)memchr(p, '\r', end - p);
+		if (p == NULL || p + 1 == end) {
+			r->need = 1;
+			return NULL;
+		}
+		if (p[1] == '\n') {
+			return p;
+		}
+		++p;
+	}
+}
+
+static int read_integer(struct reader *r, const char * p, const char * end, long long *v) {
+	int neg = 0;
+	long long n = 0;
+	if (p < end && *p == '-') {
+		neg = 1;
+		++p;
+	}
+	if (p == end) {
+		r->err = "bad integer";
+		return PARSE_ERROR;
+	}
+	for (; p < end; p++) {
+		if (*p < '0' || *p > '9') {
+			r->err = "bad integer";
+			return PARSE_ERROR;
+		}
+		n = n * 10 + (*p - '0');
+	}
+	*v = neg ? -n : n;
+	return PARSE_OK;
+}
+
+static int parse_reply(lua_State *L, struct reader *r, int depth, int *ok) {
+	const char * line = r->data + r->pos;
+	const char * eol;
+	long long n;
+	int err;
+	if (r->pos >= r->size) {
+		r->need = 1;
+		return PARSE_MORE;
+	}
+	eol = read_line(r);
+	if (eol == NULL) {
+		return PARSE_MORE;
+	}
+	switch (*line) {
+	case '+':
+	case '-':
+		lua_pushlstring(L, line + 1, eol - line - 1);
+		*ok = *line == '+';
+		r->pos = eol - r->data + 2;
+		return PARSE_OK;
+	case ':':
+		err = read_integer(r, line + 1, eol, &n);
+		if (err != PARSE_OK) {
+			return err;
+		}
+		lua_pushinteger(L, (lua_Integer)n);
+		r->pos = eol - r->data + 2;
+		return PARSE_OK;
+	case '$': {
+		size_t from = eol - r->data + 2;
+		err = read_integer(r, line + 1, eol, &n);
+		if (err != PARSE_OK) {
+			return err;
+		}
+		if (n < 0) {
+			lua_pushnil(L);
+			r->pos = from;
+			return PARSE_OK;
+		}
+		if (n > MAXBULK) {
+			r->err = "bulk string too big";
+			return PARSE_ERROR;
+		}
+		if (r->size - from < (size_t)n + 2) {
+			r->need = from + n + 2 - r->size;
+			return PARSE_MORE;
+		}
+		lua_pushlstring(L, r->data + from, (size_t)n);
+		r->pos = from + n + 2;
+		return PARSE_OK;
+	}
+	case '*': {
+		int i;
+		size_t pos = r->pos;
+		err = read_integer(r, line + 1, eol, &n);
+		if (err != PARSE_OK) {
+			return err;
+		}
+		r->pos = eol - r->data + 2;
+		if (n < 0) {
+			lua_pushnil(L);
+			return PARSE_OK;
+		}
+		// every element takes 3 bytes at least, don't make a table for a reply far from complete
+		if ((size_t)n > (r->size - r->pos) / 3) {
+			r->need = n * 3 - (r->size - r->pos);
+			r->pos = pos;
+			return PARSE_MORE;
+		}
+		if (depth >= MAXDEPTH) {
+			r->err = "nested too deep";
+			return PARSE_ERROR;
+		}
+		luaL_checkstack(L, 4, NULL);
+		lua_createtable(L, (int)n, 0);
+		for (i = 1; i <= n; i++) {
+			int eok;
+			err = parse_reply(L, r, depth + 1, &eok);
+			if (err != PARSE_OK) {
+				lua_pop(L, 1);
+				r->pos = pos;
+				return err;
+			}
+			lua_rawseti(L, -2, i);
+		}
+		*ok = 1;
+		return PARSE_OK;
+	}
+	default:
+		r->err = "bad reply type";
+		return PARSE_ERROR;
+	}
+}
+
+/*
+	string data
+	integer pos (default 1)
+	return
+		integer nextpos, boolean ok, value
+		nil, integer need	(the reply is incomplete, need bytes more at least)
+
+	A nil bulk string or array is a nil value, errors inside an array are
+	strings. ok is false for an error reply.
+ */
+static int lparse(lua_State *L) {
+	struct reader r;
+	int ok = 1;
+	int err;
+	lua_Integer pos = luaL_optinteger(L, 2, 1);
+	r.data = luaL_checklstring(L, 1, &r.size);
+	luaL_argcheck(L, pos >= 1 && (size_t)pos <= r.size + 1, 2, "out of range");
+	r.pos = (size_t)pos - 1;
+	r.need = 0;
+	r.err = NULL;
+	lua_settop(L, 2);
+	err = parse_reply(L, &r, 0, &ok);
+	if (err == PARSE_ERROR) {
+		return luaL_error(L, "redis: %s at %d", r.err, (int)r.pos + 1);
+	}
+	if (err == PARSE_MORE) {
+		lua_pushnil(L);
+		lua_pushinteger(L, (lua_Integer)r.need);
+		return 2;
+	}
+	lua_pushinteger(L, (lua_Integer)r.pos + 1);
+	lua_pushboolean(L, ok);
+	lua_rotate(L, -3, 2);
+	return 3;
+}
+
+int luaopen_redis_c(lua_State *L) {
+	luaL_Reg l[] = {
+		{ "pack", lpack },
+		{ "parse", lparse },
+		{ NULL, NULL },
+	};
+	luaL_checkversion(L);
+	luaL_newlib(L,l);
+	return 1;
+}
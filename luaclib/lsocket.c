@@ -1,4 +1,5 @@
 #include "socket.h"
+#include "service.h"
 
 #include "lua.h"
 #include "lualib.h"
@@ -8,26 +9,32 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 
+// socket data is released by the socket layer and services, share their allocator
 void *lsocket_alloc(void *p, int size) {
-	if (0 == size) {
-		free(p);
-		return 0;
-	}
-	return malloc(size);
+	return service_alloc(p, size);
 }
 
+#define BUFFER_COALESCE 256
+
 struct buffer_node {
 	char *data;
 	int size;
 	struct buffer_node *next;
 };
 
+// scan counts the bytes from the read position known not to start the last
+// separator readline looked for, which is kept as the uservalue of the buffer.
 struct buffer {
 	int size;
 	int offset;
+	int scan;
 	struct buffer_node *head;
 	struct buffer_node *tail;
 };
@@ -37,6 +44,158 @@ struct bufferpool {
 	struct buffer_node *freelist;
 };
 
+// A slice is a view of received bytes, it holds a reference to the pooled block
+// they live in instead of copying them into a lua string.
+struct slice {
+	char *block;
+	const char *data;
+	int size;
+};
+
+static void push_slice(lua_State *L, char *block, const char *data, int size) {
+	struct slice *s = (struct slice *)lua_newuserdata(L, sizeof *s);
+	if (size > 0) {
+		service_retain(block);
+		s->block = block;
+		s->data = data;
+	} else {
+		s->block = 0;
+		s->data = "";
+		size = 0;
+	}
+	s->size = size;
+	luaL_setmetatable(L, "slice");
+}
+
+static lua_Integer slice_index(lua_Integer pos, int size) {
+	if (pos >= 0) {
+		return pos;
+	}
+	if (-pos > size) {
+		return 0;
+	}
+	return size + pos + 1;
+}
+
+static int lslice_gc(lua_State *L) {
+	struct slice *s = (struct slice *)luaL_checkudata(L, 1, "slice");
+	if (s->block) {
+		lsocket_alloc(s->block, 0);
+		s->block = 0;
+	}
+	return 0;
+}
+
+static int lslice_len(lua_State *L) {
+	struct slice *s = (struct slice *)luaL_checkudata(L, 1, "slice");
+	lua_pushinteger(L, s->size);
+	return 1;
+}
+
+static int lslice_tostring(lua_State *L) {
+	struct slice *s = (struct slice *)luaL_checkudata(L, 1, "slice");
+	lua_pushlstring(L, s->data, s->size);
+	return 1;
+}
+
+// byte(i [, j]) as string.byte
+static int lslice_byte(lua_State *L) {
+	struct slice *s = (struct slice *)luaL_checkudata(L, 1, "slice");
+	lua_Integer i = slice_index(luaL_optinteger(L, 2, 1), s->size);
+	lua_Integer j = slice_index(luaL_optinteger(L, 3, i), s->size);
+	int n;
+	if (i < 1) {
+		i = 1;
+	}
+	if (j > s->size) {
+		j = s->size;
+	}
+	if (i > j) {
+		return 0;
+	}
+	n = (int)(j - i + 1);
+	luaL_checkstack(L, n, "slice too large");
+	for (; i <= j; i++) {
+		lua_pushinteger(L, (unsigned char)s->data[i - 1]);
+	}
+	return n;
+}
+
+// sub(i [, j]) as string.sub, the new slice shares the block
+static int lslice_sub(lua_State *L) {
+	struct slice *s = (struct slice *)luaL_checkudata(L, 1, "slice");
+	lua_Integer i = slice_index(luaL_checkinteger(L, 2), s->size);
+	lua_Integer j = slice_index(luaL_optinteger(L, 3, -1), s->size);
+	if (i < 1) {
+		i = 1;
+	}
+	if (j > s->size) {
+		j = s->size;
+	}
+	push_slice(L, s->block, s->data + i - 1, i > j ? 0 : (int)(j - i + 1));
+	return 1;
+}
+
+// find(str [, init]) is a plain string.find, returns the first and the last
+// index of str or nil
+static int lslice_find(lua_State *L) {
+	struct slice *s = (struct slice *)luaL_checkudata(L, 1, "slice");
+	size_t len;
+	const char *str = luaL_checklstring(L, 2, &len);
+	lua_Integer init = slice_index(luaL_optinteger(L, 3, 1), s->size);
+	const char *p, *last;
+	if (init < 1) {
+		init = 1;
+	}
+	if (init > s->size + 1 || (size_t)(s->size - init + 1) < len) {
+		lua_pushnil(L);
+		return 1;
+	}
+	if (len == 0) {
+		lua_pushinteger(L, init);
+		lua_pushinteger(L, init - 1);
+		return 2;
+	}
+	p = s->data + init - 1;
+	last = s->data + s->size - len;
+	while (p <= last) {
+		p = (const char *)memchr(p, str[0], last - p + 1);
+		if (p == 0) {
+			break;
+		}
+		if (memcmp(p + 1, str + 1, len - 1) == 0) {
+			lua_pushinteger(L, p - s->data + 1);
+			lua_pushinteger(L, p - s->data + len);
+			return 2;
+		}
+		++p;
+	}
+	lua_pushnil(L);
+	return 1;
+}
+
+static void slice_metatable(lua_State *L) {
+	if (luaL_newmetatable(L, "slice")) {
+		luaL_Reg l[] = {
+			{"len", lslice_len},
+			{"byte", lslice_byte},
+			{"sub", lslice_sub},
+			{"find", lslice_find},
+			{"tostring", lslice_tostring},
+			{0, 0},
+		};
+		luaL_newlib(L, l);
+		lua_setfield(L, -2, "__index");
+		lua_pushcfunction(L, lslice_len);
+		lua_setfield(L, -2, "__len");
+		lua_pushcfunction(L, lslice_tostring);
+		lua_setfield(L, -2, "__tostring");
+		lua_pushcfunction(L, lslice_gc);
+		lua_setfield(L, -2, "__gc");
+	}
+	lua_pop(L, 1);
+}
+
 static void _freebuffer(struct buffer *b, struct bufferpool *bp) {
 	if (b->head) {
 		struct buffer_node *node = b->head;
@@ -103,6 +262,45 @@ static void lpop_string(lua_State *L, struct buffer *b, struct bufferpool *bp, i
 	luaL_pushresult(&lb);
 }
 
+// As lpop_string, the bytes stay where they were received when they are in one
+// node. Bytes spread over several nodes are copied once into a block of their own.
+static void lpop_slice(lua_State *L, struct buffer *b, struct bufferpool *bp, int size, int skip) {
+	struct buffer_node *cur = b->head;
+	int bytes = cur->size - b->offset;
+	int copy = size - skip;
+	char *block, *p;
+	if (size <= bytes) {
+		push_slice(L, cur->data, cur->data + b->offset, copy);
+		b->offset += size;
+		if (size == bytes) {
+			_freebuffer(b, bp);
+		}
+		return;
+	}
+	block = p = (char *)lsocket_alloc(0, copy);
+	while (size > 0) {
+		cur = b->head;
+		bytes = cur->size - b->offset;
+		if (bytes > size) {
+			bytes = size;
+		}
+		if (copy > 0) {
+			int n = bytes < copy ? bytes : copy;
+			memcpy(p, cur->data + b->offset, n);
+			p += n;
+			copy -= n;
+		}
+		size -= bytes;
+		if (b->offset + bytes == cur->size) {
+			_freebuffer(b, bp);
+		} else {
+			b->offset += bytes;
+		}
+	}
+	push_slice(L, block, block, p - block);
+	lsocket_alloc(block, 0);
+}
+
 static int lreadall(lua_State *L) {
 	luaL_Buffer lb;
 	struct bufferpool *bp = (struct bufferpool *)lua_touserdata(L, lua_upvalueindex(1));
@@ -117,6 +315,7 @@ static int lreadall(lua_State *L) {
 		_freebuffer(b, bp);
 	}
 	b->size = 0;
+	b->scan = 0;
 	luaL_pushresult(&lb);
 	return 1;
 }
@@ -139,43 +338,86 @@ static int check_sep(struct buffer_node *node, int from, const char *sep, int se
 	}
 }
 
+// Position of the first sep at or after start, or -1. memchr finds the first
+// byte of sep, check_sep compares the rest across nodes.
+static int find_sep(struct buffer *b, int start, const char *sep, int len) {
+	struct buffer_node *cur = b->head;
+	int from = b->offset;
+	int pos = 0;
+	int last = b->size - len;
+	if (start > last) {
+		return -1;
+	}
+	while (start - pos >= cur->size - from) {
+		pos += cur->size - from;
+		cur = cur->next;
+		from = 0;
+	}
+	from += start - pos;
+	pos = start;
+	while (pos <= last) {
+		int n = cur->size - from;
+		const char *p;
+		if (n > last - pos + 1) {
+			n = last - pos + 1;
+		}
+		p = (const char *)memchr(cur->data + from, sep[0], n);
+		if (p) {
+			int at = (int)(p - cur->data);
+			if (check_sep(cur, at, sep, len)) {
+				return pos + at - from;
+			}
+			n = at - from + 1;
+		}
+		pos += n;
+		from += n;
+		if (from == cur->size) {
+			cur = cur->next;
+			from = 0;
+		}
+	}
+	return -1;
+}
+
 static int lreadline(lua_State *L) {
-	struct buffer_node *cur;
-	int i, from, bytes, len;
+	int i, len, start = 0;
 	size_t seplen;
 	struct bufferpool *bp = (struct bufferpool *)lua_touserdata(L, lua_upvalueindex(1));
 	struct buffer *b = (struct buffer *)lua_touserdata(L, 1);
 	const char *sep = luaL_checklstring(L, 2, &seplen);
 	int check = (int)luaL_optnumber(L, 3, 0);
+	int slice = lua_toboolean(L, 4);
 	len = seplen;
-	cur = b->head;
-	if (!cur) {
+	if (!b->head) {
 		return 0;
 	}
-	from = b->offset;
-	bytes = cur->size - from;
-	for (i = 0; i <= b->size - len; i++) {
-		if (check_sep(cur, from, sep, len)) {
-			if (check) {
-				lua_pushboolean(L, 1);
-			} else {
-				lpop_string(L, b, bp, i + len, len);
-				b->size -= i + len;
-			}
-			return 1;
-		}
-		++from;
-		--bytes;
-		if (bytes == 0) {
-			cur = cur->next;
-			from = 0;
-			if (!cur) {
-				break;
-			}
-			bytes = cur->size;
-		}
+	// go on from the last scan when it looked for the same separator
+	lua_getuservalue(L, 1);
+	if (lua_rawequal(L, -1, 2)) {
+		start = b->scan;
+	} else {
+		lua_pushvalue(L, 2);
+		lua_setuservalue(L, 1);
 	}
-	return 0;
+	lua_pop(L, 1);
+	i = len > 0 ? find_sep(b, start, sep, len) : 0;
+	if (i < 0) {
+		b->scan = b->size - len + 1 > 0 ? b->size - len + 1 : 0;
+		return 0;
+	}
+	if (check) {
+		b->scan = i;
+		lua_pushboolean(L, 1);
+		return 1;
+	}
+	if (slice) {
+		lpop_slice(L, b, bp, i + len, len);
+	} else {
+		lpop_string(L, b, bp, i + len, len);
+	}
+	b->size -= i + len;
+	b->scan = 0;
+	return 1;
 }
 
 static int lpopbuffer(lua_State *L) {
@@ -185,19 +427,56 @@ static int lpopbuffer(lua_State *L) {
 	if (b->size < size || size == 0) {
 		lua_pushnil(L);
 	} else {
-		lpop_string(L, b, bp, size, 0);
+		if (lua_toboolean(L, 3)) {
+			lpop_slice(L, b, bp, size, 0);
+		} else {
+			lpop_string(L, b, bp, size, 0);
+		}
 		b->size -= size;
+		b->scan = b->scan > size ? b->scan - size : 0;
 	}
 	lua_pushinteger(L, b->size);
 	return 2;
 }
 
+// Merges data into the tail node when both are small, a trickle of short reads
+// then doesn't leave a long list of nodes for every scan to walk.
+static int coalesce_tail(struct buffer *b, char *data, int size) {
+	struct buffer_node *tail = b->tail;
+	int from, keep;
+	char *p;
+	if (tail == 0 || size >= BUFFER_COALESCE) {
+		return 0;
+	}
+	from = tail == b->head ? b->offset : 0;
+	keep = tail->size - from;
+	if (keep + size > BUFFER_COALESCE) {
+		return 0;
+	}
+	p = (char *)lsocket_alloc(0, keep + size);
+	memcpy(p, tail->data + from, keep);
+	memcpy(p + keep, data, size);
+	lsocket_alloc(tail->data, 0);
+	lsocket_alloc(data, 0);
+	tail->data = p;
+	tail->size = keep + size;
+	if (tail == b->head) {
+		b->offset = 0;
+	}
+	return 1;
+}
+
 static int lpushbuffer(lua_State *L) {
 	struct bufferpool *bp = (struct bufferpool *)lua_touserdata(L, lua_upvalueindex(1));
 	struct buffer *b = (struct buffer *)lua_touserdata(L, 1);
 	char *data = (char *)lua_touserdata(L, 2);
 	int size = (int)luaL_checkinteger(L, 3);
 	struct buffer_node *node = bp->freelist;
+	if (coalesce_tail(b, data, size)) {
+		b->size += size;
+		lua_pushinteger(L, b->size);
+		return 1;
+	}
 	if (!node) {
 		int i;
 		int size = 2;
@@ -229,6 +508,7 @@ static int lfreebuffer(lua_State *L) {
 	struct bufferpool *bp = (struct bufferpool *)lua_touserdata(L, lua_upvalueindex(1));
 	struct buffer *b = (struct buffer *)lua_touserdata(L, 1);
 	_freebuffer(b, bp);
+	b->scan = 0;
 	return 0;
 }
 
@@ -257,16 +537,25 @@ static int lnewbuffer(lua_State *L) {
 static int llisten(lua_State *L) {
 	uint32_t handle = (uint32_t)lua_tointeger(L, lua_upvalueindex(1));
 	const char *host = luaL_checkstring(L, 1);
-	int port = (int)luaL_checkinteger(L, 2);
+	int port = (int)luaL_optinteger(L, 2, 0);
 	int id = socket_listen(host, port, (void *)(intptr_t)handle);
 	lua_pushinteger(L, id);
 	return 1;
 }
 
+static int llisten_reuseport(lua_State *L) {
+	uint32_t handle = (uint32_t)lua_tointeger(L, lua_upvalueindex(1));
+	const char *host = luaL_checkstring(L, 1);
+	int port = (int)luaL_optinteger(L, 2, 0);
+	int id = socket_listen_reuseport(host, port, (void *)(intptr_t)handle);
+	lua_pushinteger(L, id);
+	return 1;
+}
+
 static int lopen(lua_State *L) {
 	uint32_t handle = (uint32_t)lua_tointeger(L, lua_upvalueindex(1));
 	const char *host = luaL_checkstring(L, 1);
-	int port = (int)luaL_checkinteger(L, 2);
+	int port = (int)luaL_optinteger(L, 2, 0);
 	int id = socket_open(host, port, (void *)(intptr_t)handle);
 	lua_pushinteger(L, id);
 	return 1;
@@ -300,7 +589,13 @@ static int lsend(lua_State *L) {
 	size_t size;
 	int priority;
 	long nsend;
-	if (lua_isuserdata(L, 2)) {
+	struct slice *s = (struct slice *)luaL_testudata(L, 2, "slice");
+	if (s) {
+		size = s->size;
+		data = lsocket_alloc(0, size);
+		memcpy(data, s->data, size);
+		priority = (int)luaL_optinteger(L, 3, 0);
+	} else if (lua_isuserdata(L, 2)) {
 		data = lua_touserdata(L, 2);
 		size = (int)luaL_checkinteger(L, 3);
 		priority = (int)luaL_optinteger(L, 4, 0);
@@ -315,12 +610,121 @@ static int lsend(lua_State *L) {
 	return 1;
 }
 
+// sendmulti({ id1, id2, ... }, data [, priority]), data is a string, a slice or
+// a pointer and a size, one copy of it goes to every socket.
+static int lsendmulti(lua_State *L) {
+	int i, n;
+	int *ids;
+	void *data;
+	size_t size;
+	int priority;
+	struct slice *s;
+	luaL_checktype(L, 1, LUA_TTABLE);
+	n = (int)lua_rawlen(L, 1);
+	s = (struct slice *)luaL_testudata(L, 2, "slice");
+	if (s) {
+		size = s->size;
+		data = lsocket_alloc(0, size);
+		memcpy(data, s->data, size);
+		priority = (int)luaL_optinteger(L, 3, 0);
+	} else if (lua_isuserdata(L, 2)) {
+		data = lua_touserdata(L, 2);
+		size = (int)luaL_checkinteger(L, 3);
+		priority = (int)luaL_optinteger(L, 4, 0);
+	} else {
+		const char *p = luaL_checklstring(L, 2, &size);
+		data = lsocket_alloc(0, size);
+		memcpy(data, p, size);
+		priority = (int)luaL_optinteger(L, 3, 0);
+	}
+	ids = (int *)lua_newuserdata(L, (n > 0 ? n : 1) * sizeof(int));
+	for (i = 0; i < n; i++) {
+		lua_rawgeti(L, 1, i + 1);
+		ids[i] = (int)lua_tointeger(L, -1);
+		lua_pop(L, 1);
+	}
+	socket_sendmulti(ids, n, data, (int)size, priority);
+	return 0;
+}
+
+// sendfile(id, filename [, offset [, size [, priority]]]), the file is streamed
+// by the socket thread without being read into memory.
+static int lsendfile(lua_State *L) {
+	int id = (int)luaL_checkinteger(L, 1);
+	const char *filename = luaL_checkstring(L, 2);
+	lua_Integer offset = luaL_optinteger(L, 3, 0);
+	lua_Integer size = luaL_optinteger(L, 4, -1);
+	int priority = (int)luaL_optinteger(L, 5, 0);
+	struct stat st;
+	int fd = open(filename, O_RDONLY | O_CLOEXEC);
+	if (fd < 0 || fstat(fd, &st) != 0) {
+		int err = errno;
+		if (fd >= 0)
+			close(fd);
+		lua_pushnil(L);
+		lua_pushstring(L, strerror(err));
+		return 2;
+	}
+	if (offset < 0 || offset > st.st_size)
+		offset = st.st_size;
+	if (size < 0 || size > st.st_size - offset)
+		size = st.st_size - offset;
+	if (size == 0) {
+		close(fd);
+		lua_pushinteger(L, 0);
+		return 1;
+	}
+	socket_sendfile(id, fd, (long)offset, (long)size, priority);
+	lua_pushinteger(L, size);
+	return 1;
+}
+
+static int lflush(lua_State *L) {
+	int id = (int)luaL_optinteger(L, 1, -1);
+	socket_flush(id);
+	return 0;
+}
+
 static int lnodelay(lua_State *L) {
 	int id = (int)luaL_checkinteger(L, 1);
 	socket_nodelay(id);
 	return 0;
 }
 
+static int lpause(lua_State *L) {
+	int id = (int)luaL_checkinteger(L, 1);
+	socket_pause(id);
+	return 0;
+}
+
+static int lresume(lua_State *L) {
+	int id = (int)luaL_checkinteger(L, 1);
+	socket_resume(id);
+	return 0;
+}
+
+// redirect(id, handle [, header]) hands the socket to another service, header
+// 2 or 4 sends it the packages as client messages
+static int lredirect(lua_State *L) {
+	int id = (int)luaL_checkinteger(L, 1);
+	uint32_t handle = (uint32_t)luaL_checkinteger(L, 2);
+	int header = (int)luaL_optinteger(L, 3, 0);
+	if (socket_redirect(id, (void *)(intptr_t)handle, header)) {
+		return luaL_error(L, "invalid header size %d", header);
+	}
+	return 0;
+}
+
+// redirected(id [, data]) answers the redirect message with the bytes read
+// but not consumed
+static int lredirected(lua_State *L) {
+	int id = (int)luaL_checkinteger(L, 1);
+	size_t size = 0;
+	const char *data = luaL_optlstring(L, 2, 0, &size);
+	socket_redirected(id, data, (int)size);
+	return 0;
+}
+
 static int ludp(lua_State *L) {
 	uint32_t handle = (uint32_t)lua_tointeger(L, lua_upvalueindex(1));
 	int id;
@@ -363,6 +767,68 @@ static int ludp_send(lua_State *L) {
 	return 1;
 }
 
+// udp_sendv(id, { address1, data1, address2, data2, ... })
+static int ludp_sendv(lua_State *L) {
+	int id = (int)luaL_checkinteger(L, 1);
+	int i, n, sz = 0;
+	char *batch, *ptr;
+	long nsend;
+	luaL_checktype(L, 2, LUA_TTABLE);
+	n = (int)lua_rawlen(L, 2);
+	if (n == 0 || n % 2 != 0) {
+		return luaL_error(L, "need address and data pairs");
+	}
+	for (i = 1; i <= n; i += 2) {
+		size_t size;
+		const char *address, *data;
+		int r;
+		lua_rawgeti(L, 2, i);
+		lua_rawgeti(L, 2, i + 1);
+		address = luaL_checkstring(L, -2);
+		data = luaL_checklstring(L, -1, &size);
+		r = socket_udppack(0, address, data, (int)size);
+		if (r < 0) {
+			return luaL_error(L, "invalid udp package %d", i / 2 + 1);
+		}
+		sz += r;
+		lua_pop(L, 2);
+	}
+	batch = ptr = (char *)lsocket_alloc(0, sz);
+	for (i = 1; i <= n; i += 2) {
+		size_t size;
+		const char *address, *data;
+		lua_rawgeti(L, 2, i);
+		lua_rawgeti(L, 2, i + 1);
+		address = lua_tostring(L, -2);
+		data = lua_tolstring(L, -1, &size);
+		ptr += socket_udppack(ptr, address, data, (int)size);
+		lua_pop(L, 2);
+	}
+	nsend = socket_udpsendv(id, batch, sz);
+	lua_pushinteger(L, (int)nsend);
+	return 1;
+}
+
+// udp_unpack(batch, size, offset) returns next offset, data, address
+static int ludp_unpack(lua_State *L) {
+	const char *batch = (const char *)lua_touserdata(L, 1);
+	int size = (int)luaL_checkinteger(L, 2);
+	int offset = (int)luaL_optinteger(L, 3, 0);
+	const char *address, *data;
+	int address_size, data_size, r;
+	if (batch == 0 || offset >= size) {
+		return 0;
+	}
+	r = socket_udpunpack(batch + offset, size - offset, &address, &address_size, &data, &data_size);
+	if (r < 0) {
+		return luaL_error(L, "invalid udp batch");
+	}
+	lua_pushinteger(L, offset + r);
+	lua_pushlstring(L, data, data_size);
+	lua_pushlstring(L, address, address_size);
+	return 3;
+}
+
 static int ludp_address(lua_State *L) {
 	size_t size = 0;
 	const uint8_t *addr = (const uint8_t *)luaL_checklstring(L, 1, &size);
@@ -370,6 +836,14 @@ static int ludp_address(lua_State *L) {
 	int family;
 	char tmp[256];
 	void *src = (void *)(addr + 3);
+	if (size == 1) {
+		// a unix datagram, it comes from the connected peer
+		lua_pushliteral(L, "unix");
+		return 1;
+	}
+	if (size < 1 + 2 + 4) {
+		return luaL_error(L, "invalid udp address");
+	}
 	memcpy(&port, addr + 1, sizeof(uint16_t));
 	port = ntohs(port);
 	if (size == 1 + 2 + 4) {
@@ -388,6 +862,53 @@ static int ludp_address(lua_State *L) {
 	return 2;
 }
 
+static void setinteger(lua_State *L, const char *key, lua_Integer v) {
+	lua_pushinteger(L, v);
+	lua_setfield(L, -2, key);
+}
+
+// sockets opened meanwhile may be missed, the second pass never overflows
+static int linfo(lua_State *L) {
+	int i, n = socket_info(0, 0) + 64;
+	struct socket_info *si = (struct socket_info *)lua_newuserdata(L, n * sizeof(*si));
+	int count = socket_info(si, n);
+	if (count > n) {
+		count = n;
+	}
+	lua_createtable(L, count, 0);
+	for (i = 0; i < count; i++) {
+		struct socket_info *info = &si[i];
+		lua_createtable(L, 0, 13);
+		setinteger(L, "id", info->id);
+		lua_pushstring(L, info->type);
+		lua_setfield(L, -2, "type");
+		setinteger(L, "service", (uint32_t)(intptr_t)info->ud);
+		lua_pushboolean(L, info->paused);
+		lua_setfield(L, -2, "paused");
+		setinteger(L, "age", info->age);
+		setinteger(L, "read", info->read);
+		setinteger(L, "write", info->write);
+		setinteger(L, "read_call", info->read_call);
+		setinteger(L, "write_call", info->write_call);
+		setinteger(L, "read_again", info->read_again);
+		setinteger(L, "write_again", info->write_again);
+		setinteger(L, "wb_size", info->wb_size);
+		setinteger(L, "wb_peak", info->wb_peak);
+		lua_rawseti(L, -2, i + 1);
+	}
+	return 1;
+}
+
+static int lglobalstat(lua_State *L) {
+	struct socket_stat stat;
+	socket_stat(&stat);
+	lua_createtable(L, 0, 3);
+	setinteger(L, "wakeup", stat.wakeup);
+	setinteger(L, "event", stat.event);
+	setinteger(L, "request", stat.request);
+	return 1;
+}
+
 static int lunpack(lua_State *L) {
 	struct socket_message *sm = (struct socket_message *)lua_touserdata(L, 1);
 	luaL_checkinteger(L, 2);
@@ -418,16 +939,28 @@ int luaopen_socket_c(lua_State *L) {
 	};
 	luaL_Reg l2[] = {
 		{"listen", llisten},
+		{"listen_reuseport", llisten_reuseport},
 		{"open", lopen},
 		{"bind", lbind},
 		{"start", lstart},
 		{"close", lclose},
 		{"send", lsend},
+		{"flush", lflush},
+		{"sendfile", lsendfile},
+		{"sendmulti", lsendmulti},
 		{"nodelay", lnodelay},
+		{"pause", lpause},
+		{"resume", lresume},
+		{"redirect", lredirect},
+		{"redirected", lredirected},
 		{"udp", ludp},
 		{"udp_open", ludp_open},
 		{"udp_send", ludp_send},
+		{"udp_sendv", ludp_sendv},
+		{"udp_unpack", ludp_unpack},
 		{"udp_address", ludp_address},
+		{"info", linfo},
+		{"stat", lglobalstat},
 		{"unpack", lunpack},
 		{0, 0},
 	};
@@ -443,5 +976,6 @@ int luaopen_socket_c(lua_State *L) {
 	luaL_setfuncs(L, l1, 1);
 	lua_getfield(L, LUA_REGISTRYINDEX, "handle");
 	luaL_setfuncs(L, l2, 1);
+	slice_metatable(L);
 	return 1;
 }
@@ -0,0 +1,125 @@
+local service = require "service"
+local c = require "service.c"
+
+local pairs = pairs
+local string_pack = string.pack
+local string_unpack = string.unpack
+local string_sub = string.sub
+local table_concat = table.concat
+
+-- client of the key value store service in C (src/kvdb.c), keys and values
+-- are strings
+local kvdb = {}
+
+service.protocol {
+	name = "kv",
+	id = service.proto_kv,
+	pack = function(req) return req end,
+	unpack = service.msgstring,
+}
+
+local db = {}
+db.__index = db
+
+local function request(self, op, ...)
+	local req = { op }
+	for i = 1, select("#", ...) do
+		req[i+1] = string_pack("s4", select(i, ...))
+	end
+	return service.call(self.handle, "kv", table_concat(req))
+end
+
+-- reads n values of a reply into t at the keys, a missing value is nil
+local function values(reply, keys, t)
+	local pos = 1
+	for i = 1, #keys do
+		local sz
+		sz, pos = string_unpack("i4", reply, pos)
+		if sz >= 0 then
+			t[keys[i]] = string_sub(reply, pos, pos + sz - 1)
+			pos = pos + sz
+		end
+	end
+	return t
+end
+
+local function value(reply)
+	local sz = string_unpack("i4", reply)
+	if sz >= 0 then
+		return string_sub(reply, 5, 4 + sz)
+	end
+end
+
+function db:get(key)
+	return value(request(self, "g", key))
+end
+
+-- returns the old value, a nil value deletes the key
+function db:set(key, val)
+	if val == nil then
+		return self:del(key)
+	end
+	return value(request(self, "s", key, val))
+end
+
+function db:del(key)
+	return value(request(self, "d", key))
+end
+
+-- a table of key to value, missing keys are left out
+function db:mget(keys)
+	local req = { "g" }
+	for i = 1, #keys do
+		req[i+1] = string_pack("s4", keys[i])
+	end
+	return values(service.call(self.handle, "kv", table_concat(req)), keys, {})
+end
+
+-- sets all keys of t in one request, it returns once they are in the log
+function db:mset(t)
+	local req = { "m" }
+	for k, v in pairs(t) do
+		req[#req+1] = string_pack("s4s4", k, v)
+	end
+	service.call(self.handle, "kv", table_concat(req))
+end
+
+-- starts a rewrite of the log from the live records
+function db:rewrite()
+	request(self, "r")
+end
+
+function db:info()
+	local keys, live, garbage, log = request(self, "i"):match "(%d+) (%d+) (%d+) (%d+)"
+	return {
+		keys = tonumber(keys),
+		live = tonumber(live),
+		garbage = tonumber(garbage),
+		log = tonumber(log),
+	}
+end
+
+function db:exit()
+	c.exit(self.handle)
+end
+
+-- the client of a store service by handle or name
+function kvdb.open(handle)
+	if type(handle) == "string" then
+		handle = assert(service.query(handle), handle)
+	end
+	return setmetatable({ handle = handle }, db)
+end
+
+-- starts a store service, its data is logged to path and loaded from it on
+-- start. Without a path it's in memory only.
+function kvdb.new(path, name)
+	local handle = c.kvdb(path)
+	assert(handle ~= 0, "kvdb failed to start")
+	if name then
+		service.name(name, handle)
+	end
+	return kvdb.open(handle)
+end
+
+return kvdb
@@ -0,0 +1,267 @@
+local service = require "service"
+local socket = require "socket"
+local c = require "redis.c"
+
+local assert = assert
+local error = error
+local setmetatable = setmetatable
+local coroutine_running = coroutine.running
+local table_unpack = table.unpack
+local string_upper = string.upper
+local pack = c.pack
+local parse = c.parse
+
+local redis = {}
+
+-- One socket to the server. Requests from any number of coroutines are written
+-- as they come and wait in order, the replies of the server come back in that
+-- order. So concurrent requests share one round trip, and the writes of one
+-- dispatch go out together.
+local conn = {}
+conn.__index = conn
+
+local function conn_fail(self, err)
+	local q, head, tail = self.queue, self.head, self.tail
+	local id = self.id
+	self.queue = {}
+	self.head, self.tail = 1, 0
+	self.id = nil
+	if id then
+		socket.close(id)
+	end
+	for i = head, tail do
+		local req = q[i]
+		req.err = err
+		service.wakeup(req.co)
+	end
+end
+
+local function dispatch(self, ok, value)
+	local req = self.queue[self.head]
+	if not req then
+		return false
+	end
+	local n = req.n + 1
+	req.n = n
+	if req.count then
+		req.result[n] = value
+		req.ok[n] = ok
+	else
+		req.result = value
+		req.ok = ok
+	end
+	if n == (req.count or 1) then
+		self.queue[self.head] = nil
+		self.head = self.head + 1
+		service.wakeup(req.co)
+	end
+	return true
+end
+
+local function conn_read(self, id)
+	local buffer, pos = "", 1
+	local need
+	while self.id == id do
+		local data = socket.read(id, need)
+		if not data then
+			break
+		end
+		if pos > #buffer then
+			buffer = data
+		else
+			buffer = buffer:sub(pos) .. data
+		end
+		pos = 1
+		while true do
+			local nextpos, ok, value = parse(buffer, pos)
+			if nextpos == nil then
+				-- the size of a big bulk string is known, wait for all of it
+				need = ok > 1 and ok or nil
+				break
+			end
+			pos = nextpos
+			if not dispatch(self, ok, value) then
+				conn_fail(self, "redis: unexpected reply")
+				return
+			end
+		end
+	end
+	if self.id == id then
+		conn_fail(self, "redis: connection closed")
+	end
+end
+
+local function conn_connect(self)
+	local id = socket.open(self.conf.host or "127.0.0.1", self.conf.port or 6379)
+	if not id then
+		error(string.format("redis: connect %s:%s failed", self.conf.host, self.conf.port))
+	end
+	self.id = id
+	service.fork(conn_read, self, id)
+	local conf = self.conf
+	local ok, err = true
+	if conf.auth then
+		ok, err = self:request(pack("AUTH", conf.auth))
+	end
+	if ok and conf.db and conf.db ~= 0 then
+		ok, err = self:request(pack("SELECT", conf.db))
+	end
+	if not ok then
+		conn_fail(self, err)
+		error(err)
+	end
+end
+
+-- Writes packed commands and waits for count replies, or one when count is nil
+function conn:request(data, count)
+	if not self.id then
+		if self.connecting then
+			local co = coroutine_running()
+			table.insert(self.connecting, co)
+			service.wait(co)
+			if not self.id then
+				error("redis: connect failed", 0)
+			end
+		else
+			self.connecting = {}
+			local ok, err = pcall(conn_connect, self)
+			local waiting = self.connecting
+			self.connecting = nil
+			for _, co in ipairs(waiting) do
+				service.wakeup(co)
+			end
+			if not ok then
+				error(err)
+			end
+		end
+	end
+	local req = {
+		co = coroutine_running(),
+		n = 0,
+		count = count,
+		result = count and {},
+		ok = count and {},
+	}
+	local tail = self.tail + 1
+	self.tail = tail
+	self.queue[tail] = req
+	socket.write(self.id, data)
+	service.wait(req.co)
+	if req.err then
+		error(req.err, 0)
+	end
+	return req.ok, req.result
+end
+
+local function new_conn(conf)
+	return setmetatable({
+		conf = conf,
+		queue = {},
+		head = 1,
+		tail = 0,
+	}, conn)
+end
+
+-- A client keeps conf.pool connections (1 by default), a request takes the one
+-- with the fewest replies to wait for. Requests of one coroutine are answered
+-- in order, across coroutines only on one connection.
+local client = {}
+
+local command = {}
+
+local function client_conn(self)
+	local pool = self.pool
+	local best = pool[1]
+	for i = 2, #pool do
+		local cn = pool[i]
+		if cn.tail - cn.head < best.tail - best.head then
+			best = cn
+		end
+	end
+	return best
+end
+
+local function call(self, ...)
+	local ok, result = client_conn(self):request(pack(...))
+	if not ok then
+		error(result)
+	end
+	return result
+end
+
+-- db:get(key), db:hmset(key, field, value, ...) or any other command, the
+-- reply is returned and an error reply is raised.
+setmetatable(command, { __index = function(t, name)
+	local cmd = string_upper(name)
+	local f = function(self, ...)
+		return call(self, cmd, ...)
+	end
+	t[name] = f
+	return f
+end })
+
+client.__index = command
+
+-- db:pipeline { { "SET", k, v }, { "GET", k }, ... } sends all the commands in
+-- one write, returns the replies in a table and a table of their ok flags.
+-- Error replies don't raise.
+function command:pipeline(cmds)
+	local n = #cmds
+	if n == 0 then
+		return {}, {}
+	end
+	local ok, result = client_conn(self):request(pack(table_unpack(cmds)), n)
+	return result, ok
+end
+
+-- db:mgetmap(keys [, batch]) gets the values of many keys with MGET commands
+-- of batch keys (128 by default) sent together, returns a table of key to value.
+function command:mgetmap(keys, batch)
+	batch = batch or 128
+	local cmds = {}
+	for i = 1, #keys, batch do
+		local cmd = { "MGET" }
+		for j = i, math.min(i + batch - 1, #keys) do
+			cmd[#cmd+1] = keys[j]
+		end
+		cmds[#cmds+1] = cmd
+	end
+	local result, ok = self:pipeline(cmds)
+	local map = {}
+	local k = 0
+	for i = 1, #cmds do
+		if not ok[i] then
+			error(result[i])
+		end
+		local values = result[i]
+		for j = 2, #cmds[i] do
+			k = k + 1
+			local v = values[j - 1]
+			if v ~= nil then
+				map[keys[k]] = v
+			end
+		end
+	end
+	return map
+end
+
+function command:disconnect()
+	for _, cn in ipairs(self.pool) do
+		conn_fail(cn, "redis: disconnected")
+	end
+end
+
+-- conf: host, port, db, auth and pool. The connections are made on first use.
+function redis.connect(conf)
+	local pool = {}
+	for i = 1, conf.pool or 1 do
+		pool[i] = new_conn(conf)
+	end
+	return setmetatable({ pool = pool }, client)
+end
+
+-- RESP encoding and parsing, for a server or a proxy
+redis.pack = pack
+redis.parse = parse
+
+return redis
@@ -26,6 +26,8 @@ local service = {
 	proto_lua = 3,
 	proto_client = 4,
 	proto_debug = 5,
+	proto_text = 6,
+	proto_kv = 7,
 }
 
 function service.log(...)
@@ -47,7 +49,10 @@ service.abort = c.abort
 service.getenv = c.getenv
 service.setenv = c.setenv
 
+-- string copies of socket payloads, which are freed, and of messages, which
+-- the dispatcher frees
 service.string = c.tostring
+service.msgstring = c.msgstring
 service.trash = c.trash
 service.now = c.now
 service.starttime = c.starttime
@@ -514,6 +519,14 @@ service.protocol {
 	dispatch = dispatch_error
 }
 
+-- plain strings, commands to and events from the services written in C
+service.protocol {
+	id = service.proto_text,
+	name = "text",
+	pack = function(text) return text end,
+	unpack = c.msgstring,
+}
+
 function service.req(d, ...)
 	return service.call(d, "lua", ...)
 end
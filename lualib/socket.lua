@@ -122,6 +122,45 @@ socket_handle[6] = function(id, size, data, address)
 	s.callback(str, address)
 end
 
+--udp batch
+local udp_unpack = c.udp_unpack
+socket_handle[8] = function(id, size, data)
+	local s = socket_pool[id]
+	if s == nil or s.callback == nil then
+		service.log("socket: drop udp batch from %d\n", id)
+		service.trash(data)
+		return
+	end
+	local packages = {}
+	local n = 0
+	local offset, str, address = udp_unpack(data, size)
+	while offset do
+		packages[n+1] = str
+		packages[n+2] = address
+		n = n + 2
+		offset, str, address = udp_unpack(data, size, offset)
+	end
+	service.trash(data)
+	local callback = s.callback
+	for i = 1, n, 2 do
+		callback(packages[i], packages[i+1])
+	end
+end
+
+--redirect, what was read but not consumed goes on to the new owner
+socket_handle[9] = function(id)
+	local s = socket_pool[id]
+	if s == nil then
+		c.redirected(id)
+		return
+	end
+	local rest = s.buffer:readall()
+	socket_pool[id] = nil
+	s.valid = false
+	wakeup(s)
+	c.redirected(id, rest)
+end
+
 local function default_warning(id, size)
 	local s = socket_pool[id]
 	local last = s.warningsize or 0
@@ -173,11 +212,18 @@ local function socket_new(id, func)
 	end
 end
 
-function socket.open(addr, port)
-	if port == nil then
+-- "host:port" when no port is given, unless it's a unix socket: a path starting
+-- with "/" or "./", or "@name" in the abstract namespace
+local function split_address(addr, port)
+	if port == nil and not addr:find("^[/@]") and not addr:find("^%./") then
 		addr, port = string.match(addr, "([^:]+):(.+)$")
 		port = tonumber(port)
 	end
+	return addr, port
+end
+
+function socket.open(addr, port)
+	addr, port = split_address(addr, port)
 	local id = c.open(addr, port)
 	return socket_new(id)
 end
@@ -229,13 +275,17 @@ function socket.close(id)
 end
 
 function socket.listen(host, port, backlog)
-	if port == nil then
-		host, port = string.match(host, "([^:]+):(.+)$")
-		port = tonumber(port)
-	end
+	host, port = split_address(host, port)
 	return c.listen(host, port, backlog)
 end
 
+-- one listener of a group sharing host:port, each member is started by its own
+-- service and the kernel balances new connections between them
+function socket.listen_reuseport(host, port)
+	host, port = split_address(host, port)
+	return c.listen_reuseport(host, port)
+end
+
 function socket.read(id, size)
 	local s = socket_pool[id]
 	assert(s)
@@ -257,7 +307,7 @@ function socket.read(id, size)
 			return false, ret
 		end
 	end
-	local ret = s.buffer:pop(size)
+	local ret = s.buffer:pop(size, s.slice)
 	if ret then
 		return ret
 	end
@@ -267,7 +317,7 @@ function socket.read(id, size)
 	assert(not s.need_read)
 	s.need_read = size
 	suspend(s)
-	ret = s.buffer:pop(size)
+	ret = s.buffer:pop(size, s.slice)
 	if ret then
 		return ret
 	else
@@ -293,7 +343,7 @@ function socket.readline(id, sep)
 	sep = sep or "\n"
 	local s = socket_pool[id]
 	assert(s)
-	local ret = s.buffer:readline(sep)
+	local ret = s.buffer:readline(sep, nil, s.slice)
 	if ret then
 		return ret
 	end
@@ -304,7 +354,7 @@ function socket.readline(id, sep)
 	s.need_read = sep
 	suspend(s)
 	if s.valid then
-		return s.buffer:readline(sep)
+		return s.buffer:readline(sep, nil, s.slice)
 	else
 		return false, s.buffer:readall()
 	end
@@ -319,6 +369,15 @@ function socket.limit(id, limit)
 	s.buffer_limit = limit
 end
 
+-- with slice on, read(id, size) and readline return slices of the received
+-- bytes instead of strings: #s, s:byte(i [, j]), s:sub(i [, j]), s:find(str
+-- [, init]) for a plain search, and s:tostring() or tostring(s) to copy it out.
+-- socket.write and sendmulti take a slice as well.
+function socket.slice(id, on)
+	local s = assert(socket_pool[id])
+	s.slice = on ~= false
+end
+
 function socket.lock(id)
 	local s = socket_pool[id]
 	assert(s)
@@ -355,6 +414,16 @@ function socket.abandon(id)
 	socket_pool[id] = nil
 end
 
+-- hand an opened tcp socket to the service handle, the socket is gone here once
+-- its data so far is consumed. With a header of 2 or 4 the stream is split into
+-- packages with a big endian size of that many bytes in front, each one is a
+-- "client" message to handle. Its socket messages go to handle as well.
+function socket.redirect(id, handle, header)
+	local s = socket_pool[id]
+	assert(s and s.buffer)
+	c.redirect(id, handle, header)
+end
+
 function socket.block(id)
 	local s = socket_pool[id]
 	if not s or not s.valid then
@@ -367,6 +436,14 @@ function socket.block(id)
 end
 
 socket.write = assert(c.send)
+-- writes are held until the current message is dispatched, flush sends them now
+socket.flush = assert(c.flush)
+-- sendfile(id, filename [, offset, size]) streams the file from the kernel page
+-- cache, returns the bytes to send or nil and the error
+socket.sendfile = assert(c.sendfile)
+-- sendmulti({ id1, id2, ... }, data) queues one buffer to all the sockets, a
+-- broadcast copies the data once instead of once per socket
+socket.sendmulti = assert(c.sendmulti)
 
 local function udp_new(id, cb)
 	socket_pool[id] = {
@@ -404,7 +481,14 @@ function socket.warning(id, callback)
 end
 
 socket.sendto = assert(c.udp_send)
+socket.sendto_batch = assert(c.udp_sendv)
 socket.udp_address = assert(c.udp_address)
 socket.nodelay = assert(c.nodelay)
+-- stop reading from the peer until resumed, the kernel buffer then pushes back
+socket.pause = assert(c.pause)
+socket.resume = assert(c.resume)
+-- counters of every live socket, and totals of the socket threads
+socket.info = assert(c.info)
+socket.stat = assert(c.stat)
 
 return socket
\ No newline at end of file
@@ -1,17 +1,34 @@
 #include "event.h"
+#include "uring.h"
 
 #include <unistd.h>
 #include <sys/epoll.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 
+// In edge triggered mode EPOLLOUT stays armed, event_mod only changes the read
+// interest there and the caller must drain each fd until EAGAIN.
+// With uring set every call goes to the io_uring poller in uring.c instead.
 struct pollfd {
 	int event_fd;
+	int edge;
+	struct uring *uring;
 };
 
 struct pollfd *
-event_new(void) {
+event_new(int edge, int uring) {
 	struct pollfd *pfd = (struct pollfd *)malloc(sizeof *pfd);
+	pfd->edge = edge;
+	pfd->uring = NULL;
+	if (uring) {
+		pfd->uring = uring_new(edge);
+		if (pfd->uring) {
+			pfd->event_fd = -1;
+			return pfd;
+		}
+		fprintf(stderr, "socketlib io_uring unavailable errno:%d, use epoll.\n", errno);
+	}
 	pfd->event_fd = epoll_create1(0);
 	if (pfd->event_fd == -1) {
 		free(pfd);
@@ -22,14 +39,21 @@ event_new(void) {
 
 void
 event_free(struct pollfd *pfd) {
-	close(pfd->event_fd);
+	if (pfd->uring) {
+		uring_free(pfd->uring);
+	} else {
+		close(pfd->event_fd);
+	}
 	free(pfd);
 }
 
 int
 event_add(struct pollfd *pfd, int fd, void *ud) {
 	struct epoll_event ev;
-	ev.events = EPOLLIN;
+	if (pfd->uring) {
+		return uring_add(pfd->uring, fd, ud);
+	}
+	ev.events = pfd->edge ? (EPOLLIN | EPOLLOUT | EPOLLET) : EPOLLIN;
 	ev.data.ptr = ud;
 	if (epoll_ctl(pfd->event_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
 		return 1;
@@ -39,13 +63,25 @@ event_add(struct pollfd *pfd, int fd, void *ud) {
 
 void
 event_del(struct pollfd *pfd, int fd) {
+	if (pfd->uring) {
+		uring_del(pfd->uring, fd);
+		return;
+	}
 	epoll_ctl(pfd->event_fd, EPOLL_CTL_DEL, fd , 0);
 }
 
 void
-event_write(struct pollfd *pfd, int fd, void *ud, int enable) {
+event_mod(struct pollfd *pfd, int fd, void *ud, int read, int write) {
 	struct epoll_event ev;
-	ev.events = EPOLLIN | (enable ? EPOLLOUT : 0);
+	if (pfd->uring) {
+		uring_mod(pfd->uring, fd, ud, read, write);
+		return;
+	}
+	if (pfd->edge) {
+		ev.events = (read ? EPOLLIN : 0) | EPOLLOUT | EPOLLET;
+	} else {
+		ev.events = (read ? EPOLLIN : 0) | (write ? EPOLLOUT : 0);
+	}
 	ev.data.ptr = ud;
 	epoll_ctl(pfd->event_fd, EPOLL_CTL_MOD, fd, &ev);
 }
@@ -54,12 +90,35 @@ int
 event_wait(struct pollfd *pfd, struct event *e, int maxev) {
 	struct epoll_event ev[maxev];
 	int i, n;
+	if (pfd->uring) {
+		return uring_wait(pfd->uring, e, maxev);
+	}
 	n = epoll_wait(pfd->event_fd, ev, maxev, -1);
 	for (i = 0; i < n; i++) {
 		unsigned flag = ev[i].events;
+		e[i].type = EVENT_POLL;
 		e[i].ud = ev[i].data.ptr;
 		e[i].write = (flag & EPOLLOUT) != 0;
 		e[i].read = (flag & EPOLLIN) != 0;
+		if (!e[i].read && !e[i].write && (flag & (EPOLLERR | EPOLLHUP))) {
+			// a socket with reading paused, let the owner find the error
+			e[i].read = 1;
+		}
 	}
 	return n;
 }
+
+int
+event_accept(struct pollfd *pfd, int fd) {
+	return pfd->uring ? uring_accept(pfd->uring, fd) : -1;
+}
+
+int
+event_recv(struct pollfd *pfd, int fd) {
+	return pfd->uring ? uring_recv(pfd->uring, fd) : -1;
+}
+
+int
+event_send(struct pollfd *pfd, int fd, void *ud, const struct iovec *iov, int n) {
+	return pfd->uring ? uring_send(pfd->uring, fd, ud, iov, n) : -1;
+}
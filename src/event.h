@@ -1,18 +1,36 @@
 #ifndef _event_h_
 #define _event_h_
 
+#define EVENT_POLL 0
+#define EVENT_ACCEPT 1	// res is the accepted fd or -errno
+#define EVENT_RECV 2	// res bytes are in data, 0 at eof or -errno
+#define EVENT_SEND 3	// res bytes of an event_send went out, or -errno
+
 struct event {
+	int type;
 	int read;
 	int write;
 	void *ud;
+	int res;
+	char *data;	// valid until the next event_wait
 };
 
 struct pollfd;
-struct pollfd *event_new(void);
+struct iovec;
+struct pollfd *event_new(int edge, int uring);
 void event_free(struct pollfd *pfd);
 int event_add(struct pollfd *pfd, int fd, void *ud);
 void event_del(struct pollfd *pfd, int fd);
-void event_write(struct pollfd *pfd, int fd, void *ud, int enable);
+void event_mod(struct pollfd *pfd, int fd, void *ud, int read, int write);
 int event_wait(struct pollfd *pfd, struct event *e, int maxev);
+// io_uring only: accept from a listen fd or receive from a stream fd in the
+// kernel, the fd gets completions instead of read events. -1 with epoll.
+int event_accept(struct pollfd *pfd, int fd);
+int event_recv(struct pollfd *pfd, int fd);
+// io_uring only: send iov in the kernel with the next wait, one send per fd at a
+// time. The data must stay until the EVENT_SEND for ud, it comes even after
+// event_del, as -ECANCELED if nothing went out. n 0 only tells if sends go
+// through the ring.
+int event_send(struct pollfd *pfd, int fd, void *ud, const struct iovec *iov, int n);
 
 #endif // _event_h_
@@ -0,0 +1,643 @@
+#include "service.h"
+#include "socket.h"
+#include "hash.h"
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// The client gate as a C service. Clients send packages prefixed by a 2 byte
+// big endian size. The first package of a connection is the handshake
+//	base64(uid)@base64(server)#base64(subid):index:base64(hmac)
+// answered with "200 OK" or an error code, every later package goes to the
+// agent of the user as a SERVICE_PROTO_CLIENT message without entering lua.
+// The controller service (lualib/gate.lua) drives the gate with text commands
+//	login username hexsecret agent
+//	logout username
+//	kick username
+// and is told "auth username id address" and "afk username" back.
+// In redirect mode the socket itself goes to the agent after the handshake, the
+// socket thread splits the packages then. The gate forgets the connection once
+// it's handed over and only closes the socket on kick, logout or a reconnect if
+// the agent still owns it, the agent alone hears of the client going away.
+
+#define GATE_HASH 1024
+#define GATE_MAX_HANDSHAKE 512
+
+struct gate_conn;
+
+struct gate_user {
+	struct gate_conn *conn;
+	int socket;	// handed to the agent in redirect mode, -1 if none
+	uint32_t agent;
+	long version;
+	uint8_t secret[8];
+	char name[1];
+};
+
+struct gate_conn {
+	struct gate_conn *next;
+	struct gate_user *user;
+	int id;
+	int header;	// first byte of a size split between two reads, -1 if none
+	int size;	// the package being read in buffer
+	int read;
+	int redirect;	// handed to the agent, buffer keeps what is read meanwhile
+	char *buffer;
+	char addr[64];
+};
+
+struct gate {
+	uint32_t handle;
+	uint32_t controller;
+	int listen;
+	int maxclient;
+	int client_n;
+	int nodelay;
+	int redirect;
+	struct gate_conn *conn[GATE_HASH];
+	struct hash *user;	// name to gate_user
+};
+
+static inline struct gate_user *
+gate_user(struct gate *g, const char *name) {
+	return (struct gate_user *)hash_get(g->user, name, (int)strlen(name));
+}
+
+static struct gate_conn **
+gate_conn_slot(struct gate *g, int id) {
+	struct gate_conn **p = &g->conn[(unsigned)id % GATE_HASH];
+	while (*p && (*p)->id != id) {
+		p = &(*p)->next;
+	}
+	return p;
+}
+
+static void
+gate_notify(struct gate *g, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+static void
+gate_notify(struct gate *g, const char *fmt, ...) {
+	struct message m;
+	va_list ap;
+	int size;
+	va_start(ap, fmt);
+	size = vsnprintf(0, 0, fmt, ap);
+	va_end(ap);
+	m.data = service_alloc(0, size + 1);
+	va_start(ap, fmt);
+	vsnprintf((char *)m.data, size + 1, fmt, ap);
+	va_end(ap);
+	m.size = size;
+	m.source = g->handle;
+	m.session = 0;
+	m.proto = SERVICE_PROTO_TEXT;
+	if (service_send(g->controller, &m) == -1) {
+		service_alloc(m.data, 0);
+	}
+}
+
+static void
+gate_conn_free(struct gate *g, struct gate_conn *c) {
+	struct gate_conn **p = gate_conn_slot(g, c->id);
+	*p = c->next;
+	if (c->user) {
+		c->user->conn = 0;
+		gate_notify(g, "afk %s", c->user->name);
+	}
+	service_alloc(c->buffer, 0);
+	service_alloc(c, 0);
+	g->client_n--;
+}
+
+// The close message that follows finds no connection and is ignored.
+static void
+gate_close(struct gate *g, struct gate_conn *c) {
+	socket_close(c->id, (void *)(uintptr_t)g->handle);
+	gate_conn_free(g, c);
+}
+
+// The agent owns a redirected socket, it gets the close message. The agent may
+// have closed or handed it on already, the id is stale then. Returns 0 if the
+// user has no socket left.
+static int
+gate_close_redirected(struct gate_user *u) {
+	void *agent = (void *)(uintptr_t)u->agent;
+	int id = u->socket;
+	if (id < 0) {
+		return 0;
+	}
+	u->socket = -1;
+	if (!socket_owned(id, agent)) {
+		return 0;
+	}
+	socket_close(id, agent);
+	return 1;
+}
+
+static void
+gate_reply(struct gate_conn *c, const char *text) {
+	int n = (int)strlen(text);
+	uint8_t *p = service_alloc(0, n + 2);
+	p[0] = (n >> 8) & 0xff;
+	p[1] = n & 0xff;
+	memcpy(p + 2, text, n);
+	socket_send(c->id, p, n + 2, SOCKET_PRIORITY_HIGH);
+}
+
+// hmac_hash of luaclib/lcrypt.c, the handshake must match crypt.hmac_hash.
+static void
+gate_hashkey(const char *str, int sz, uint32_t key[2]) {
+	uint32_t djb_hash = 5381L;
+	uint32_t js_hash = 1315423911L;
+	int i;
+	for (i = 0; i < sz; i++) {
+		uint8_t c = (uint8_t)str[i];
+		djb_hash += (djb_hash << 5) + c;
+		js_hash ^= ((js_hash << 5) + c + (js_hash >> 2));
+	}
+	key[0] = djb_hash;
+	key[1] = js_hash;
+}
+
+#define LEFTROTATE(x, c) (((x) << (c)) | ((x) >> (32 - (c))))
+
+static void
+gate_hmac(const uint32_t x[2], const uint32_t y[2], uint32_t result[2]) {
+	static const uint32_t k[64] = {
+		0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+		0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+		0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+		0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+		0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+		0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+		0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+		0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391 };
+	static const uint32_t r[64] = {
+		7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+		5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20,
+		4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+		6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21 };
+	uint32_t w[16];
+	uint32_t a, b, c, d, f, g, temp;
+	int i;
+	a = 0x67452301u;
+	b = 0xefcdab89u;
+	c = 0x98badcfeu;
+	d = 0x10325476u;
+	for (i = 0; i < 16; i += 4) {
+		w[i] = x[1];
+		w[i+1] = x[0];
+		w[i+2] = y[1];
+		w[i+3] = y[0];
+	}
+	for (i = 0; i < 64; i++) {
+		if (i < 16) {
+			f = (b & c) | ((~b) & d);
+			g = i;
+		} else if (i < 32) {
+			f = (d & b) | ((~d) & c);
+			g = (5*i + 1) % 16;
+		} else if (i < 48) {
+			f = b ^ c ^ d;
+			g = (3*i + 5) % 16;
+		} else {
+			f = c ^ (b | (~d));
+			g = (7*i) % 16;
+		}
+		temp = d;
+		d = c;
+		c = b;
+		b = b + LEFTROTATE((a + f + k[i] + w[g]), r[i]);
+		a = temp;
+	}
+	result[0] = c^d;
+	result[1] = a^b;
+}
+
+static int
+gate_b64index(uint8_t c) {
+	if (c >= 'A' && c <= 'Z') return c - 'A';
+	if (c >= 'a' && c <= 'z') return c - 'a' + 26;
+	if (c >= '0' && c <= '9') return c - '0' + 52;
+	if (c == '+') return 62;
+	if (c == '/') return 63;
+	return -1;
+}
+
+// Decodes exactly 8 bytes, trailing '=' padding is optional.
+static int
+gate_b64decode8(const char *text, int sz, uint8_t out[8]) {
+	uint32_t v = 0;
+	int i, bits = 0, n = 0;
+	for (i = 0; i < sz && text[i] != '='; i++) {
+		int c = gate_b64index((uint8_t)text[i]);
+		if (c < 0) {
+			return -1;
+		}
+		v = v << 6 | c;
+		bits += 6;
+		if (bits >= 8) {
+			bits -= 8;
+			if (n == 8) {
+				return -1;
+			}
+			out[n++] = (v >> bits) & 0xff;
+		}
+	}
+	return n == 8 ? 0 : -1;
+}
+
+static const char *
+gate_auth(struct gate *g, struct gate_conn *c, const char *msg, int sz) {
+	char tmp[GATE_MAX_HANDSHAKE];
+	struct gate_user *u;
+	char *index, *hmac, *end;
+	long idx;
+	uint8_t h[8];
+	uint32_t text[2], key[2], v[2];
+	if (sz >= GATE_MAX_HANDSHAKE) {
+		return "400 Bad Request";
+	}
+	memcpy(tmp, msg, sz);
+	tmp[sz] = 0;
+	index = strchr(tmp, ':');
+	if (index == 0 || (hmac = strchr(index + 1, ':')) == 0) {
+		return "400 Bad Request";
+	}
+	*index++ = 0;
+	u = gate_user(g, tmp);
+	if (u == 0) {
+		return "404 User Not Found";
+	}
+	idx = strtol(index, &end, 10);
+	if (end != hmac || gate_b64decode8(hmac + 1, (int)strlen(hmac + 1), h)) {
+		return "400 Bad Request";
+	}
+	if (idx <= u->version) {
+		return "403 Index Expired";
+	}
+	// the signed text is "username:index", as sent
+	gate_hashkey(msg, (int)(hmac - tmp), text);
+	key[0] = u->secret[0] | u->secret[1] << 8 | u->secret[2] << 16 | (uint32_t)u->secret[3] << 24;
+	key[1] = u->secret[4] | u->secret[5] << 8 | u->secret[6] << 16 | (uint32_t)u->secret[7] << 24;
+	gate_hmac(text, key, v);
+	if (v[0] != (h[0] | h[1] << 8 | h[2] << 16 | (uint32_t)h[3] << 24)
+		|| v[1] != (h[4] | h[5] << 8 | h[6] << 16 | (uint32_t)h[7] << 24)) {
+		return "401 Unauthorized";
+	}
+	u->version = idx;
+	if (u->conn) {
+		// a reconnect replaces the connection left behind
+		struct gate_conn *old = u->conn;
+		old->user = 0;
+		u->conn = 0;
+		gate_close(g, old);
+	}
+	gate_close_redirected(u);
+	u->conn = c;
+	c->user = u;
+	return 0;
+}
+
+// data belongs to the gate when own is set, returns -1 if the connection is gone.
+static int
+gate_package(struct gate *g, struct gate_conn *c, char *data, int size, int own) {
+	struct message m;
+	if (c->user == 0) {
+		const char *err = gate_auth(g, c, data, size);
+		if (own) {
+			service_alloc(data, 0);
+		}
+		gate_reply(c, err ? err : "200 OK");
+		if (err) {
+			gate_close(g, c);
+			return -1;
+		}
+		gate_notify(g, "auth %s %d %s", c->user->name, c->id, c->addr);
+		if (g->redirect) {
+			c->redirect = 1;
+			c->size = 0;
+			c->read = 0;
+			socket_redirect(c->id, (void *)(uintptr_t)c->user->agent, 2);
+		}
+		return 0;
+	}
+	if (!own) {
+		char *p = service_alloc(0, size);
+		memcpy(p, data, size);
+		data = p;
+	}
+	m.source = g->handle;
+	m.session = 0;
+	m.proto = SERVICE_PROTO_CLIENT;
+	m.data = data;
+	m.size = size;
+	if (service_send(c->user->agent, &m) == -1) {
+		service_alloc(data, 0);
+	}
+	return 0;
+}
+
+// Keep what follows the handshake until the socket thread takes it back.
+static void
+gate_hold(struct gate_conn *c, const uint8_t *data, int size) {
+	if (c->read + size > c->size) {
+		int cap = c->size ? c->size : 256;
+		char *p;
+		while (cap < c->read + size) {
+			cap *= 2;
+		}
+		p = service_alloc(0, cap);
+		if (c->read > 0) {
+			memcpy(p, c->buffer, c->read);
+		}
+		service_alloc(c->buffer, 0);
+		c->buffer = p;
+		c->size = cap;
+	}
+	memcpy(c->buffer + c->read, data, size);
+	c->read += size;
+}
+
+// Split the stream into packages, a package read whole is forwarded from the
+// receive buffer, a split one is assembled in c->buffer.
+static void
+gate_data(struct gate *g, struct gate_conn *c, const uint8_t *data, int size) {
+	while (size > 0) {
+		int n;
+		if (c->redirect) {
+			gate_hold(c, data, size);
+			return;
+		}
+		if (c->buffer == 0) {
+			int len;
+			if (c->header >= 0) {
+				len = c->header << 8 | data[0];
+				c->header = -1;
+				data++;
+				size--;
+			} else if (size == 1) {
+				c->header = data[0];
+				return;
+			} else {
+				len = data[0] << 8 | data[1];
+				data += 2;
+				size -= 2;
+			}
+			if (size >= len) {
+				if (gate_package(g, c, (char *)data, len, 0)) {
+					return;
+				}
+				data += len;
+				size -= len;
+				continue;
+			}
+			c->buffer = service_alloc(0, len);
+			c->size = len;
+			c->read = 0;
+		}
+		n = c->size - c->read;
+		if (n > size) {
+			n = size;
+		}
+		memcpy(c->buffer + c->read, data, n);
+		c->read += n;
+		data += n;
+		size -= n;
+		if (c->read == c->size) {
+			char *buffer = c->buffer;
+			c->buffer = 0;
+			if (gate_package(g, c, buffer, c->size, 1)) {
+				return;
+			}
+		}
+	}
+}
+
+static void
+gate_accept(struct gate *g, int id, const char *addr) {
+	struct gate_conn *c;
+	if (g->client_n >= g->maxclient) {
+		socket_close(id, (void *)(uintptr_t)g->handle);
+		return;
+	}
+	c = service_alloc(0, sizeof(*c));
+	memset(c, 0, sizeof(*c));
+	c->id = id;
+	c->header = -1;
+	snprintf(c->addr, sizeof(c->addr), "%s", addr ? addr : "");
+	c->next = g->conn[(unsigned)id % GATE_HASH];
+	g->conn[(unsigned)id % GATE_HASH] = c;
+	g->client_n++;
+	socket_start(id, (void *)(uintptr_t)g->handle);
+	if (g->nodelay) {
+		socket_nodelay(id);
+	}
+}
+
+static void
+gate_socket(struct gate *g, struct socket_message *sm) {
+	struct gate_conn *c;
+	switch (sm->type) {
+	case SOCKET_DATA:
+		c = *gate_conn_slot(g, sm->id);
+		if (c) {
+			gate_data(g, c, (const uint8_t *)sm->data, sm->size);
+		}
+		service_alloc(sm->data, 0);
+		break;
+	case SOCKET_ACCEPT:
+		gate_accept(g, sm->size, sm->data);
+		break;
+	case SOCKET_REDIRECT:
+		c = *gate_conn_slot(g, sm->id);
+		if (c) {
+			socket_redirected(sm->id, c->buffer, c->read);
+			service_alloc(c->buffer, 0);
+			c->buffer = 0;
+			c->read = 0;
+			// the socket is the agent's now, it no longer counts for maxclient
+			if (c->user) {
+				c->user->socket = sm->id;
+				c->user->conn = 0;
+				c->user = 0;
+			}
+			gate_conn_free(g, c);
+		} else {
+			socket_redirected(sm->id, 0, 0);
+		}
+		break;
+	case SOCKET_CLOSE:
+	case SOCKET_ERR:
+		if (sm->id == g->listen) {
+			service_log(g->handle, "gate listen socket closed\n");
+			g->listen = -1;
+			break;
+		}
+		c = *gate_conn_slot(g, sm->id);
+		if (c) {
+			gate_conn_free(g, c);
+		}
+		break;
+	case SOCKET_WARNING:
+		service_log(g->handle, "%d K bytes send blocked on %d\n", sm->size, sm->id);
+		break;
+	}
+}
+
+static void
+gate_login(struct gate *g, const char *name, const char *hex, uint32_t agent) {
+	struct gate_user *u = gate_user(g, name);
+	int i;
+	if (strlen(hex) != 16) {
+		service_log(g->handle, "gate login %s invalid secret\n", name);
+		return;
+	}
+	if (u == 0) {
+		size_t sz = strlen(name);
+		u = service_alloc(0, sizeof(*u) + sz);
+		memset(u, 0, sizeof(*u));
+		memcpy(u->name, name, sz + 1);
+		u->socket = -1;
+		hash_set(g->user, name, (int)sz, u);
+	}
+	u->agent = agent;
+	u->version = 0;
+	for (i = 0; i < 8; i++) {
+		unsigned v;
+		sscanf(hex + i * 2, "%2x", &v);
+		u->secret[i] = (uint8_t)v;
+	}
+}
+
+static void
+gate_logout(struct gate *g, const char *name, int kick) {
+	struct gate_user *u = gate_user(g, name);
+	if (u == 0) {
+		return;
+	}
+	if (kick) {
+		// the user stays, the controller is told it went afk
+		if (u->conn) {
+			gate_close(g, u->conn);
+		} else if (gate_close_redirected(u)) {
+			gate_notify(g, "afk %s", u->name);
+		}
+		return;
+	}
+	if (u->conn) {
+		u->conn->user = 0;
+		gate_close(g, u->conn);
+	}
+	gate_close_redirected(u);
+	hash_remove(g->user, name, (int)strlen(name));
+	service_alloc(u, 0);
+}
+
+static void
+gate_command(struct gate *g, const char *msg, int sz) {
+	char cmd[16], name[256], hex[32];
+	char tmp[GATE_MAX_HANDSHAKE];
+	uint32_t agent;
+	if (sz >= GATE_MAX_HANDSHAKE) {
+		service_log(g->handle, "gate command too long\n");
+		return;
+	}
+	memcpy(tmp, msg, sz);
+	tmp[sz] = 0;
+	if (sscanf(tmp, "%15s %255s", cmd, name) != 2) {
+		service_log(g->handle, "gate invalid command %s\n", tmp);
+	} else if (strcmp(cmd, "login") == 0 && sscanf(tmp, "%*s %*s %31s %u", hex, &agent) == 2) {
+		gate_login(g, name, hex, agent);
+	} else if (strcmp(cmd, "logout") == 0) {
+		gate_logout(g, name, 0);
+	} else if (strcmp(cmd, "kick") == 0) {
+		gate_logout(g, name, 1);
+	} else {
+		service_log(g->handle, "gate invalid command %s\n", tmp);
+	}
+}
+
+static int
+gate_dispatch(uint32_t handle, void *ud, const struct message *m) {
+	struct gate *g = (struct gate *)ud;
+	switch (m->proto) {
+	case SERVICE_PROTO_SOCKET:
+		gate_socket(g, (struct socket_message *)m->data);
+		break;
+	case SERVICE_PROTO_TEXT:
+		gate_command(g, (const char *)m->data, m->size);
+		break;
+	}
+	return 0;
+}
+
+// param: controller address port maxclient nodelay reuseport [redirect]
+static void *
+gate_create(uint32_t handle, const char *param) {
+	struct gate *g;
+	char address[128];
+	unsigned controller;
+	int port, maxclient, nodelay, reuseport, redirect = 0;
+	if (param == 0 || sscanf(param, "%u %127s %d %d %d %d %d", &controller, address, &port, &maxclient, &nodelay, &reuseport, &redirect) < 6) {
+		service_log(handle, "gate invalid param %s\n", param ? param : "");
+		return 0;
+	}
+	g = service_alloc(0, sizeof(*g));
+	memset(g, 0, sizeof(*g));
+	g->handle = handle;
+	g->controller = controller;
+	g->maxclient = maxclient;
+	g->nodelay = nodelay;
+	g->redirect = redirect;
+	g->user = hash_new(0);
+	if (reuseport) {
+		g->listen = socket_listen_reuseport(address, port, (void *)(uintptr_t)handle);
+	} else {
+		g->listen = socket_listen(address, port, (void *)(uintptr_t)handle);
+	}
+	if (g->listen < 0) {
+		service_log(handle, "gate listen at %s:%d failed\n", address, port);
+		hash_free(g->user);
+		service_alloc(g, 0);
+		return 0;
+	}
+	socket_start(g->listen, (void *)(uintptr_t)handle);
+	return g;
+}
+
+static void
+gate_release(uint32_t handle, void *ud) {
+	struct gate *g = (struct gate *)ud;
+	const char *name;
+	int i, sz;
+	void *u;
+	if (g->listen >= 0) {
+		socket_close(g->listen, (void *)(uintptr_t)handle);
+	}
+	for (i = 0; i < GATE_HASH; i++) {
+		struct gate_conn *c = g->conn[i];
+		while (c) {
+			struct gate_conn *next = c->next;
+			socket_close(c->id, (void *)(uintptr_t)handle);
+			service_alloc(c->buffer, 0);
+			service_alloc(c, 0);
+			c = next;
+		}
+	}
+	i = 0;
+	while ((i = hash_next(g->user, i, &name, &sz, &u)) >= 0) {
+		service_alloc(u, 0);
+	}
+	hash_free(g->user);
+	service_alloc(g, 0);
+}
+
+struct module gate_mod = {
+	gate_dispatch,
+	gate_create,
+	gate_release,
+};
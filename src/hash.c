@@ -1,133 +1,277 @@
-#include <stdio.h>
+#include "hash.h"
+
 #include <stdlib.h>
-#include <ctype.h>
+#include <string.h>
+
+// Robin Hood open addressing: a key sits at most as far from its home slot
+// as the keys it passed, so a lookup stops at the first slot closer to home
+// than the distance probed. Removal shifts the following keys back, there
+// are no tombstones.
 
-static unsigned long _crypt_table[0x500];
-static char _ctypt_init = 0;
-static const unsigned long HASH_OFF = 0, HASH_A = 1, HASH_B = 2;
+#define HASH_MINCAP 8
 
 struct hash_node {
-	long hasha;
-	long hashb;
-	char exist;
+	uint64_t hash;
+	char *key;
+	void *value;
+	int size;
+	int dist;	// 0 for an empty slot, else 1 + the distance from home
 };
 
 struct hash {
 	int mask;
 	int size;
+	uint64_t seed;
 	struct hash_node *node;
 };
 
+// wyhash, final version 4
+
+static const uint64_t _wyp[4] = {
+	0xa0761d6478bd642full, 0xe7037ed1a0b428dbull, 0x8ebc6af09c88c6e3ull, 0x589965cc75374cc3ull,
+};
+
+static inline void
+_wymum(uint64_t *a, uint64_t *b) {
+	__uint128_t r = *a;
+	r *= *b;
+	*a = (uint64_t)r;
+	*b = (uint64_t)(r >> 64);
+}
+
+static inline uint64_t
+_wymix(uint64_t a, uint64_t b) {
+	_wymum(&a, &b);
+	return a ^ b;
+}
+
+static inline uint64_t
+_wyr8(const uint8_t *p) {
+	uint64_t v;
+	memcpy(&v, p, 8);
+	return v;
+}
+
+static inline uint64_t
+_wyr4(const uint8_t *p) {
+	uint32_t v;
+	memcpy(&v, p, 4);
+	return v;
+}
+
+static inline uint64_t
+_wyr3(const uint8_t *p, size_t k) {
+	return (((uint64_t)p[0]) << 16) | (((uint64_t)p[k >> 1]) << 8) | p[k - 1];
+}
+
+uint64_t
+hash_string(const char *key, int size, uint64_t seed) {
+	const uint8_t *p = (const uint8_t *)key;
+	size_t len = (size_t)size;
+	uint64_t a, b;
+	seed ^= _wymix(seed ^ _wyp[0], _wyp[1]);
+	if (len <= 16) {
+		if (len >= 4) {
+			a = (_wyr4(p) << 32) | _wyr4(p + ((len >> 3) << 2));
+			b = (_wyr4(p + len - 4) << 32) | _wyr4(p + len - 4 - ((len >> 3) << 2));
+		} else if (len > 0) {
+			a = _wyr3(p, len);
+			b = 0;
+		} else {
+			a = b = 0;
+		}
+	} else {
+		size_t i = len;
+		if (i > 48) {
+			uint64_t see1 = seed, see2 = seed;
+			do {
+				seed = _wymix(_wyr8(p) ^ _wyp[1], _wyr8(p + 8) ^ seed);
+				see1 = _wymix(_wyr8(p + 16) ^ _wyp[2], _wyr8(p + 24) ^ see1);
+				see2 = _wymix(_wyr8(p + 32) ^ _wyp[3], _wyr8(p + 40) ^ see2);
+				p += 48;
+				i -= 48;
+			} while (i > 48);
+			seed ^= see1 ^ see2;
+		}
+		while (i > 16) {
+			seed = _wymix(_wyr8(p) ^ _wyp[1], _wyr8(p + 8) ^ seed);
+			i -= 16;
+			p += 16;
+		}
+		a = _wyr8(p + i - 16);
+		b = _wyr8(p + i - 8);
+	}
+	a ^= _wyp[1];
+	b ^= seed;
+	_wymum(&a, &b);
+	return _wymix(a ^ _wyp[0] ^ len, b ^ _wyp[1]);
+}
+
+static int
+_find(struct hash *h, uint64_t hash, const char *key, int size) {
+	int i = (int)(hash & h->mask);
+	int dist = 1;
+	for (;;) {
+		struct hash_node *n = &h->node[i];
+		if (n->dist < dist) {
+			return -1;
+		}
+		if (n->hash == hash && n->size == size && memcmp(n->key, key, size) == 0) {
+			return i;
+		}
+		i = (i + 1) & h->mask;
+		++dist;
+	}
+}
+
+// places a key known to be absent, richer keys on the way give up their slot
 static void
-_crypt_table_init(void) {
-	unsigned long seed = 0x00100001, idx1 = 0, idx2 = 0, i;
-	for (idx1 = 0; idx1 < 0x100; idx1++) {
-		for (idx2 = idx1, i = 0; i < 5; i++, idx2 += 0x100) {
-			unsigned long tmp1, tmp2;
-			seed = (seed * 125 + 3) % 0x2AAAAB;
-			tmp1 = (seed & 0xFFFF) << 0x10;
-			seed = (seed * 125 + 3) % 0x2AAAAB;
-			tmp2 = (seed & 0xFFFF);
-			_crypt_table[idx2] = (tmp1 | tmp2);
+_place(struct hash *h, struct hash_node node) {
+	int i = (int)(node.hash & h->mask);
+	node.dist = 1;
+	for (;;) {
+		struct hash_node *n = &h->node[i];
+		if (n->dist == 0) {
+			*n = node;
+			return;
+		}
+		if (n->dist < node.dist) {
+			struct hash_node tmp = *n;
+			*n = node;
+			node = tmp;
 		}
+		i = (i + 1) & h->mask;
+		++node.dist;
 	}
 }
 
-static unsigned long
-_hash_string(const char *key, int size, unsigned long type) {
-	unsigned long seed1 = 0x7FED7FED, seed2 = 0xEEEEEEEE;
-	int i = 0;
-	while (i < size) {
-		int ch = toupper(*(key + i++));
-		seed1 = _crypt_table[(type << 8) + ch] ^ (seed1 + seed2);
-		seed2 = ch + seed1 + seed2 + (seed2 << 5) + 3;
+static int
+_resize(struct hash *h, int cap) {
+	struct hash_node *old = h->node;
+	int n = h->mask + 1;
+	int i;
+	h->node = calloc(cap, sizeof(struct hash_node));
+	if (!h->node) {
+		h->node = old;
+		return -1;
+	}
+	h->mask = cap - 1;
+	for (i = 0; i < n; i++) {
+		if (old[i].dist) {
+			_place(h, old[i]);
+		}
 	}
-	return seed1;
+	free(old);
+	return 0;
 }
 
 struct hash *
 hash_new(int cap) {
 	struct hash *h;
-	int i;
+	int n = HASH_MINCAP;
+	while (n < cap) {
+		n *= 2;
+	}
 	h = malloc(sizeof(struct hash));
 	if (!h) return 0;
-	if (cap == 0) {
-		cap = 16;
-	}
-	h->mask = cap - 1;
+	h->mask = n - 1;
 	h->size = 0;
-	h->node = malloc(cap * sizeof(struct hash_node));
+	// differs from table to table, colliding keys can't be made up ahead
+	h->seed = (uint64_t)(uintptr_t)h ^ _wyp[3];
+	h->node = calloc(n, sizeof(struct hash_node));
 	if (!h->node) {
 		free(h);
 		return 0;
 	}
-	for (i = 0; i < cap; i++) {
-		h->node[i].hasha = -1;
-		h->node[i].hashb = -1;
-		h->node[i].exist = 0;
-	}
-	if (_ctypt_init == 0) {
-		_crypt_table_init();
-		_ctypt_init = 1;
-	}
 	return h;
 }
 
 void
 hash_free(struct hash *h) {
+	int i;
+	for (i = 0; i <= h->mask; i++) {
+		if (h->node[i].dist) {
+			free(h->node[i].key);
+		}
+	}
 	free(h->node);
 	free(h);
 }
 
-int
-hash_insert(struct hash *h, const char *key, int size) {
-	unsigned long hash = _hash_string(key, size, HASH_OFF);
-	unsigned long hasha = _hash_string(key, size, HASH_A);
-	unsigned long hashb = _hash_string(key, size, HASH_B);
-	int hash_start = hash % h->mask;
-	int npos = hash_start;
-	while (h->node[npos].exist == 1) {
-		if (h->node[npos].hasha == hasha && h->node[npos].hashb == hashb) {
-			return -1;
-		}
-		npos = (npos + 1) % h->mask;
-		if (npos == hash_start) {
-			return -1;
+void *
+hash_set(struct hash *h, const char *key, int size, void *value) {
+	uint64_t hash = hash_string(key, size, h->seed);
+	int i = _find(h, hash, key, size);
+	struct hash_node node;
+	if (i >= 0) {
+		void *old = h->node[i].value;
+		h->node[i].value = value;
+		return old;
+	}
+	// grows at 7/8 full
+	if (h->size + 1 > (h->mask + 1) - ((h->mask + 1) >> 3)) {
+		if (_resize(h, (h->mask + 1) * 2)) {
+			return 0;
 		}
 	}
-	h->node[npos].exist = 1;
-	h->node[npos].hasha = hasha;
-	h->node[npos].hashb = hashb;
+	node.hash = hash;
+	node.key = malloc(size > 0 ? size : 1);
+	if (!node.key) {
+		return 0;
+	}
+	memcpy(node.key, key, size);
+	node.value = value;
+	node.size = size;
+	_place(h, node);
 	++h->size;
-	return npos;
+	return 0;
+}
+
+void *
+hash_get(struct hash *h, const char *key, int size) {
+	int i = _find(h, hash_string(key, size, h->seed), key, size);
+	return i >= 0 ? h->node[i].value : 0;
 }
 
 int
 hash_exist(struct hash *h, const char *key, int size) {
-	unsigned long hash = _hash_string(key, size, HASH_OFF);
-	unsigned long hasha = _hash_string(key, size, HASH_A);
-	unsigned long hashb = _hash_string(key, size, HASH_B);
-	int hash_start = hash & h->mask;
-	int npos = hash_start;
-	while (1) {
-		if (h->node[npos].hasha == hasha && h->node[npos].hashb == hashb) {
-			return npos;
-		} else {
-			npos = (npos + 1) & h->mask;
-		}
-		if (npos == hash_start) {
-			break;
-		}
-	}
-	return -1;
+	return _find(h, hash_string(key, size, h->seed), key, size) >= 0;
 }
 
-void
-hash_remove(struct hash *h, int pos) {
-	h->node[pos].exist = 0;
-	h->node[pos].hasha = -1;
-	h->node[pos].hashb = -1;
+void *
+hash_remove(struct hash *h, const char *key, int size) {
+	int i = _find(h, hash_string(key, size, h->seed), key, size);
+	int j;
+	void *value;
+	if (i < 0) {
+		return 0;
+	}
+	value = h->node[i].value;
+	free(h->node[i].key);
+	j = (i + 1) & h->mask;
+	while (h->node[j].dist > 1) {
+		h->node[i] = h->node[j];
+		--h->node[i].dist;
+		i = j;
+		j = (j + 1) & h->mask;
+	}
+	h->node[i].dist = 0;
 	--h->size;
+	return value;
+}
+
+int
+hash_next(struct hash *h, int pos, const char **key, int *size, void **value) {
+	for (; pos <= h->mask; pos++) {
+		struct hash_node *n = &h->node[pos];
+		if (n->dist) {
+			*key = n->key;
+			*size = n->size;
+			*value = n->value;
+			return pos + 1;
+		}
+	}
+	return -1;
 }
 
 int
@@ -1,13 +1,23 @@
 #ifndef _hash_h_
 #define _hash_h_
 
+#include <stdint.h>
+
+// A map of byte string keys to pointers, the keys are copied. It grows as
+// needed. Not thread safe.
 struct hash;
 struct hash *hash_new(int cap);
 void hash_free(struct hash *h);
-int hash_insert(struct hash *h, const char *key, int size);
+// returns the old value or NULL
+void *hash_set(struct hash *h, const char *key, int size, void *value);
+void *hash_get(struct hash *h, const char *key, int size);
 int hash_exist(struct hash *h, const char *key, int size);
-void hash_remove(struct hash *h, int pos);
+// removes the key, returns its value or NULL
+void *hash_remove(struct hash *h, const char *key, int size);
+// iterates from pos 0, returns the next pos or -1 at the end
+int hash_next(struct hash *h, int pos, const char **key, int *size, void **value);
 int hash_size(struct hash *h);
 int hash_cap(struct hash *h);
+uint64_t hash_string(const char *key, int size, uint64_t seed);
 
 #endif // _hash_h_
@@ -0,0 +1,721 @@
+#include "service.h"
+#include "lock.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// A key value store of strings as a C service. Keys are found through an open
+// addressing hash index, records are bump allocated in arena chunks and never
+// change once written: a new value is a new record, the old one is garbage
+// until the live records are copied to fresh chunks.
+// Requests are SERVICE_PROTO_KV messages, an op byte followed by strings, each
+// with a 32 bit native size in front:
+//	'g' key ...		replies the values, a size of -1 for a missing key
+//	's' key value ...	sets, replies the old values
+//	'm' key value ...	sets, replies nothing
+//	'd' key ...		deletes, replies the old values
+//	'r'			rewrites the log now
+//	'i'			replies "keys live garbage log" as text
+// With a log file every change is appended before the reply. A record in the
+// log is laid out as in memory, so on start the file is mapped and the index
+// points into the mapping. A thread rewrites the log from the live records once
+// it is twice their size. The changes made meanwhile are kept and appended to
+// the new file before it replaces the old one.
+
+#define KV_CHUNK (1024 * 1024)
+#define KV_INDEX 1024
+#define KV_REWRITE_MIN (4 * 1024 * 1024)
+#define KV_COMPACT_MIN (4 * KV_CHUNK)
+#define KV_MAXSIZE (1 << 30)
+#define KV_TICK 10
+
+#define KV_SET 's'
+#define KV_DEL 'd'
+
+// followed by key and value, padded to 8 bytes
+struct kv_record {
+	uint32_t sum;	// of the rest of the record
+	uint32_t op;
+	uint32_t klen;
+	uint32_t vlen;
+};
+
+#define RECORD_SIZE(klen, vlen) ((sizeof(struct kv_record) + (size_t)(klen) + (vlen) + 7) & ~(size_t)7)
+#define RECORD_KEY(r) ((char *)((r) + 1))
+#define RECORD_VALUE(r) (RECORD_KEY(r) + (r)->klen)
+
+struct kv_chunk {
+	struct kv_chunk *next;
+	char *data;
+	size_t size;
+	size_t used;
+	int mapped;
+};
+
+struct kv_slot {
+	uint32_t hash;
+	struct kv_record *r;
+};
+
+struct kv_buffer {
+	char *data;
+	size_t size;
+	size_t cap;
+};
+
+struct kv_rewrite {
+	pthread_t pid;
+	int done;	// 1 when written, -1 when failed
+	int fd;
+	int n;
+	struct kv_record **r;
+	struct kv_buffer tail;	// the changes since it started
+	char path[1];
+};
+
+struct kvdb {
+	uint32_t handle;
+	int fd;
+	size_t log;
+	size_t live;
+	size_t garbage;
+	int cap;
+	int n;
+	struct kv_slot *slot;
+	struct kv_chunk *chunk;
+	struct kv_rewrite *rewrite;
+	struct kv_buffer out;
+	char path[1];
+};
+
+static uint32_t
+kv_sum(const char *p, size_t sz) {
+	uint64_t h = 0x9e3779b97f4a7c15ull ^ sz;
+	while (sz >= 8) {
+		uint64_t v;
+		memcpy(&v, p, 8);
+		h = (h ^ v) * 0xff51afd7ed558ccdull;
+		h ^= h >> 32;
+		p += 8;
+		sz -= 8;
+	}
+	if (sz) {
+		uint64_t v = 0;
+		memcpy(&v, p, sz);
+		h = (h ^ v) * 0xc4ceb9fe1a85ec53ull;
+		h ^= h >> 29;
+	}
+	return (uint32_t)(h ^ (h >> 32));
+}
+
+static uint32_t
+kv_record_sum(const struct kv_record *r) {
+	return kv_sum((const char *)&r->op, sizeof(*r) - sizeof(r->sum) + r->klen + r->vlen);
+}
+
+static void
+kv_buffer_reserve(struct kv_buffer *b, size_t sz) {
+	size_t cap = b->cap ? b->cap : 256;
+	char *data;
+	if (b->size + sz <= b->cap) {
+		return;
+	}
+	while (cap < b->size + sz) {
+		cap *= 2;
+	}
+	data = service_alloc(0, (int)cap);
+	if (b->size) {
+		memcpy(data, b->data, b->size);
+	}
+	service_alloc(b->data, 0);
+	b->data = data;
+	b->cap = cap;
+}
+
+static void
+kv_buffer_push(struct kv_buffer *b, const void *p, size_t sz) {
+	kv_buffer_reserve(b, sz);
+	memcpy(b->data + b->size, p, sz);
+	b->size += sz;
+}
+
+static void
+kv_buffer_value(struct kv_buffer *b, const struct kv_record *r) {
+	int32_t sz = r ? (int32_t)r->vlen : -1;
+	kv_buffer_push(b, &sz, sizeof(sz));
+	if (r) {
+		kv_buffer_push(b, RECORD_VALUE(r), r->vlen);
+	}
+}
+
+static void
+kv_buffer_free(struct kv_buffer *b) {
+	service_alloc(b->data, 0);
+	b->data = 0;
+	b->size = b->cap = 0;
+}
+
+static void
+kv_chunk_free(struct kv_chunk *c) {
+	while (c) {
+		struct kv_chunk *next = c->next;
+		if (c->mapped) {
+			munmap(c->data, c->size);
+		} else {
+			service_alloc(c->data, 0);
+		}
+		service_alloc(c, 0);
+		c = next;
+	}
+}
+
+static struct kv_record *
+kv_alloc(struct kvdb *db, size_t sz) {
+	struct kv_chunk *c = db->chunk;
+	struct kv_record *r;
+	if (c == 0 || c->mapped || c->size - c->used < sz) {
+		// a big record gets a chunk of its own, the current one stays in front
+		size_t size = sz > KV_CHUNK / 4 ? sz : KV_CHUNK;
+		struct kv_chunk *nc = service_alloc(0, sizeof(*nc));
+		nc->data = service_alloc(0, (int)size);
+		nc->size = size;
+		if (size == sz && c && !c->mapped) {
+			nc->next = c->next;
+			c->next = nc;
+		} else {
+			nc->next = c;
+			db->chunk = nc;
+		}
+		c = nc;
+	}
+	r = (struct kv_record *)(c->data + c->used);
+	c->used += sz;
+	return r;
+}
+
+static struct kv_slot *
+kv_find(struct kvdb *db, uint32_t hash, const char *key, uint32_t klen) {
+	int mask = db->cap - 1;
+	int i = hash & mask;
+	for (;;) {
+		struct kv_slot *s = &db->slot[i];
+		struct kv_record *r = s->r;
+		if (r == 0 || (s->hash == hash && r->klen == klen && memcmp(RECORD_KEY(r), key, klen) == 0)) {
+			return s;
+		}
+		i = (i + 1) & mask;
+	}
+}
+
+static void
+kv_resize(struct kvdb *db, int cap) {
+	struct kv_slot *old = db->slot;
+	int n = db->cap;
+	int i;
+	db->slot = service_alloc(0, cap * sizeof(struct kv_slot));
+	db->cap = cap;
+	for (i = 0; i < n; i++) {
+		struct kv_record *r = old[i].r;
+		if (r) {
+			struct kv_slot *s = kv_find(db, old[i].hash, RECORD_KEY(r), r->klen);
+			*s = old[i];
+		}
+	}
+	service_alloc(old, 0);
+}
+
+// The slots after a removed one move back, no tombstones are left behind
+static void
+kv_remove(struct kvdb *db, struct kv_slot *s) {
+	int mask = db->cap - 1;
+	int i = s - db->slot;
+	int j = i;
+	for (;;) {
+		int k;
+		j = (j + 1) & mask;
+		if (db->slot[j].r == 0) {
+			break;
+		}
+		k = db->slot[j].hash & mask;
+		// move j to i unless its home k lies cyclically in (i, j]
+		if ((i <= j) ? (i < k && k <= j) : (i < k || k <= j)) {
+			continue;
+		}
+		db->slot[i] = db->slot[j];
+		i = j;
+	}
+	db->slot[i].r = 0;
+	db->slot[i].hash = 0;
+	--db->n;
+}
+
+// Puts r in the index, returns the record it replaces
+static struct kv_record *
+kv_put(struct kvdb *db, struct kv_record *r) {
+	uint32_t hash = kv_sum(RECORD_KEY(r), r->klen);
+	struct kv_slot *s = kv_find(db, hash, RECORD_KEY(r), r->klen);
+	struct kv_record *old = s->r;
+	s->hash = hash;
+	s->r = r;
+	db->live += RECORD_SIZE(r->klen, r->vlen);
+	if (old) {
+		size_t sz = RECORD_SIZE(old->klen, old->vlen);
+		db->live -= sz;
+		db->garbage += sz;
+	} else if (++db->n * 4 > db->cap * 3) {
+		kv_resize(db, db->cap * 2);
+	}
+	return old;
+}
+
+static struct kv_record *
+kv_del(struct kvdb *db, const char *key, uint32_t klen) {
+	uint32_t hash = kv_sum(key, klen);
+	struct kv_slot *s = kv_find(db, hash, key, klen);
+	struct kv_record *old = s->r;
+	if (old) {
+		size_t sz = RECORD_SIZE(old->klen, old->vlen);
+		db->live -= sz;
+		db->garbage += sz;
+		kv_remove(db, s);
+	}
+	return old;
+}
+
+static struct kv_record *
+kv_get(struct kvdb *db, const char *key, uint32_t klen) {
+	return kv_find(db, kv_sum(key, klen), key, klen)->r;
+}
+
+static void
+kv_log(struct kvdb *db, const void *p, size_t sz) {
+	if (db->fd < 0) {
+		return;
+	}
+	kv_buffer_push(&db->out, p, sz);
+	if (db->rewrite) {
+		kv_buffer_push(&db->rewrite->tail, p, sz);
+	}
+}
+
+static int
+kv_write(int fd, const char *p, size_t sz) {
+	while (sz > 0) {
+		ssize_t n = write(fd, p, sz);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		p += n;
+		sz -= n;
+	}
+	return 0;
+}
+
+static void
+kv_flush(struct kvdb *db) {
+	if (db->out.size == 0) {
+		return;
+	}
+	if (kv_write(db->fd, db->out.data, db->out.size)) {
+		service_log(db->handle, "kvdb write %s failed: %s\n", db->path, strerror(errno));
+	} else {
+		db->log += db->out.size;
+	}
+	db->out.size = 0;
+}
+
+static void *
+kv_rewrite_thread(void *p) {
+	struct kv_rewrite *rw = (struct kv_rewrite *)p;
+	char buffer[64 * 1024];
+	size_t n = 0;
+	int i, err = 0;
+	for (i = 0; i < rw->n && err == 0; i++) {
+		struct kv_record *r = rw->r[i];
+		size_t sz = RECORD_SIZE(r->klen, r->vlen);
+		if (n + sz > sizeof(buffer)) {
+			err = kv_write(rw->fd, buffer, n);
+			n = 0;
+		}
+		if (sz > sizeof(buffer)) {
+			err = err || kv_write(rw->fd, (const char *)r, sz);
+		} else {
+			memcpy(buffer + n, r, sz);
+			n += sz;
+		}
+	}
+	if (err == 0) {
+		err = kv_write(rw->fd, buffer, n) || fdatasync(rw->fd);
+	}
+	atom_sync();
+	rw->done = err ? -1 : 1;
+	return 0;
+}
+
+static void
+kv_rewrite_start(struct kvdb *db) {
+	struct kv_rewrite *rw;
+	size_t len = strlen(db->path);
+	int i, n = 0;
+	if (db->fd < 0 || db->rewrite) {
+		return;
+	}
+	rw = service_alloc(0, sizeof(*rw) + len + 8);
+	memcpy(rw->path, db->path, len);
+	memcpy(rw->path + len, ".write", 7);
+	rw->fd = open(rw->path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (rw->fd < 0) {
+		service_log(db->handle, "kvdb rewrite %s failed: %s\n", rw->path, strerror(errno));
+		service_alloc(rw, 0);
+		return;
+	}
+	rw->r = service_alloc(0, (db->n ? db->n : 1) * sizeof(struct kv_record *));
+	for (i = 0; i < db->cap; i++) {
+		if (db->slot[i].r) {
+			rw->r[n++] = db->slot[i].r;
+		}
+	}
+	rw->n = n;
+	if (pthread_create(&rw->pid, 0, kv_rewrite_thread, rw)) {
+		service_log(db->handle, "kvdb rewrite thread failed\n");
+		close(rw->fd);
+		unlink(rw->path);
+		service_alloc(rw->r, 0);
+		service_alloc(rw, 0);
+		return;
+	}
+	db->rewrite = rw;
+	service_timeout(db->handle, KV_TICK);
+}
+
+// Swaps the new log in once the thread is done, returns 0 while it's running
+static int
+kv_rewrite_finish(struct kvdb *db, int wait) {
+	struct kv_rewrite *rw = db->rewrite;
+	if (rw == 0) {
+		return 1;
+	}
+	if (!wait && rw->done == 0) {
+		return 0;
+	}
+	pthread_join(rw->pid, 0);
+	if (rw->done > 0 && kv_write(rw->fd, rw->tail.data, rw->tail.size) == 0 && rename(rw->path, db->path) == 0) {
+		// the new file is written to the end, appends go on there
+		close(db->fd);
+		db->fd = rw->fd;
+		db->log = (size_t)lseek(db->fd, 0, SEEK_END);
+	} else {
+		service_log(db->handle, "kvdb rewrite %s failed\n", rw->path);
+		unlink(rw->path);
+		close(rw->fd);
+	}
+	kv_buffer_free(&rw->tail);
+	service_alloc(rw->r, 0);
+	service_alloc(rw, 0);
+	db->rewrite = 0;
+	return 1;
+}
+
+// Copies the live records to fresh chunks when most of the arena is garbage.
+// Not while a rewrite reads the records.
+static void
+kv_compact(struct kvdb *db) {
+	struct kv_chunk *old = db->chunk;
+	int i;
+	if (db->rewrite || db->garbage < KV_COMPACT_MIN || db->garbage < db->live) {
+		return;
+	}
+	db->chunk = 0;
+	for (i = 0; i < db->cap; i++) {
+		struct kv_record *r = db->slot[i].r;
+		if (r) {
+			size_t sz = RECORD_SIZE(r->klen, r->vlen);
+			struct kv_record *nr = kv_alloc(db, sz);
+			memcpy(nr, r, sz);
+			db->slot[i].r = nr;
+		}
+	}
+	kv_chunk_free(old);
+	db->garbage = 0;
+}
+
+static void
+kv_changed(struct kvdb *db) {
+	kv_flush(db);
+	if (db->fd >= 0 && db->log > KV_REWRITE_MIN && db->log > db->live * 2) {
+		kv_rewrite_start(db);
+	}
+	kv_compact(db);
+}
+
+static struct kv_record *
+kv_set(struct kvdb *db, const char *key, uint32_t klen, const char *value, uint32_t vlen) {
+	size_t sz = RECORD_SIZE(klen, vlen);
+	struct kv_record *r = kv_alloc(db, sz);
+	r->op = KV_SET;
+	r->klen = klen;
+	r->vlen = vlen;
+	memcpy(RECORD_KEY(r), key, klen);
+	memcpy(RECORD_VALUE(r), value, vlen);
+	memset(RECORD_VALUE(r) + vlen, 0, sz - sizeof(*r) - klen - vlen);
+	r->sum = kv_record_sum(r);
+	kv_log(db, r, sz);
+	return kv_put(db, r);
+}
+
+static void
+kv_log_del(struct kvdb *db, const char *key, uint32_t klen) {
+	size_t sz = RECORD_SIZE(klen, 0);
+	struct kv_record *r;
+	if (db->fd < 0) {
+		return;
+	}
+	kv_buffer_reserve(&db->out, sz);
+	r = (struct kv_record *)(db->out.data + db->out.size);
+	memset(r, 0, sz);
+	r->op = KV_DEL;
+	r->klen = klen;
+	memcpy(RECORD_KEY(r), key, klen);
+	r->sum = kv_record_sum(r);
+	db->out.size += sz;
+	if (db->rewrite) {
+		kv_buffer_push(&db->rewrite->tail, r, sz);
+	}
+}
+
+// Loads the log through a mapping, the records stay in it. A torn record at
+// the end is cut off.
+static int
+kv_recover(struct kvdb *db) {
+	struct stat st;
+	struct kv_chunk *c;
+	size_t off = 0;
+	char *base;
+	if (fstat(db->fd, &st) != 0) {
+		return -1;
+	}
+	if (st.st_size == 0) {
+		return 0;
+	}
+	base = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, db->fd, 0);
+	if (base == MAP_FAILED) {
+		return -1;
+	}
+	c = service_alloc(0, sizeof(*c));
+	c->data = base;
+	c->size = c->used = st.st_size;
+	c->mapped = 1;
+	c->next = db->chunk;
+	db->chunk = c;
+	while (off + sizeof(struct kv_record) <= (size_t)st.st_size) {
+		struct kv_record *r = (struct kv_record *)(base + off);
+		size_t sz = RECORD_SIZE(r->klen, r->vlen);
+		if (r->klen > KV_MAXSIZE || r->vlen > KV_MAXSIZE || off + sz > (size_t)st.st_size || kv_record_sum(r) != r->sum) {
+			break;
+		}
+		if (r->op == KV_SET) {
+			kv_put(db, r);
+		} else if (r->op == KV_DEL) {
+			kv_del(db, RECORD_KEY(r), r->klen);
+			db->garbage += sz;
+		} else {
+			break;
+		}
+		off += sz;
+	}
+	if (off < (size_t)st.st_size) {
+		service_log(db->handle, "kvdb %s: %ld bytes at the end are broken, cut off\n", db->path, (long)(st.st_size - off));
+		if (ftruncate(db->fd, off) != 0) {
+			return -1;
+		}
+	}
+	db->log = off;
+	return 0;
+}
+
+struct kv_request {
+	const char *p;
+	const char *end;
+};
+
+static int
+kv_string(struct kv_request *req, const char **str, uint32_t *sz) {
+	uint32_t n;
+	if (req->end - req->p < (long)sizeof(n)) {
+		return 0;
+	}
+	memcpy(&n, req->p, sizeof(n));
+	req->p += sizeof(n);
+	if (n > KV_MAXSIZE || req->end - req->p < (long)n) {
+		req->p = req->end + 1;
+		return 0;
+	}
+	*str = req->p;
+	*sz = n;
+	req->p += n;
+	return 1;
+}
+
+static void
+kv_reply(struct kvdb *db, const struct message *m, int proto, struct kv_buffer *b) {
+	struct message r;
+	if (m->session == 0) {
+		kv_buffer_free(b);
+		return;
+	}
+	r.source = db->handle;
+	r.session = m->session;
+	r.proto = proto;
+	r.data = b->data;
+	r.size = (int)b->size;
+	if (service_send(m->source, &r) == -1) {
+		service_alloc(r.data, 0);
+	}
+	b->data = 0;
+	b->size = b->cap = 0;
+}
+
+static void
+kv_request(struct kvdb *db, const struct message *m) {
+	struct kv_request req;
+	struct kv_buffer reply = { 0, 0, 0 };
+	const char *key, *value;
+	uint32_t klen, vlen;
+	int op;
+	int proto = SERVICE_PROTO_RESP;
+	if (m->size < 1) {
+		kv_reply(db, m, SERVICE_PROTO_ERROR, &reply);
+		return;
+	}
+	req.p = (const char *)m->data + 1;
+	req.end = (const char *)m->data + m->size;
+	op = *(const char *)m->data;
+	switch (op) {
+	case 'g':
+		while (kv_string(&req, &key, &klen)) {
+			kv_buffer_value(&reply, kv_get(db, key, klen));
+		}
+		break;
+	case 's':
+	case 'm':
+		while (kv_string(&req, &key, &klen)) {
+			struct kv_record *old;
+			if (!kv_string(&req, &value, &vlen)) {
+				req.p = req.end + 1;
+				break;
+			}
+			old = kv_set(db, key, klen, value, vlen);
+			if (op == 's') {
+				kv_buffer_value(&reply, old);
+			}
+		}
+		kv_changed(db);
+		break;
+	case 'd':
+		while (kv_string(&req, &key, &klen)) {
+			struct kv_record *old = kv_get(db, key, klen);
+			kv_buffer_value(&reply, old);
+			if (old) {
+				kv_log_del(db, key, klen);
+				kv_del(db, key, klen);
+			}
+		}
+		kv_changed(db);
+		break;
+	case 'r':
+		kv_rewrite_start(db);
+		break;
+	case 'i': {
+		char tmp[128];
+		int n = snprintf(tmp, sizeof(tmp), "%d %lu %lu %lu", db->n,
+			(unsigned long)db->live, (unsigned long)db->garbage, (unsigned long)db->log);
+		kv_buffer_push(&reply, tmp, n);
+		break;
+	}
+	default:
+		req.p = req.end + 1;
+		break;
+	}
+	if (req.p != req.end) {
+		service_log(db->handle, "kvdb bad request from %u\n", m->source);
+		proto = SERVICE_PROTO_ERROR;
+		kv_buffer_free(&reply);
+	}
+	kv_reply(db, m, proto, &reply);
+}
+
+static int
+kv_dispatch(uint32_t handle, void *ud, const struct message *m) {
+	struct kvdb *db = (struct kvdb *)ud;
+	switch (m->proto) {
+	case SERVICE_PROTO_KV:
+		kv_request(db, m);
+		break;
+	case SERVICE_PROTO_RESP:
+		// the tick while a rewrite runs
+		if (!kv_rewrite_finish(db, 0)) {
+			service_timeout(handle, KV_TICK);
+		}
+		break;
+	}
+	return 0;
+}
+
+// param: the log file, none keeps the data in memory only
+static void *
+kv_create(uint32_t handle, const char *param) {
+	struct kvdb *db;
+	size_t len = param ? strlen(param) : 0;
+	db = service_alloc(0, sizeof(*db) + len);
+	if (len > 0) {
+		memcpy(db->path, param, len);
+	}
+	db->handle = handle;
+	db->fd = -1;
+	db->cap = KV_INDEX;
+	db->slot = service_alloc(0, db->cap * sizeof(struct kv_slot));
+	if (len > 0) {
+		db->fd = open(db->path, O_RDWR | O_CREAT | O_APPEND, 0644);
+		if (db->fd < 0 || kv_recover(db)) {
+			service_log(handle, "kvdb open %s failed: %s\n", db->path, strerror(errno));
+			if (db->fd >= 0) {
+				close(db->fd);
+			}
+			kv_chunk_free(db->chunk);
+			service_alloc(db->slot, 0);
+			service_alloc(db, 0);
+			return 0;
+		}
+	}
+	return db;
+}
+
+static void
+kv_release(uint32_t handle, void *ud) {
+	struct kvdb *db = (struct kvdb *)ud;
+	kv_rewrite_finish(db, 1);
+	if (db->fd >= 0) {
+		close(db->fd);
+	}
+	kv_buffer_free(&db->out);
+	kv_chunk_free(db->chunk);
+	service_alloc(db->slot, 0);
+	service_alloc(db, 0);
+}
+
+struct module kvdb_mod = {
+	kv_dispatch,
+	kv_create,
+	kv_release,
+};
@@ -7,8 +7,10 @@
 #define atom_and(ptr, n) __sync_and_and_fetch(ptr, n)
 #define atom_add(ptr, n) __sync_add_and_fetch(ptr, n)
 #define atom_sub(ptr, n) __sync_sub_and_fetch(ptr, n)
+#define atom_xchg(ptr, val) __atomic_exchange_n(ptr, val, __ATOMIC_SEQ_CST)
 #define atom_sync() __sync_synchronize()
 #define atom_spinlock(ptr) while (__sync_lock_test_and_set(ptr, 1)) {}
+#define atom_spintrylock(ptr) (__sync_lock_test_and_set(ptr, 1) == 0)
 #define atom_spinunlock(ptr) __sync_lock_release(ptr)
 
 
@@ -59,6 +61,11 @@ spinlock_lock(struct spinlock *lock) {
 	pthread_mutex_lock(&lock->lock);
 }
 
+static inline int
+spinlock_trylock(struct spinlock *lock) {
+	return pthread_mutex_trylock(&lock->lock) == 0;
+}
+
 static inline void
 spinlock_unlock(struct spinlock *lock) {
 	pthread_mutex_unlock(&lock->lock);
@@ -123,6 +130,11 @@ spinlock_lock(struct spinlock *lock) {
 	atom_spinlock(&lock->lock);
 }
 
+static inline int
+spinlock_trylock(struct spinlock *lock) {
+	return atom_spintrylock(&lock->lock);
+}
+
 static inline void
 spinlock_unlock(struct spinlock *lock) {
 	atom_spinunlock(&lock->lock);
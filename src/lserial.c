@@ -1,4 +1,5 @@
 #include "lserial.h"
+#include "service.h"
 
 #include "lualib.h"
 #include "lauxlib.h"
@@ -228,8 +229,9 @@ static void lpack_one(lua_State *L, struct buffer *b, int idx, int depth) {
 	}
 }
 
+// the data becomes a message, which is freed by service_alloc
 static void lpack_ret(lua_State *L, struct buffer_node *node, int len) {
-	uint8_t *data = (uint8_t *)malloc(len);
+	uint8_t *data = (uint8_t *)service_alloc(0, len);
 	uint8_t *p = data;
 	int size = len;
 	while (len > 0) {
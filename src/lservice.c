@@ -2,6 +2,7 @@
 #include "timer.h"
 #include "lserial.h"
 #include "lalloc.h"
+#include "mpool.h"
 
 #include "lua.h"
 #include "lualib.h"
@@ -137,6 +138,26 @@ static int lservice(lua_State *L) {
 	return 1;
 }
 
+extern struct module gate_mod;
+
+// a client gate in C, see src/gate.c
+static int lgate(lua_State *L) {
+	const char *param = luaL_checkstring(L, 1);
+	uint32_t handle = service_create(&gate_mod, param);
+	lua_pushinteger(L, handle);
+	return 1;
+}
+
+extern struct module kvdb_mod;
+
+// a key value store in C, see src/kvdb.c
+static int lkvdb(lua_State *L) {
+	const char *param = luaL_optstring(L, 1, "");
+	uint32_t handle = service_create(&kvdb_mod, param);
+	lua_pushinteger(L, handle);
+	return 1;
+}
+
 static int lexit(lua_State *L) {
 	uint32_t handle;
 	if (lua_isinteger(L, 1)) {
@@ -223,6 +244,18 @@ static int ltostring(lua_State *L) {
 	return 1;
 }
 
+// the message itself is freed by the dispatcher when the dispatch returns
+static int lmsgstring(lua_State *L) {
+	void *data = lua_touserdata(L, 1);
+	int size = luaL_checkinteger(L, 2);
+	if (size > 0) {
+		lua_pushlstring(L, data, size);
+	} else {
+		lua_pushliteral(L, "");
+	}
+	return 1;
+}
+
 static int lname(lua_State *L) {
 	const char *name = luaL_checkstring(L, 1);
 	uint32_t handle = (uint32_t)luaL_checkinteger(L, 2);
@@ -287,9 +320,26 @@ static int labort(lua_State *L) {
 	return 0;
 }
 
+static int lmpool(lua_State *L) {
+	struct mpool_stat stat;
+	mpool_stat(&stat);
+	lua_createtable(L, 0, 4);
+	lua_pushinteger(L, stat.alloc);
+	lua_setfield(L, -2, "alloc");
+	lua_pushinteger(L, stat.malloc);
+	lua_setfield(L, -2, "malloc");
+	lua_pushinteger(L, stat.free);
+	lua_setfield(L, -2, "free");
+	lua_pushinteger(L, stat.cached);
+	lua_setfield(L, -2, "cached");
+	return 1;
+}
+
 int service_c(lua_State *L) {
 	luaL_Reg l[] = {
 		{"service", lservice},
+		{"gate", lgate},
+		{"kvdb", lkvdb},
 		{"exit", lexit},
 		{"send", lsend},
 		{"start", lstart},
@@ -299,6 +349,7 @@ int service_c(lua_State *L) {
 		{"timeout", ltimeout},
 		{"trash", ltrash},
 		{"tostring", ltostring},
+		{"msgstring", lmsgstring},
 		{"name", lname},
 		{"query", lquery},
 		{"log", llog},
@@ -308,6 +359,7 @@ int service_c(lua_State *L) {
 		{"logon", llogon},
 		{"logoff", llogoff},
 		{"abort", labort},
+		{"mpool", lmpool},
 		{0, 0},
 	};
 	luaL_newlib(L, l);
@@ -0,0 +1,198 @@
+#include "mpool.h"
+#include "lock.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <assert.h>
+
+// Size classes from 64 bytes to 1M, bigger blocks go straight to malloc.
+// Every pointer handed out is preceded by a 32 bit tag holding its distance
+// to the block header, so a block can be shared by two pointers (a message
+// header and the payload behind it) and released through either of them.
+
+#define MPOOL_MIN_SHIFT 6
+#define MPOOL_CLASS 15
+#define MPOOL_LARGE 0xffff
+#define MPOOL_MAGIC 0x6d70
+#define MPOOL_CACHE (4 * 1024 * 1024)
+#define MPOOL_CACHE_MIN 16
+
+struct mpool_block {
+	int ref;
+	uint16_t cls;
+	uint16_t magic;
+	uint32_t size;
+	uint32_t tag;
+};
+
+struct mpool_free {
+	struct mpool_free *next;
+};
+
+struct mpool_class {
+	struct spinlock lock;
+	struct mpool_free *head;
+	int n;
+	int max;
+	long alloc;
+	long malloc;
+	long free;
+};
+
+struct mpool {
+	struct mpool_class cls[MPOOL_CLASS];
+	long large_alloc;
+	long large_free;
+};
+
+static struct mpool M;
+
+#define BLOCK_SIZE(cls) (1 << ((cls) + MPOOL_MIN_SHIFT))
+
+static inline int
+mpool_class(int size) {
+	int cls = 0;
+	size += sizeof(struct mpool_block);
+	while (cls < MPOOL_CLASS && BLOCK_SIZE(cls) < size) {
+		cls++;
+	}
+	return cls;
+}
+
+static inline struct mpool_block *
+mpool_block(void *p) {
+	uint32_t tag = *((uint32_t *)p - 1);
+	struct mpool_block *b = (struct mpool_block *)((char *)p - tag);
+	assert(b->magic == MPOOL_MAGIC);
+	return b;
+}
+
+void
+mpool_init(void) {
+	int i;
+	for (i = 0; i < MPOOL_CLASS; i++) {
+		struct mpool_class *c = &M.cls[i];
+		spinlock_init(&c->lock);
+		c->head = 0;
+		c->n = 0;
+		c->max = MPOOL_CACHE / BLOCK_SIZE(i);
+		if (c->max < MPOOL_CACHE_MIN) {
+			c->max = MPOOL_CACHE_MIN;
+		}
+		c->alloc = c->malloc = c->free = 0;
+	}
+	M.large_alloc = M.large_free = 0;
+}
+
+void
+mpool_unit(void) {
+	int i;
+	for (i = 0; i < MPOOL_CLASS; i++) {
+		struct mpool_class *c = &M.cls[i];
+		struct mpool_free *f = c->head;
+		while (f) {
+			struct mpool_free *next = f->next;
+			free((struct mpool_block *)f - 1);
+			f = next;
+		}
+		c->head = 0;
+		c->n = 0;
+		spinlock_unit(&c->lock);
+	}
+}
+
+void *
+mpool_alloc(int size) {
+	struct mpool_block *b = 0;
+	int cls = mpool_class(size);
+	if (cls == MPOOL_CLASS) {
+		atom_inc(&M.large_alloc);
+		b = (struct mpool_block *)malloc(sizeof(*b) + size);
+		b->cls = MPOOL_LARGE;
+	} else {
+		struct mpool_class *c = &M.cls[cls];
+		spinlock_lock(&c->lock);
+		c->alloc++;
+		if (c->head) {
+			b = (struct mpool_block *)c->head - 1;
+			c->head = c->head->next;
+			c->n--;
+		} else {
+			c->malloc++;
+		}
+		spinlock_unlock(&c->lock);
+		if (b == 0) {
+			b = (struct mpool_block *)malloc(BLOCK_SIZE(cls));
+		}
+		b->cls = cls;
+	}
+	b->ref = 1;
+	b->magic = MPOOL_MAGIC;
+	b->size = size;
+	b->tag = sizeof(*b);
+	return b + 1;
+}
+
+void
+mpool_free(void *p) {
+	struct mpool_block *b = mpool_block(p);
+	struct mpool_class *c;
+	if (atom_dec(&b->ref) != 0) {
+		return;
+	}
+	if (b->cls == MPOOL_LARGE) {
+		atom_inc(&M.large_free);
+		free(b);
+		return;
+	}
+	c = &M.cls[b->cls];
+	spinlock_lock(&c->lock);
+	c->free++;
+	if (c->n < c->max) {
+		struct mpool_free *f = (struct mpool_free *)(b + 1);
+		f->next = c->head;
+		c->head = f;
+		c->n++;
+		b = 0;
+	}
+	spinlock_unlock(&c->lock);
+	if (b) {
+		free(b);
+	}
+}
+
+// Let interior, a pointer inside the block of p, be released on its own.
+// The block goes back to the pool when both p and interior are freed.
+void
+mpool_share(void *p, void *interior) {
+	struct mpool_block *b = mpool_block(p);
+	uint32_t tag = (uint32_t)((char *)interior - (char *)b);
+	assert((char *)interior >= (char *)p + sizeof(uint32_t) && tag <= sizeof(*b) + b->size);
+	*((uint32_t *)interior - 1) = tag;
+	atom_inc(&b->ref);
+}
+
+// One more owner of the block p points into, it goes back to the pool once
+// freed that many more times.
+void
+mpool_retain(void *p) {
+	atom_inc(&mpool_block(p)->ref);
+}
+
+void
+mpool_stat(struct mpool_stat *stat) {
+	int i;
+	stat->alloc = M.large_alloc;
+	stat->malloc = M.large_alloc;
+	stat->free = M.large_free;
+	stat->cached = 0;
+	for (i = 0; i < MPOOL_CLASS; i++) {
+		struct mpool_class *c = &M.cls[i];
+		spinlock_lock(&c->lock);
+		stat->alloc += c->alloc;
+		stat->malloc += c->malloc;
+		stat->free += c->free;
+		stat->cached += (long)c->n * BLOCK_SIZE(i);
+		spinlock_unlock(&c->lock);
+	}
+}
@@ -0,0 +1,19 @@
+#ifndef _mpool_h_
+#define _mpool_h_
+
+struct mpool_stat {
+	long alloc;		// mpool_alloc calls
+	long malloc;	// allocations that missed the pool
+	long free;		// blocks released
+	long cached;	// bytes kept in the pool
+};
+
+void mpool_init(void);
+void mpool_unit(void);
+void *mpool_alloc(int size);
+void mpool_free(void *p);
+void mpool_share(void *p, void *interior);
+void mpool_retain(void *p);
+void mpool_stat(struct mpool_stat *stat);
+
+#endif // _mpool_h_
@@ -0,0 +1,515 @@
+#include "resolver.h"
+
+#include <pthread.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+// Host lookups run on their own threads so a slow name server never holds up a
+// socket thread. Results are kept for ttl seconds, failures for a second, and
+// lookups of a host already being resolved wait for the same answer.
+// With a name server given, the lookups ask it for the A and AAAA records over
+// udp instead of going through getaddrinfo, hosts files and search domains are
+// left out then.
+
+#define RESOLVER_HASH 256
+#define RESOLVER_MAX_ENTRY 4096
+#define RESOLVER_MAX_THREAD 16
+#define RESOLVER_FAIL_TTL 1000
+#define RESOLVER_DNS_TIMEOUT 5000
+#define RESOLVER_DNS_SIZE 512
+
+struct resolver_wait {
+	struct resolver_wait *next;
+	struct resolver_addr *ra;
+	resolver_cb cb;
+	void *ud;
+};
+
+struct resolver_entry {
+	struct resolver_entry *next;
+	struct resolver_entry *job;
+	struct resolver_wait *wait;
+	int pending;
+	uint64_t expire;
+	struct resolver_addr addr;
+	char host[1];
+};
+
+struct resolver {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int quit;
+	int thread;
+	int ttl;
+	int n;
+	socklen_t ns_len;
+	struct sockaddr_storage ns;
+	struct resolver_entry *job_head;
+	struct resolver_entry *job_tail;
+	struct resolver_entry *hash[RESOLVER_HASH];
+	pthread_t pid[RESOLVER_MAX_THREAD];
+};
+
+static struct resolver R;
+
+static uint64_t
+resolver_now(void) {
+	struct timespec ti;
+	clock_gettime(CLOCK_MONOTONIC, &ti);
+	return (uint64_t)ti.tv_sec * 1000 + ti.tv_nsec / 1000000;
+}
+
+static unsigned
+resolver_hash(const char *host) {
+	unsigned h = 2166136261u;
+	while (*host) {
+		h = (h ^ (unsigned char)*host++) * 16777619u;
+	}
+	return h % RESOLVER_HASH;
+}
+
+static void
+resolver_fill(struct resolver_addr *ra, const char *host, int flags) {
+	struct addrinfo ai_hints;
+	struct addrinfo *ai_list = 0;
+	struct addrinfo *ai_ptr;
+	memset(&ai_hints, 0, sizeof(ai_hints));
+	ai_hints.ai_family = AF_UNSPEC;
+	ai_hints.ai_socktype = SOCK_STREAM;
+	ai_hints.ai_flags = flags;
+	ra->n = 0;
+	ra->err = getaddrinfo(host, 0, &ai_hints, &ai_list);
+	if (ra->err != 0) {
+		return;
+	}
+	for (ai_ptr = ai_list; ai_ptr != 0 && ra->n < RESOLVER_MAX_ADDR; ai_ptr = ai_ptr->ai_next) {
+		if (ai_ptr->ai_addrlen > sizeof(ra->addr[0])) {
+			continue;
+		}
+		memcpy(&ra->addr[ra->n], ai_ptr->ai_addr, ai_ptr->ai_addrlen);
+		ra->len[ra->n] = ai_ptr->ai_addrlen;
+		ra->n++;
+	}
+	freeaddrinfo(ai_list);
+	if (ra->n == 0) {
+		ra->err = EAI_NONAME;
+	}
+}
+
+// A query for one record type of host, returns its size or 0 for a bad name.
+static int
+resolver_question(uint8_t *buf, const char *host, int id, int type) {
+	int n = 12;
+	memset(buf, 0, 12);
+	buf[0] = id >> 8;
+	buf[1] = id & 0xff;
+	buf[2] = 1;	// recursion desired
+	buf[5] = 1;	// one question
+	while (*host) {
+		const char *dot = strchr(host, '.');
+		int len = dot ? (int)(dot - host) : (int)strlen(host);
+		if (len == 0 || len > 63 || n + len + 1 > 12 + 255) {
+			return 0;
+		}
+		buf[n++] = len;
+		memcpy(buf + n, host, len);
+		n += len;
+		host += len;
+		if (*host == '.') {
+			host++;
+		}
+	}
+	buf[n++] = 0;
+	buf[n++] = 0;
+	buf[n++] = type;
+	buf[n++] = 0;
+	buf[n++] = 1;	// class IN
+	return n;
+}
+
+static int
+resolver_skip_name(const uint8_t *buf, int n, int i) {
+	while (i < n) {
+		if (buf[i] == 0) {
+			return i + 1;
+		}
+		if ((buf[i] & 0xc0) == 0xc0) {
+			return i + 2;
+		}
+		i += buf[i] + 1;
+	}
+	return n + 1;
+}
+
+// Adds the addresses of an answer to ra, returns 0 if it isn't the answer to
+// id. err is set for an answer without records.
+static int
+resolver_answer(struct resolver_addr *ra, const uint8_t *buf, int n, int id, int *err) {
+	int i, qd, an;
+	if (n < 12 || (buf[0] << 8 | buf[1]) != id || !(buf[2] & 0x80)) {
+		return 0;
+	}
+	switch (buf[3] & 0xf) {
+	case 0:
+		break;
+	case 3:
+		*err = EAI_NONAME;
+		return 1;
+	default:
+		*err = EAI_FAIL;
+		return 1;
+	}
+	qd = buf[4] << 8 | buf[5];
+	an = buf[6] << 8 | buf[7];
+	i = 12;
+	while (qd-- > 0) {
+		i = resolver_skip_name(buf, n, i) + 4;
+	}
+	while (an-- > 0) {
+		int type, len;
+		i = resolver_skip_name(buf, n, i);
+		if (i + 10 > n) {
+			break;
+		}
+		type = buf[i] << 8 | buf[i + 1];
+		len = buf[i + 8] << 8 | buf[i + 9];
+		i += 10;
+		if (i + len > n) {
+			break;
+		}
+		if (ra->n < RESOLVER_MAX_ADDR && type == 1 && len == 4) {
+			struct sockaddr_in *sin = (struct sockaddr_in *)&ra->addr[ra->n];
+			memset(sin, 0, sizeof(*sin));
+			sin->sin_family = AF_INET;
+			memcpy(&sin->sin_addr, buf + i, 4);
+			ra->len[ra->n++] = sizeof(*sin);
+		} else if (ra->n < RESOLVER_MAX_ADDR && type == 28 && len == 16) {
+			struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&ra->addr[ra->n];
+			memset(sin6, 0, sizeof(*sin6));
+			sin6->sin6_family = AF_INET6;
+			memcpy(&sin6->sin6_addr, buf + i, 16);
+			ra->len[ra->n++] = sizeof(*sin6);
+		}
+		i += len;
+	}
+	return 1;
+}
+
+// Asks the name server for A and AAAA at once and waits for both answers.
+static void
+resolver_dns(struct resolver_addr *ra, const char *host) {
+	uint8_t buf[RESOLVER_DNS_SIZE];
+	struct timeval tv;
+	int fd, n, i, err = EAI_NONAME;
+	int id = rand() & 0xfffe;
+	int wait = 3;	// the answers still missing
+	uint64_t expire = resolver_now() + RESOLVER_DNS_TIMEOUT;
+	ra->n = 0;
+	ra->err = EAI_SYSTEM;
+	fd = socket(R.ns.ss_family, SOCK_DGRAM, 0);
+	if (fd < 0) {
+		return;
+	}
+	if (connect(fd, (struct sockaddr *)&R.ns, R.ns_len)) {
+		close(fd);
+		return;
+	}
+	for (i = 0; i < 2; i++) {
+		n = resolver_question(buf, host, id + i, i ? 28 : 1);
+		if (n == 0) {
+			ra->err = EAI_NONAME;
+			close(fd);
+			return;
+		}
+		if (send(fd, buf, n, 0) != n) {
+			ra->err = EAI_AGAIN;
+			close(fd);
+			return;
+		}
+	}
+	while (wait) {
+		uint64_t now = resolver_now();
+		if (now >= expire) {
+			err = EAI_AGAIN;
+			break;
+		}
+		tv.tv_sec = (expire - now) / 1000;
+		tv.tv_usec = (expire - now) % 1000 * 1000;
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+		n = recv(fd, buf, sizeof(buf), 0);
+		if (n < 0) {
+			err = EAI_AGAIN;
+			break;
+		}
+		for (i = 0; i < 2; i++) {
+			if ((wait & 1 << i) && resolver_answer(ra, buf, n, id + i, &err)) {
+				wait &= ~(1 << i);
+				break;
+			}
+		}
+	}
+	close(fd);
+	ra->err = ra->n > 0 ? 0 : err;
+}
+
+// ip, ip:port or [ip6]:port, the port defaults to 53.
+static int
+resolver_nameserver(const char *ns) {
+	char ip[64];
+	const char *port = 0;
+	struct resolver_addr ra;
+	size_t sz;
+	if (ns[0] == '[') {
+		const char *end = strchr(ns, ']');
+		if (end == 0) {
+			return -1;
+		}
+		sz = end - ns - 1;
+		ns++;
+		if (end[1] == ':') {
+			port = end + 2;
+		}
+	} else {
+		port = strchr(ns, ':');
+		if (port && strchr(port + 1, ':')) {
+			port = 0;	// a bare ip6 address
+		}
+		sz = port ? (size_t)(port - ns) : strlen(ns);
+		if (port) {
+			port++;
+		}
+	}
+	if (sz >= sizeof(ip)) {
+		return -1;
+	}
+	memcpy(ip, ns, sz);
+	ip[sz] = 0;
+	resolver_fill(&ra, ip, AI_NUMERICHOST);
+	if (ra.err != 0) {
+		return -1;
+	}
+	R.ns = ra.addr[0];
+	R.ns_len = ra.len[0];
+	if (R.ns.ss_family == AF_INET) {
+		((struct sockaddr_in *)&R.ns)->sin_port = htons(port ? atoi(port) : 53);
+	} else {
+		((struct sockaddr_in6 *)&R.ns)->sin6_port = htons(port ? atoi(port) : 53);
+	}
+	return 0;
+}
+
+static void
+resolver_remove(struct resolver_entry *e) {
+	struct resolver_entry **p = &R.hash[resolver_hash(e->host)];
+	while (*p != e) {
+		p = &(*p)->next;
+	}
+	*p = e->next;
+	R.n--;
+	free(e);
+}
+
+// Drop the expired results, or every result when all of them are still fresh.
+static void
+resolver_sweep(uint64_t now) {
+	int i, all;
+	for (all = 0; all < 2 && R.n >= RESOLVER_MAX_ENTRY; all++) {
+		for (i = 0; i < RESOLVER_HASH; i++) {
+			struct resolver_entry **p = &R.hash[i];
+			while (*p) {
+				struct resolver_entry *e = *p;
+				if (!e->pending && (all || e->expire <= now)) {
+					*p = e->next;
+					R.n--;
+					free(e);
+				} else {
+					p = &e->next;
+				}
+			}
+		}
+	}
+}
+
+static void
+resolver_done(struct resolver_entry *e, struct resolver_wait *w) {
+	while (w) {
+		struct resolver_wait *next = w->next;
+		*w->ra = e->addr;
+		w = next;
+	}
+}
+
+static void
+resolver_notify(struct resolver_wait *w) {
+	while (w) {
+		struct resolver_wait *next = w->next;
+		w->cb(w->ud);
+		free(w);
+		w = next;
+	}
+}
+
+static void *
+resolver_thread(void *ud) {
+	(void)ud;
+	pthread_mutex_lock(&R.lock);
+	for (;;) {
+		struct resolver_entry *e;
+		struct resolver_addr addr;
+		struct resolver_wait *w;
+		while (!R.quit && R.job_head == 0) {
+			pthread_cond_wait(&R.cond, &R.lock);
+		}
+		if (R.quit) {
+			break;
+		}
+		e = R.job_head;
+		R.job_head = e->job;
+		if (R.job_head == 0) {
+			R.job_tail = 0;
+		}
+		pthread_mutex_unlock(&R.lock);
+		if (R.ns_len) {
+			resolver_dns(&addr, e->host);
+		} else {
+			resolver_fill(&addr, e->host, 0);
+		}
+		pthread_mutex_lock(&R.lock);
+		e->addr = addr;
+		e->pending = 0;
+		e->expire = resolver_now() + (addr.err ? RESOLVER_FAIL_TTL : (uint64_t)R.ttl * 1000);
+		w = e->wait;
+		e->wait = 0;
+		resolver_done(e, w);
+		if (R.ttl == 0) {
+			resolver_remove(e);
+		}
+		pthread_mutex_unlock(&R.lock);
+		resolver_notify(w);
+		pthread_mutex_lock(&R.lock);
+	}
+	pthread_mutex_unlock(&R.lock);
+	return 0;
+}
+
+int
+resolver_init(int thread, int ttl, const char *nameserver) {
+	int i;
+	memset(&R, 0, sizeof(R));
+	if (nameserver && resolver_nameserver(nameserver)) {
+		fprintf(stderr, "resolver: invalid name server %s\n", nameserver);
+		return -1;
+	}
+	if (thread <= 0) {
+		thread = 1;
+	} else if (thread > RESOLVER_MAX_THREAD) {
+		thread = RESOLVER_MAX_THREAD;
+	}
+	R.ttl = ttl > 0 ? ttl : 0;
+	pthread_mutex_init(&R.lock, 0);
+	pthread_cond_init(&R.cond, 0);
+	for (i = 0; i < thread; i++) {
+		if (pthread_create(&R.pid[i], 0, resolver_thread, 0)) {
+			break;
+		}
+	}
+	R.thread = i;
+	if (i == 0) {
+		pthread_cond_destroy(&R.cond);
+		pthread_mutex_destroy(&R.lock);
+		return -1;
+	}
+	return 0;
+}
+
+// Waits for the lookups in progress, the queued ones fail with EAI_AGAIN.
+void
+resolver_unit(void) {
+	int i;
+	pthread_mutex_lock(&R.lock);
+	R.quit = 1;
+	pthread_cond_broadcast(&R.cond);
+	pthread_mutex_unlock(&R.lock);
+	for (i = 0; i < R.thread; i++) {
+		pthread_join(R.pid[i], 0);
+	}
+	for (i = 0; i < RESOLVER_HASH; i++) {
+		struct resolver_entry *e = R.hash[i];
+		while (e) {
+			struct resolver_entry *next = e->next;
+			struct resolver_wait *w = e->wait;
+			e->addr.err = EAI_AGAIN;
+			e->addr.n = 0;
+			resolver_done(e, w);
+			resolver_notify(w);
+			free(e);
+			e = next;
+		}
+	}
+	pthread_cond_destroy(&R.cond);
+	pthread_mutex_destroy(&R.lock);
+}
+
+int
+resolver_query(const char *host, struct resolver_addr *ra, resolver_cb cb, void *ud) {
+	unsigned h;
+	size_t sz;
+	uint64_t now;
+	struct resolver_entry *e;
+	struct resolver_wait *w;
+	resolver_fill(ra, host, AI_NUMERICHOST);
+	if (ra->err != EAI_NONAME) {
+		return 0;
+	}
+	w = (struct resolver_wait *)malloc(sizeof(*w));
+	w->ra = ra;
+	w->cb = cb;
+	w->ud = ud;
+	h = resolver_hash(host);
+	now = resolver_now();
+	pthread_mutex_lock(&R.lock);
+	for (e = R.hash[h]; e; e = e->next) {
+		if (strcmp(e->host, host) == 0) {
+			break;
+		}
+	}
+	if (e && !e->pending && e->expire <= now) {
+		resolver_remove(e);
+		e = 0;
+	}
+	if (e && !e->pending) {
+		*ra = e->addr;
+		pthread_mutex_unlock(&R.lock);
+		free(w);
+		return 0;
+	}
+	if (e == 0) {
+		resolver_sweep(now);
+		sz = strlen(host);
+		e = (struct resolver_entry *)malloc(sizeof(*e) + sz);
+		memset(e, 0, sizeof(*e));
+		memcpy(e->host, host, sz + 1);
+		e->pending = 1;
+		e->next = R.hash[h];
+		R.hash[h] = e;
+		R.n++;
+		if (R.job_tail) {
+			R.job_tail->job = e;
+		} else {
+			R.job_head = e;
+		}
+		R.job_tail = e;
+		pthread_cond_signal(&R.cond);
+	}
+	w->next = e->wait;
+	e->wait = w;
+	pthread_mutex_unlock(&R.lock);
+	return 1;
+}
@@ -0,0 +1,26 @@
+#ifndef _resolver_h_
+#define _resolver_h_
+
+#include <sys/socket.h>
+
+#define RESOLVER_MAX_ADDR 8
+
+// Addresses of a host, the ports are left 0. err is 0 or a getaddrinfo error.
+struct resolver_addr {
+	int err;
+	int n;
+	socklen_t len[RESOLVER_MAX_ADDR];
+	struct sockaddr_storage addr[RESOLVER_MAX_ADDR];
+};
+
+typedef void (*resolver_cb)(void *ud);
+
+// thread: lookup threads, ttl: seconds a result is cached, 0 disables the cache.
+// nameserver: ip[:port] asked directly instead of getaddrinfo, or 0.
+int resolver_init(int thread, int ttl, const char *nameserver);
+void resolver_unit(void);
+// Returns 0 with ra filled for a numeric or cached host, otherwise returns 1 and
+// a resolver thread fills ra and calls cb later. ra must live until then.
+int resolver_query(const char *host, struct resolver_addr *ra, resolver_cb cb, void *ud);
+
+#endif // _resolver_h_
@@ -3,6 +3,9 @@
 #include "queue.h"
 #include "lock.h"
 #include "env.h"
+#include "hash.h"
+#include "mpool.h"
+#include "socket.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -16,28 +19,42 @@ struct service {
 	int session;
 	struct queue *queue;
 	FILE *logfile;
+	struct spinlock pause_lock;
+	int *paused;
+	int paused_n;
+	int paused_cap;
 };
 
 struct service_global {
 	int total;
 	struct index *index;
 	struct env *env;
-	struct env *names;
+	struct rwlock names_lock;
+	struct hash *names;
 	uint32_t log;
+	int socket_pause;
 };
 
 static struct service_global g;
 
 void *service_alloc(void *p, int size) {
 	if (0 == size) {
-		if (p) free(p);
+		if (p) mpool_free(p);
 		return 0;
 	}
-	p = malloc(size);
+	p = mpool_alloc(size);
 	memset(p, 0, size);
 	return p;
 }
 
+void service_share(void *p, void *interior) {
+	mpool_share(p, interior);
+}
+
+void service_retain(void *p) {
+	mpool_retain(p);
+}
+
 void service_log(uint32_t handle, const char *fmt, ...) {
 	if (g.log == 0) {
 		fprintf(stderr, "[%u] ", handle);
@@ -74,12 +91,13 @@ static void initialize(const char *config) {
 	g.log = 0;
 	g.total = 0;
 	g.index = index_new();
-	g.names = env_create(0);
+	rwlock_init(&g.names_lock);
+	g.names = hash_new(0);
 }
 
 static void finalize(void) {
 	index_free(g.index);
-	env_release(g.names);
+	hash_free(g.names);
 	env_release(g.env);
 }
 
@@ -95,12 +113,24 @@ static inline int service_total(void) {
 	return g.total;
 }
 
+// handle 0 removes the name
 void service_name(const char *name, uint32_t handle) {
-	env_setint(g.names, name, handle);
+	int size = strlen(name);
+	rwlock_wlock(&g.names_lock);
+	if (handle) {
+		hash_set(g.names, name, size, (void *)(uintptr_t)handle);
+	} else {
+		hash_remove(g.names, name, size);
+	}
+	rwlock_wunlock(&g.names_lock);
 }
 
 uint32_t service_query(const char *name) {
-	return (uint32_t)env_getint(g.names, name);
+	uintptr_t handle;
+	rwlock_rlock(&g.names_lock);
+	handle = (uintptr_t)hash_get(g.names, name, strlen(name));
+	rwlock_runlock(&g.names_lock);
+	return (uint32_t)handle;
 }
 
 const char *service_env_get(const char *key) {
@@ -143,6 +173,7 @@ uint32_t service_create(struct module *module, const char *param) {
 	s->module = *module;
 	s->session = 0;
 	s->logfile = 0;
+	spinlock_init(&s->pause_lock);
 	s->handle = service_regist(s);
 	s->queue = queue_create(s->handle);
 	service_total_inc();
@@ -155,6 +186,7 @@ uint32_t service_create(struct module *module, const char *param) {
 		while (!(s = (struct service *)index_release(g.index, handle))) {}
 		queue_try_release(s->queue);
 		queue_release(s->queue, queue_message_dtor, (void *)(uintptr_t)handle);
+		spinlock_unit(&s->pause_lock);
 		service_alloc(s, 0);
 		service_total_dec();
 		return 0;
@@ -173,6 +205,8 @@ int service_release(uint32_t handle) {
 	queue_try_release(s->queue);
 	if (s->logfile)
 		fclose(s->logfile);
+	spinlock_unit(&s->pause_lock);
+	free(s->paused);
 	service_alloc(s, 0);
 	service_total_dec();
 	service_log(handle, "RELEASE\n");
@@ -205,6 +239,41 @@ int service_mqlen(uint32_t handle) {
 
 void log_output(FILE *f, struct message *m);
 
+// Sockets paused for a service stay in its list until its queue drains to a
+// quarter of the threshold. The pause goes out before the id is listed, so a
+// resume can't get ahead of it.
+static void service_socket_pause(uint32_t handle, int id) {
+	struct service *s = service_grab(handle);
+	if (!s) return;
+	if (queue_length(s->queue) > g.socket_pause) {
+		int i;
+		spinlock_lock(&s->pause_lock);
+		for (i=0; i<s->paused_n; i++) {
+			if (s->paused[i] == id)
+				break;
+		}
+		if (i == s->paused_n) {
+			socket_throttle(id, 1);
+			if (s->paused_n == s->paused_cap) {
+				s->paused_cap = s->paused_cap ? s->paused_cap * 2 : 8;
+				s->paused = realloc(s->paused, s->paused_cap * sizeof(int));
+			}
+			s->paused[s->paused_n++] = id;
+		}
+		spinlock_unlock(&s->pause_lock);
+	}
+	service_release(handle);
+}
+
+static void service_socket_resume(struct service *s) {
+	int i;
+	spinlock_lock(&s->pause_lock);
+	for (i=0; i<s->paused_n; i++)
+		socket_throttle(s->paused[i], 0);
+	s->paused_n = 0;
+	spinlock_unlock(&s->pause_lock);
+}
+
 struct monitor;
 void monitor_trigger(struct monitor *monitor, uint32_t source, uint32_t handle);
 
@@ -231,7 +300,12 @@ struct queue *service_dispatch(struct monitor *monitor, struct queue *q) {
 	monitor_trigger(monitor, m.source, handle);
 	if (s->logfile)
 		log_output(s->logfile, &m);
+	// sends to one socket during a dispatch go out together when it returns
+	socket_cork();
 	s->module.dispatch(s->handle, s->ud, &m);
+	socket_uncork();
+	if (s->paused_n && queue_length(q) <= g.socket_pause / 4)
+		service_socket_resume(s);
 	service_alloc(m.data, 0);
 	monitor_trigger(monitor, 0, 0);
 	struct queue *next = worker_queue_pop();
@@ -247,7 +321,6 @@ struct queue *service_dispatch(struct monitor *monitor, struct queue *q) {
 #include <pthread.h>
 
 #include "timer.h"
-#include "socket.h"
 #include "dump.h"
 
 static FILE *log_open(uint32_t handle) {
@@ -363,22 +436,52 @@ static void service_timer_dispatch(void *p) {
 	service_send(evt->handle, &m);
 }
 
-static int service_socket_poll(void) {
+// The socket layer leaves this much room in front of received data, so the
+// message header shares one pooled block with the payload.
+#define SOCKET_HEADROOM (sizeof(struct socket_message) + 8)
+
+static int service_socket_poll(int thread) {
 	struct socket_message sm;
-	if (!socket_poll(&sm))
+	if (!socket_poll(thread, &sm))
 		return 0;
 	struct message m;
-	int size = sizeof sm;
+	uint32_t handle = (uint32_t)(uintptr_t)sm.ud;
+	if (sm.type == SOCKET_PACKAGE) {
+		// a package of a redirected socket, the way a gate forwards it
+		m.source = 0;
+		m.session = 0;
+		m.data = sm.data;
+		m.size = sm.size;
+		m.proto = SERVICE_PROTO_CLIENT;
+		if (g.socket_pause > 0)
+			service_socket_pause(handle, sm.id);
+		if (-1 == service_send(handle, &m))
+			service_alloc(m.data, 0);
+		return 1;
+	}
+	struct socket_message *header;
+	int shared = sm.type == SOCKET_DATA || sm.type == SOCKET_UDP || sm.type == SOCKET_UDPBATCH;
+	if (shared) {
+		header = (struct socket_message *)(sm.data - SOCKET_HEADROOM);
+		*header = sm;
+		mpool_share(header, sm.data);
+	} else {
+		header = service_alloc(0, sizeof sm);
+		*header = sm;
+	}
 	m.source = 0;
 	m.session = 0;
-	m.data = service_alloc(0, size);
-	m.size = size;
+	m.data = header;
+	m.size = sizeof sm;
 	m.proto = SERVICE_PROTO_SOCKET;
-	memcpy(m.data, &sm, size);
-	uint32_t handle = (uint32_t)(uintptr_t)sm.ud;
-	if (-1 == service_send(handle, &m))
+	if (shared && g.socket_pause > 0)
+		service_socket_pause(handle, sm.id);
+	if (-1 == service_send(handle, &m)) {
+		if (shared)
+			service_alloc(sm.data, 0);
 		service_alloc(m.data, 0);
-  return 1;
+	}
+	return 1;
 }
 
 extern struct module lua_mod;
@@ -478,9 +581,15 @@ static void *timer(void *p) {
 	return 0;
 }
 
+struct socket_param {
+	int thread;
+	struct watcher *watcher;
+};
+
 static void *socket(void *p) {
-	struct watcher *watcher = (struct watcher *)p;
-	while (service_socket_poll()) {
+	struct socket_param *sp = (struct socket_param *)p;
+	struct watcher *watcher = sp->watcher;
+	while (service_socket_poll(sp->thread)) {
 		if (watcher->sleep >= watcher->thread)
 			pthread_cond_signal(&watcher->cond);
 	}
@@ -533,9 +642,11 @@ static void start(int thread) {
 	struct watcher watcher;
 	watcher_init(&watcher, thread, wp);
 
+	int nsocket = socket_thread();
+	struct socket_param sp[nsocket];
 
-	pthread_t pid[thread+3];
-	int i;
+	pthread_t pid[thread+nsocket+2];
+	int i, j;
 	for (i=0; i<thread; i++) {
 		wp[i].watcher = &watcher;
 		wp[i].thread = i;
@@ -544,19 +655,45 @@ static void start(int thread) {
 	}
 
 	pthread_create(&pid[i++], 0, timer, &watcher);
-	pthread_create(&pid[i++], 0, socket, &watcher);
+	for (j=0; j<nsocket; j++) {
+		sp[j].watcher = &watcher;
+		sp[j].thread = j;
+		pthread_create(&pid[i++], 0, socket, &sp[j]);
+	}
 	pthread_create(&pid[i++], 0, monitor, &watcher);
 
-	for (i=0; i<thread+3; i++)
+	for (i=0; i<thread+nsocket+2; i++)
 		pthread_join(pid[i], 0);
 	watcher_unit(&watcher);
 }
 
+static int service_env_int(const char *key, int def) {
+	const char *val = service_env_get(key);
+	if (!val)
+		return def;
+	return atoi(val);
+}
+
 void service_start(const char *config) {
+	mpool_init();
 	initialize(config);
 	worker_queue_init();
 	timer_init(service_timer_dispatch, service_alloc);
-	socket_init(service_alloc);
+
+	struct socket_config sc;
+	sc.thread = service_env_int("socket_thread", 1);
+	sc.edge = service_env_int("socket_edge", 0);
+	sc.uring = service_env_int("socket_uring", 0);
+	sc.max = service_env_int("socket_max", 65536);
+	sc.resolver = service_env_int("socket_resolver", 2);
+	sc.dns_ttl = service_env_int("socket_dns_ttl", 60);
+	sc.nameserver = service_env_get("socket_nameserver");
+	sc.headroom = SOCKET_HEADROOM;
+	g.socket_pause = service_env_int("socket_pause", 0);
+	if (socket_init(service_alloc, &sc)) {
+		fprintf(stderr, "socket init failed\n");
+		exit(1);
+	}
 
 	struct module log_mod = {
 		log_dispatch,
@@ -574,4 +711,5 @@ void service_start(const char *config) {
 	socket_unit();
 	timer_unit();
 	finalize();
+	mpool_unit();
 }
@@ -6,6 +6,9 @@
 #define SERVICE_PROTO_RESP 0
 #define SERVICE_PROTO_ERROR 1
 #define SERVICE_PROTO_SOCKET 2
+#define SERVICE_PROTO_CLIENT 4
+#define SERVICE_PROTO_TEXT 6
+#define SERVICE_PROTO_KV 7
 
 struct message {
 	uint32_t source;
@@ -22,6 +25,11 @@ struct module {
 };
 
 void *service_alloc(void *, int);
+// interior, a pointer into the block p, is freed on its own. The 4 bytes in
+// front of interior are overwritten.
+void service_share(void *p, void *interior);
+// p is freed once more before the block is released
+void service_retain(void *p);
 
 void service_log(uint32_t handle, const char *fmt, ...);
 uint32_t service_create(struct module *module, const char *param);
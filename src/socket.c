@@ -1,27 +1,42 @@
+#define _GNU_SOURCE
 #include "socket.h"
 #include "event.h"
+#include "lock.h"
+#include "resolver.h"
 
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <stddef.h>
 #include <errno.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <assert.h>
 #include <unistd.h>
 
 #define MAX_EVENT 64
 #define MAX_SOCKET_P 16
+#define MAX_SOCKET_LIMIT_P 20
 #define MAX_SOCK_INFO 128
 #define MIN_SOCK_BUFF 64
+#define MAX_SOCK_DRAIN (1024 * 1024)
 #define MAX_SOCKET (1<<MAX_SOCKET_P)
+#define MAX_SOCKET_THREAD 64
+#define SLOT_PAGE_P 8
+#define SLOT_PAGE (1<<SLOT_PAGE_P)
 
 #define SOCKET_TYPE_INVALID 0
 #define SOCKET_TYPE_RESERVE 1
@@ -44,19 +59,49 @@
 #define SOCKET_REQ_UDP 9
 #define SOCKET_REQ_SETUDP 10
 #define SOCKET_REQ_SENDUDP 11
+#define SOCKET_REQ_SENDUDPV 12
+#define SOCKET_REQ_PAUSE 13
+#define SOCKET_REQ_SENDFILE 14
+#define SOCKET_REQ_UDPCONNECT 15
+#define SOCKET_REQ_RESOLVED 16
+#define SOCKET_REQ_REDIRECT 17
+#define SOCKET_REQ_REDIRECTED 18
+#define SOCKET_REQ_SENDMULTI 19
 
 #define PROTOCOL_TCP 0
 #define PROTOCOL_UDP 1
 #define PROTOCOL_UDPv6 2
+#define PROTOCOL_UNIX 3
 
 #define UDP_ADDRESS_SIZE 19
 #define MAX_UDP_PACKAGE 65535
-
-#define HASH_ID(id) (id%MAX_SOCKET)
-
-#define atom_cas(ptr, oval, nval) __sync_bool_compare_and_swap(ptr, oval, nval)
-#define atom_inc(ptr) __sync_add_and_fetch(ptr, 1)
-#define atom_and(ptr, n) __sync_and_and_fetch(ptr, n)
+#define MAX_UDP_BATCH 64
+#define MAX_UDP_RECV 16
+#define MAX_ACCEPT_BATCH 64
+#define MAX_SENDFILE (1024 * 1024)
+#define MAX_PACKAGE (16 * 1024 * 1024)
+
+// Why the reads of a socket are off, bits of socket.paused.
+#define PAUSE_USER 1
+#define PAUSE_REDIRECT 2
+#define PAUSE_AUTO 4
+
+#define MAX_CORK_SOCKET 16
+#define MAX_CORK_COPY 4096
+#define MAX_CORK_SIZE (64 * 1024)
+#define MIN_CORK_BUFF 512
+
+// An id is the slot index in the low slot_p bits and the generation of the slot above.
+#define HASH_ID(id) ((id)&S.slot_mask)
+#define ID_TAG16(id) ((uint32_t)((id)>>S.slot_p)&0xffff)
+#define SHARD_ID(id) (HASH_ID(id)&(S.thread-1))
+#define SOCKET_SHARD(id) (&S.shard[SHARD_ID(id)])
+
+// send_object of a buffer
+#define SEND_MEMORY 0
+#define SEND_OBJECT 1
+#define SEND_FILE 2
+#define SEND_SHARED 3
 
 struct buffer {
 	struct buffer *next;
@@ -67,6 +112,22 @@ struct buffer {
 	uint8_t udp_address[UDP_ADDRESS_SIZE];
 };
 
+// The buff of a SEND_FILE buffer, its len stays 0 and the file isn't counted in
+// wb_size. The fd belongs to the buffer.
+struct send_file {
+	int fd;
+	off_t offset;
+	long left;
+};
+
+// The buff of a SEND_SHARED buffer, one block queued to many sockets. Each
+// buffer and each request on the way holds a reference, the last frees data.
+struct send_shared {
+	int ref;
+	int size;
+	char *data;
+};
+
 struct buffer_list {
 	struct buffer *head;
 	struct buffer *tail;
@@ -75,34 +136,97 @@ struct buffer_list {
 #define SIZEOF_TCPBUFFER (offsetof(struct buffer, udp_address[0]))
 #define SIZEOF_UDPBUFFER (sizeof(struct buffer))
 
+// Counters behind socket_info, written by whoever does the syscall.
+struct socket_iostat {
+	long start;
+	long read;
+	long write;
+	long read_call;
+	long write_call;
+	long read_again;
+	long write_again;
+	long wb_peak;
+};
+
+// Splits the stream of a redirected socket into packages with a 2 or 4 byte
+// big endian size in front.
+struct socket_frame {
+	int header;
+	int head_n;
+	uint8_t head[4];
+	int size;
+	int read;
+	char *buffer;	// the package being assembled
+	char *raw;	// received data not split yet, from socket_data_alloc
+	int raw_size;
+	int raw_off;
+};
+
 struct socket {
 	int fd;
 	int id;
 	void *ud;
+	uint32_t sending;
+	struct spinlock dw_lock;
+	int next_free;
 	long wb_size;
 	struct buffer_list high;
 	struct buffer_list low;
 	uint16_t type;
 	uint16_t protocol;
+	uint8_t paused;
+	uint8_t writing;
+	struct buffer_list *ring;	// the list an event_send is writing out
 	union {
 		int size;
 		uint8_t udp_address[UDP_ADDRESS_SIZE];
 	} p;
+	struct socket_frame *frame;
+	struct socket_iostat stat;
 };
 
-struct socketlib {
-	int next_id;
+struct socket_cmd;
+
+struct socket_shard {
+	int index;
+	struct spinlock free_lock;
+	int free_head;
+	int free_tail;
 	struct pollfd *event_fd;
-	int sendctl_fd;
-	int recvctl_fd;
+	int ctrl_fd;
+	int ctrl_notify;
 	int check_ctrl;
-	fd_set rfds;
+	struct socket_cmd *cmd_head;
+	struct socket_cmd *cmd_tail;
 	struct event ev[MAX_EVENT];
-	struct socket slot[MAX_SOCKET];
+	struct iovec iov[IOV_MAX];
 	char buffer[MAX_SOCK_INFO];
 	int ev_idx;
 	int ev_n;
-	uint8_t udpbuffer[MAX_UDP_PACKAGE];
+	int accept_n;
+	int ring_send;	// tcp sends go through event_send
+	uint8_t *udpbuffer;
+	struct socket *drain;	// the framed socket whose last read is being split
+	long wakeup;
+	long event;
+	long request;
+};
+
+struct socketlib {
+	int thread;
+	int edge;
+	int uring;
+	int headroom;
+	int slot_p;
+	int slot_mask;
+	int gen_mask;
+	int balance;
+	struct socket_shard *shard;
+	struct spinlock page_lock;
+	int page_n;
+	int page_max;
+	struct socket **page;
+	struct socket invalid;
 	struct socket_object_interface soi;
 	socket_alloc alloc;
 };
@@ -126,6 +250,13 @@ struct open_req {
 	char host[128];
 };
 
+// An open waiting for its host to be resolved, owned by the resolver until
+// SOCKET_REQ_RESOLVED hands it back.
+struct resolve_req {
+	struct open_req open;
+	struct resolver_addr addr;
+};
+
 struct bind_req {
 	int id;
 	int fd;
@@ -146,6 +277,7 @@ struct send_req {
 	int id;
 	int priority;
 	int size;
+	int offset;
 	char *data;
 };
 
@@ -172,6 +304,41 @@ struct sendudp_req {
 	uint8_t address[UDP_ADDRESS_SIZE];
 };
 
+struct pause_req {
+	int id;
+	int pause;
+	int what;	// PAUSE_USER or PAUSE_AUTO
+};
+
+struct redirect_req {
+	int id;
+	int header;
+	void *ud;
+};
+
+// The bytes the old owner was sent but did not consume, from socket_data_alloc.
+struct redirected_req {
+	int id;
+	int size;
+	char *data;
+};
+
+// The ids of one shard, the array is allocated with the request.
+struct sendmulti_req {
+	int n;
+	int priority;
+	int *ids;
+	struct send_shared *shared;
+};
+
+struct sendfile_req {
+	int id;
+	int fd;
+	int priority;
+	long offset;
+	long size;
+};
+
 struct socket_req {
 	int req;
 	union {
@@ -186,16 +353,43 @@ struct socket_req {
 		struct udp_req udp;
 		struct setudp_req setudp;
 		struct sendudp_req sendudp;
+		struct pause_req pause;
+		struct sendfile_req sendfile;
+		struct resolve_req *resolved;
+		struct redirect_req redirect;
+		struct redirected_req redirected;
+		struct sendmulti_req sendmulti;
 	} u;
 };
 
+struct socket_cmd {
+	struct socket_cmd *next;
+	struct socket_req req;
+};
+
 struct socket_send_object {
 	void *data;
 	int size;
 	void(*free)(void *);
 };
 
+struct socket_cork_buffer {
+	int id;
+	int priority;
+	int size;
+	int cap;
+	char *data;
+};
+
+// Sends of a worker thread held back while a service dispatches a message.
+struct socket_cork {
+	int corked;
+	int n;
+	struct socket_cork_buffer b[MAX_CORK_SOCKET];
+};
+
 static struct socketlib S;
+static __thread struct socket_cork C;
 
 static inline void
 socket_nonblocking(int fd) {
@@ -212,32 +406,207 @@ socket_keepalive(int fd) {
 	setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, (void *)&keepalive, sizeof(keepalive));
 }
 
+static inline long
+socket_time(void) {
+	struct timespec ti;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ti);
+	return (long)ti.tv_sec * 1000 + ti.tv_nsec / 1000000;
+}
+
+// n is the syscall result, errno is only looked at when it's negative.
+static inline void
+socket_stat_read(struct socket *sock, long n) {
+	sock->stat.read_call++;
+	if (n > 0) {
+		sock->stat.read += n;
+	} else if (n < 0 && errno == EAGAIN) {
+		sock->stat.read_again++;
+	}
+}
+
+static inline void
+socket_stat_write(struct socket *sock, long n) {
+	sock->stat.write_call++;
+	if (n > 0) {
+		sock->stat.write += n;
+	} else if (n < 0 && errno == EAGAIN) {
+		sock->stat.write_again++;
+	}
+}
+
+static inline long
+socket_mmsg_bytes(struct mmsghdr *msg, int n) {
+	long sz = 0;
+	int i;
+	if (n < 0) {
+		return -1;
+	}
+	for (i = 0; i < n; i++) {
+		sz += msg[i].msg_len;
+	}
+	return sz;
+}
+
+static inline void
+socket_wb_add(struct socket *sock, int sz) {
+	sock->wb_size += sz;
+	if (sock->wb_size > sock->stat.wb_peak) {
+		sock->stat.wb_peak = sock->wb_size;
+	}
+}
+
+// A host starting with "/" or "./" is a unix socket path, "@name" is a name in
+// the abstract namespace. Returns 0 for any other host, -1 if the path is too long.
+static int
+socket_unix_address(const char *host, struct sockaddr_un *su, socklen_t *len) {
+	size_t n;
+	if (host == 0 || !(host[0] == '/' || host[0] == '@' || (host[0] == '.' && host[1] == '/'))) {
+		return 0;
+	}
+	n = strlen(host);
+	if (n >= sizeof(su->sun_path)) {
+		return -1;
+	}
+	memset(su, 0, sizeof(*su));
+	su->sun_family = AF_UNIX;
+	memcpy(su->sun_path, host, n);
+	if (host[0] == '@') {
+		su->sun_path[0] = 0;
+		*len = offsetof(struct sockaddr_un, sun_path) + n;
+	} else {
+		*len = offsetof(struct sockaddr_un, sun_path) + n + 1;
+	}
+	return 1;
+}
+
+static inline struct socket *
+socket_index(int index) {
+	return &S.page[index >> SLOT_PAGE_P][index & (SLOT_PAGE - 1)];
+}
+
+// Ids from the caller may point into a page never allocated, they get a slot
+// that never matches.
+static inline struct socket *
+socket_slot(int id) {
+	int index = HASH_ID(id);
+	struct socket *page = S.page[index >> SLOT_PAGE_P];
+	if (page == 0) {
+		return &S.invalid;
+	}
+	return &page[index & (SLOT_PAGE - 1)];
+}
+
+// Give an INVALID slot back to its shard. The free list is fifo so a slot
+// rests a while before its next generation is handed out.
+static void
+socket_free_slot(struct socket *sock) {
+	int index = HASH_ID(sock->id);
+	struct socket_shard *shard = &S.shard[index & (S.thread - 1)];
+	sock->next_free = -1;
+	spinlock_lock(&shard->free_lock);
+	if (shard->free_tail < 0) {
+		shard->free_head = index;
+	} else {
+		socket_index(shard->free_tail)->next_free = index;
+	}
+	shard->free_tail = index;
+	spinlock_unlock(&shard->free_lock);
+}
+
+static int
+socket_pop_slot(struct socket_shard *shard) {
+	int index;
+	spinlock_lock(&shard->free_lock);
+	index = shard->free_head;
+	if (index >= 0) {
+		shard->free_head = socket_index(index)->next_free;
+		if (shard->free_head < 0) {
+			shard->free_tail = -1;
+		}
+	}
+	spinlock_unlock(&shard->free_lock);
+	return index;
+}
+
+// Slots are allocated a page at a time up to the configured capacity, and a page
+// lives until socket_unit so slot pointers stay valid. The slots of a page are
+// dealt out to the shards by the low bits of their index.
+static int
+socket_grow(void) {
+	struct socket *page;
+	int i, base;
+	spinlock_lock(&S.page_lock);
+	if (S.page_n == S.page_max) {
+		spinlock_unlock(&S.page_lock);
+		return -1;
+	}
+	page = (struct socket *)S.alloc(0, SLOT_PAGE * sizeof(struct socket));
+	memset(page, 0, SLOT_PAGE * sizeof(struct socket));
+	base = S.page_n * SLOT_PAGE;
+	for (i = 0; i < SLOT_PAGE; i++) {
+		struct socket *sock = &page[i];
+		sock->type = SOCKET_TYPE_INVALID;
+		sock->fd = -1;
+		sock->id = base + i;
+		spinlock_init(&sock->dw_lock);
+	}
+	atom_sync();
+	S.page[S.page_n++] = page;
+	spinlock_unlock(&S.page_lock);
+	for (i = 0; i < SLOT_PAGE; i++) {
+		socket_free_slot(&page[i]);
+	}
+	return 0;
+}
+
+static int
+socket_reserve(int index) {
+	struct socket *sock = socket_index(index);
+	int gen = ((sock->id >> S.slot_p) + 1) & S.gen_mask;
+	int id;
+	if (gen == 0) {
+		gen = 1;
+	}
+	id = (gen << S.slot_p) | index;
+	assert(sock->type == SOCKET_TYPE_INVALID);
+	sock->type = SOCKET_TYPE_RESERVE;
+	sock->fd = -1;
+	sock->sending = ID_TAG16(id) << 16;
+	sock->id = id;
+	return id;
+}
+
+// Reserve a slot on the next shard in turn, or on any shard with a free slot
+// once the capacity is reached. The id tells the shard it belongs to.
 static int
 socket_next_id(void) {
 	int i;
-	for (i = 0; i < MAX_SOCKET; i++) {
-		struct socket *sock;
-		int id = atom_inc(&(S.next_id));
-		if (id < 0) {
-			id = atom_and(&(S.next_id), 0x7fffffff);
-		}
-		sock = &S.slot[HASH_ID(id)];
-		if (sock->type == SOCKET_TYPE_INVALID) {
-			if (atom_cas(&(sock->type), SOCKET_TYPE_INVALID, SOCKET_TYPE_RESERVE)) {
-				sock->id = id;
-				sock->fd = -1;
-				return id;
+	int start = atom_inc(&S.balance);
+	for (i = 0; i < S.thread; i++) {
+		struct socket_shard *shard = &S.shard[(start + i) & (S.thread - 1)];
+		int index;
+		while ((index = socket_pop_slot(shard)) < 0) {
+			if (socket_grow()) {
+				break;
 			}
-			--i;
+		}
+		if (index >= 0) {
+			return socket_reserve(index);
 		}
 	}
 	return -1;
 }
 
+static inline void
+socket_release(struct socket *sock) {
+	sock->type = SOCKET_TYPE_INVALID;
+	socket_free_slot(sock);
+}
+
 static struct socket *
-socket_new(int fd, int id, int protocol, void *ud, int add) {
+socket_new(struct socket_shard *shard, int fd, int id, int protocol, void *ud, int add) {
 	struct socket *sock;
-	sock = &S.slot[HASH_ID(id)];
+	sock = socket_slot(id);
 	assert(sock->type == SOCKET_TYPE_RESERVE);
 	sock->id = id;
 	sock->fd = fd;
@@ -247,9 +616,14 @@ socket_new(int fd, int id, int protocol, void *ud, int add) {
 	sock->protocol = protocol;
 	sock->high.head = sock->high.tail = 0;
 	sock->low.head = sock->low.tail = 0;
+	sock->paused = 0;
+	sock->writing = 0;
+	sock->ring = 0;
+	sock->frame = 0;
+	memset(&sock->stat, 0, sizeof(sock->stat));
+	sock->stat.start = socket_time();
 	if (add) {
-		if (event_add(S.event_fd, fd, sock)) {
-			sock->type = SOCKET_TYPE_INVALID;
+		if (event_add(shard->event_fd, fd, sock)) {
 			fprintf(stderr, "socketlib event add errno:%d.\n", errno);
 			return 0;
 		}
@@ -257,44 +631,112 @@ socket_new(int fd, int id, int protocol, void *ud, int add) {
 	return sock;
 }
 
+// The write interest always stays on in edge triggered mode, only pausing the
+// reads needs an update there.
 static inline void
-socket_send_req(struct socket_req *req) {
+socket_event_write(struct socket_shard *shard, struct socket *sock, int enable) {
+	sock->writing = enable;
+	if (!S.edge) {
+		event_mod(shard->event_fd, sock->fd, sock, !sock->paused, enable);
+	}
+}
+
+static inline void
+socket_ctrl_notify(struct socket_shard *shard) {
+	uint64_t one = 1;
+	if (!atom_cas(&shard->ctrl_notify, 0, 1)) {
+		return;
+	}
 	for (;;) {
-		int n = write(S.sendctl_fd, (void *)req, sizeof *req);
+		int n = write(shard->ctrl_fd, &one, sizeof one);
 		if (n < 0) {
-			if (errno != EINTR && errno != EAGAIN) {
-				fprintf(stderr, "socketlib pipe send request errno:%d.\n", errno);
-				break;
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno != EAGAIN) {
+				fprintf(stderr, "socketlib eventfd notify errno:%d.\n", errno);
 			}
-			continue;
 		}
 		return;
 	}
 }
 
+static inline void
+socket_ctrl_reset(struct socket_shard *shard) {
+	uint64_t n;
+	while (read(shard->ctrl_fd, &n, sizeof n) < 0 && errno == EINTR) {}
+	shard->ctrl_notify = 0;
+	atom_sync();
+}
+
+static inline void
+socket_send_req(struct socket_shard *shard, struct socket_req *req) {
+	struct socket_cmd *prev;
+	struct socket_cmd *cmd = (struct socket_cmd *)S.alloc(0, sizeof *cmd);
+	cmd->next = 0;
+	cmd->req = *req;
+	prev = atom_xchg(&shard->cmd_tail, cmd);
+	prev->next = cmd;
+	socket_ctrl_notify(shard);
+}
+
 static inline int
-socket_recv_req(struct socket_req *req) {
-	for (;;) {
-		int n = read(S.recvctl_fd, (void *)req, sizeof(*req));
-		if (n < 0) {
-			if (errno != EINTR && errno != EAGAIN) {
-				fprintf(stderr, "socketlib pipe recv request errno:%d.\n", errno);
-				return -1;
+socket_recv_req(struct socket_shard *shard, struct socket_req *req) {
+	struct socket_cmd *head = shard->cmd_head;
+	struct socket_cmd *next = ((struct socket_cmd * volatile *)&head->next)[0];
+	if (next == 0) {
+		return -1;
+	}
+	*req = next->req;
+	shard->cmd_head = next;
+	S.alloc(head, 0);
+	return 0;
+}
+
+// A socket file is left behind when a process exits, it's removed unless
+// something still accepts connections on it.
+static int
+_socket_bind_unix(struct sockaddr_un *su, socklen_t len, int protocol, int *family) {
+	struct stat st;
+	int fd = socket(AF_UNIX, protocol == IPPROTO_TCP ? SOCK_STREAM : SOCK_DGRAM, 0);
+	if (fd < 0) {
+		return -1;
+	}
+	if (su->sun_path[0] && stat(su->sun_path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+		int probe = socket(AF_UNIX, protocol == IPPROTO_TCP ? SOCK_STREAM : SOCK_DGRAM, 0);
+		if (probe >= 0) {
+			if (connect(probe, (struct sockaddr *)su, len) != 0 && errno == ECONNREFUSED) {
+				unlink(su->sun_path);
 			}
-			continue;
+			close(probe);
 		}
-		return 0;
 	}
+	if (bind(fd, (struct sockaddr *)su, len) != 0) {
+		close(fd);
+		return -1;
+	}
+	*family = AF_UNIX;
+	return fd;
 }
 
 static int
-_socket_bind(const char *host, int port, int protocol, int *family) {
+_socket_bind(const char *host, int port, int protocol, int reuseport, int *family) {
 	int fd;
 	int status;
 	int reuse = 1;
 	struct addrinfo ai_hints;
 	struct addrinfo *ai_list = 0;
+	struct sockaddr_un su;
+	socklen_t len;
 	char portstr[16];
+	status = socket_unix_address(host, &su, &len);
+	if (status != 0) {
+		// a unix socket path has one owner, no reuseport group
+		if (status < 0 || reuseport) {
+			return -1;
+		}
+		return _socket_bind_unix(&su, len, protocol, family);
+	}
 	if (host == 0 || host[0] == 0) {
 		host = "0.0.0.0";
 	}
@@ -320,6 +762,9 @@ _socket_bind(const char *host, int port, int protocol, int *family) {
 	if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (void *)&reuse, sizeof(int)) == -1) {
 		goto _failed;
 	}
+	if (reuseport && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, (void *)&reuse, sizeof(int)) == -1) {
+		goto _failed;
+	}
 	status = bind(fd, (struct sockaddr *)ai_list->ai_addr, ai_list->ai_addrlen);
 	if (status != 0) {
 		goto _failed;
@@ -334,9 +779,9 @@ _failed_fd:
 }
 
 static inline int
-_socket_listen(const char *host, int port) {
+_socket_listen(const char *host, int port, int reuseport) {
 	int family = 0;
-	int listen_fd = _socket_bind(host, port, IPPROTO_TCP, &family);
+	int listen_fd = _socket_bind(host, port, IPPROTO_TCP, reuseport, &family);
 	if (listen_fd < 0) {
 		return -1;
 	}
@@ -344,15 +789,30 @@ _socket_listen(const char *host, int port) {
 		close(listen_fd);
 		return -1;
 	}
+	socket_nonblocking(listen_fd);
 	return listen_fd;
 }
 
+static inline void
+socket_shared_release(struct send_shared *shared) {
+	if (atom_dec(&shared->ref) == 0) {
+		S.alloc(shared->data, 0);
+		S.alloc(shared, 0);
+	}
+}
+
 static inline void
 _free_buffer(struct buffer *tmp) {
-	if (tmp->send_object)
+	if (tmp->send_object == SEND_FILE) {
+		close(((struct send_file *)tmp->buff)->fd);
+		S.alloc(tmp->buff, 0);
+	} else if (tmp->send_object == SEND_SHARED) {
+		socket_shared_release((struct send_shared *)tmp->buff);
+	} else if (tmp->send_object == SEND_OBJECT) {
 		S.soi.free(tmp->buff);
-	else
+	} else {
 		S.alloc(tmp->buff, 0);
+	}
 	S.alloc(tmp, 0);
 }
 
@@ -367,8 +827,31 @@ socket_free_buffer_list(struct buffer_list *list) {
 	list->head = list->tail = 0;
 }
 
+// Received data keeps S.headroom free bytes in front for the caller.
+static inline char *
+socket_data_alloc(int size) {
+	char *p = (char *)S.alloc(0, S.headroom + size);
+	return p + S.headroom;
+}
+
+static inline void
+socket_data_free(char *data) {
+	S.alloc(data - S.headroom, 0);
+}
+
+static void
+socket_frame_free(struct socket_frame *f) {
+	if (f->buffer) {
+		S.alloc(f->buffer, 0);
+	}
+	if (f->raw) {
+		socket_data_free(f->raw);
+	}
+	S.alloc(f, 0);
+}
+
 static void
-socket_force_close(struct socket *sock, struct socket_message *ret) {
+socket_force_close(struct socket_shard *shard, struct socket *sock, struct socket_message *ret) {
 	ret->id = sock->id;
 	ret->ud = sock->ud;
 	ret->data = 0;
@@ -377,15 +860,59 @@ socket_force_close(struct socket *sock, struct socket_message *ret) {
 		return;
 	}
 	assert(sock->type != SOCKET_TYPE_RESERVE);
-	socket_free_buffer_list(&sock->high);
-	socket_free_buffer_list(&sock->low);
+	if (sock->ring == 0) {
+		socket_free_buffer_list(&sock->high);
+		socket_free_buffer_list(&sock->low);
+	}
+	if (sock->frame) {
+		socket_frame_free(sock->frame);
+		sock->frame = 0;
+	}
+	if (shard->drain == sock) {
+		shard->drain = 0;
+	}
 	if (sock->type != SOCKET_TYPE_PACCEPT && sock->type != SOCKET_TYPE_PLISTEN) {
-		event_del(S.event_fd, sock->fd);
+		event_del(shard->event_fd, sock->fd);
 	}
+	spinlock_lock(&sock->dw_lock);
 	if (sock->type != SOCKET_TYPE_BIND) {
 		close(sock->fd);
 	}
 	sock->type = SOCKET_TYPE_INVALID;
+	spinlock_unlock(&sock->dw_lock);
+	if (sock->ring == 0) {
+		// otherwise the kernel may still read the buffers, they and the slot
+		// wait for the completion of the cancelled send
+		socket_free_slot(sock);
+	}
+}
+
+// sending counts the send requests of a socket still queued to its socket thread,
+// the high 16 bits tag the id so requests of a reused slot are not counted.
+static inline void
+socket_inc_sending(struct socket *sock, int id) {
+	for (;;) {
+		uint32_t sending = sock->sending;
+		if ((sending >> 16) != ID_TAG16(id)) {
+			return;
+		}
+		if (atom_cas(&sock->sending, sending, sending + 1)) {
+			return;
+		}
+	}
+}
+
+static inline void
+socket_dec_sending(struct socket *sock, int id) {
+	for (;;) {
+		uint32_t sending = sock->sending;
+		if ((sending >> 16) != ID_TAG16(id) || (sending & 0xffff) == 0) {
+			return;
+		}
+		if (atom_cas(&sock->sending, sending, sending - 1)) {
+			return;
+		}
+	}
 }
 
 static inline void
@@ -399,99 +926,366 @@ socket_send_object_init(struct socket_send_object *so, void *data, int size) {
 		so->data = S.soi.data(data);
 		so->size = S.soi.size(data);
 		so->free = S.soi.free;
-		return 1;
+		return SEND_OBJECT;
 	} else {
 		so->data = data;
 		so->size = size;
 		so->free = _soi_free;
-		return 0;
+		return SEND_MEMORY;
 	}
 }
 
-static int
-socket_send_buffer_list(struct socket *sock, struct buffer_list *list, struct socket_message *ret) {
-	while (list->head) {
-		struct buffer *tmp = list->head;
-		for (;;) {
-			int sz = write(sock->fd, tmp->ptr, tmp->len);
-			if (sz < 0) {
-				switch (errno) {
-				case EINTR:
-					continue;
-				case EAGAIN:
-					return -1;
-				}
-				fprintf(stderr, "socketlib write to fd %d (fd=%d) errno:%d.\n", sock->id, sock->fd, errno);
-				socket_force_close(sock, ret);
-				return SOCKET_CLOSE;
-			}
-			sock->wb_size -= sz;
-			if (sz != tmp->len) {
-				tmp->ptr += sz;
-				tmp->len -= sz;
-				return -1;
-			}
-			break;
-		}
-		list->head = tmp->next;
-		_free_buffer(tmp);
-	}
-	list->tail = 0;
-	return -1;
+static inline void
+freebuffer(void *data, int size) {
+	struct socket_send_object so;
+	socket_send_object_init(&so, data, size);
+	so.free(data);
 }
 
 static inline int
-socket_buffer_list_complete(struct buffer_list *list) {
-	struct buffer *wb = list->head;
-	if (wb == 0) {
+udp_address_size(const uint8_t *udp_address) {
+	switch (udp_address[0]) {
+	case PROTOCOL_UDP:
+		return 1 + 2 + 4;
+	case PROTOCOL_UDPv6:
+		return 1 + 2 + 16;
+	case PROTOCOL_UNIX:
+		// unix datagrams only go to the connected peer
 		return 1;
 	}
-	return (void *)wb->ptr == wb->buff;
+	return 0;
 }
 
-static int
-socket_send_buffer(struct socket *sock, struct socket_message *ret) {
-	assert(socket_buffer_list_complete(&sock->low));
-	if (socket_send_buffer_list(sock, &sock->high, ret) == SOCKET_CLOSE) {
-		return SOCKET_CLOSE;
+static socklen_t
+udp_socket_address(struct socket *sock, const uint8_t udp_address[UDP_ADDRESS_SIZE], union sockaddr_all *sa) {
+	uint16_t port = 0;
+	uint8_t type = udp_address[0];
+	if (type != sock->protocol) {
+		return 0;
 	}
-	if (sock->high.head == 0) {
-		if (sock->low.head != 0) {
-			if (socket_send_buffer_list(sock, &sock->low, ret) == SOCKET_CLOSE) {
-				return SOCKET_CLOSE;
-			}
-			if (!socket_buffer_list_complete(&sock->low)) {
-				struct buffer_list *high;
-				struct buffer_list *low = &sock->low;
-				struct buffer *tmp = low->head;
-				low->head = tmp->next;
-				if (low->head == 0) {
-					low->tail = 0;
-				}
-				high = &sock->high;
-				assert(high->head == 0);
-				tmp->next = 0;
-				high->head = high->tail = tmp;
-			}
-		} else {
-			event_write(S.event_fd, sock->fd, sock, 0);
-			if (sock->type == SOCKET_TYPE_HALFCLOSE) {
-				socket_force_close(sock, ret);
-				return SOCKET_CLOSE;
-			}
-		}
+	memcpy(&port, udp_address + 1, sizeof(uint16_t));
+	switch (sock->protocol) {
+	case PROTOCOL_UDP:
+		memset(&sa->v4, 0, sizeof(sa->v4));
+		sa->s.sa_family = AF_INET;
+		sa->v4.sin_port = port;
+		memcpy(&sa->v4.sin_addr, udp_address + 1 + sizeof(uint16_t), sizeof(sa->v4.sin_addr));
+		return sizeof(sa->v4);
+	case PROTOCOL_UDPv6:
+		memset(&sa->v6, 0, sizeof(sa->v6));
+		sa->s.sa_family = AF_INET6;
+		sa->v6.sin6_port = port;
+		memcpy(&sa->v6.sin6_addr, udp_address + 1 + sizeof(uint16_t), sizeof(sa->v6.sin6_addr));
+		return sizeof(sa->v6);
+	case PROTOCOL_UNIX:
+		return 0;
 	}
-	return -1;
+	return 0;
 }
 
+static inline void
+socket_list_pop(struct buffer_list *list) {
+	struct buffer *tmp = list->head;
+	list->head = tmp->next;
+	if (list->head == 0) {
+		list->tail = 0;
+	}
+	_free_buffer(tmp);
+}
+
+// A partially written low buffer moves to the front of high so it is finished
+// first, high is only filled meanwhile while an event_send writes low. Both
+// lists look empty halfway through, so a worker in socket_direct_write must not
+// check them meanwhile.
+static void
+socket_list_promote(struct socket *sock) {
+	struct buffer *tmp = sock->low.head;
+	spinlock_lock(&sock->dw_lock);
+	sock->low.head = tmp->next;
+	if (sock->low.head == 0) {
+		sock->low.tail = 0;
+	}
+	tmp->next = sock->high.head;
+	sock->high.head = tmp;
+	if (sock->high.tail == 0) {
+		sock->high.tail = tmp;
+	}
+	spinlock_unlock(&sock->dw_lock);
+}
+
+// Drop the sz bytes written from the front of list, returns what is left of sz
+// for the next list.
+static ssize_t
+socket_list_sent(struct socket *sock, struct buffer_list *list, ssize_t sz) {
+	while (list->head && list->head->send_object != SEND_FILE && sz >= list->head->len) {
+		sz -= list->head->len;
+		socket_list_pop(list);
+	}
+	if (list->head && sz > 0) {
+		struct buffer *tmp = list->head;
+		tmp->ptr += sz;
+		tmp->len -= (int)sz;
+		sz = 0;
+		if (list == &sock->low) {
+			socket_list_promote(sock);
+		}
+	}
+	return sz;
+}
+
+// Stream the head file buffer of list with sendfile, returns 0 once the file is
+// done and the next buffers can be sent, -1 if the socket is full.
+static int
+socket_send_file(struct socket_shard *shard, struct socket *sock, struct buffer_list *list, struct socket_message *ret) {
+	struct send_file *f = (struct send_file *)list->head->buff;
+	for (;;) {
+		size_t n = f->left > MAX_SENDFILE ? MAX_SENDFILE : (size_t)f->left;
+		ssize_t sz = sendfile(sock->fd, f->fd, &f->offset, n);
+		socket_stat_write(sock, sz);
+		if (sz < 0) {
+			switch (errno) {
+			case EINTR:
+				continue;
+			case EAGAIN:
+				return -1;
+			}
+			fprintf(stderr, "socketlib sendfile to %d (fd=%d) errno:%d.\n", sock->id, sock->fd, errno);
+			socket_force_close(shard, sock, ret);
+			return SOCKET_CLOSE;
+		}
+		if (sz == 0) {
+			// the file is shorter than asked for
+			fprintf(stderr, "socketlib sendfile to %d (fd=%d) %ld bytes missing.\n", sock->id, sock->fd, f->left);
+			f->left = 0;
+		}
+		f->left -= sz;
+		if (f->left == 0) {
+			socket_list_pop(list);
+			return 0;
+		}
+		// a short count may come from the end of the file, go on until EAGAIN
+		if (list == &sock->low) {
+			socket_list_promote(sock);
+			list = &sock->high;
+		}
+	}
+}
+
+// Gather up to IOV_MAX buffers from high then low into one writev, a file
+// buffer ends the gathering and goes out with sendfile once it's the first.
+static int
+socket_send_tcp_list(struct socket_shard *shard, struct socket *sock, struct socket_message *ret) {
+	for (;;) {
+		struct buffer_list *list[2] = { &sock->high, &sock->low };
+		struct buffer *tmp = 0;
+		struct iovec *iov = shard->iov;
+		int i, r, full, cnt = 0;
+		ssize_t sz, total = 0;
+		for (i = 0; i < 2 && cnt < IOV_MAX; i++) {
+			for (tmp = list[i]->head; tmp && cnt < IOV_MAX; tmp = tmp->next) {
+				if (tmp->send_object == SEND_FILE) {
+					break;
+				}
+				iov[cnt].iov_base = tmp->ptr;
+				iov[cnt].iov_len = tmp->len;
+				total += tmp->len;
+				cnt++;
+			}
+			if (tmp) {
+				break;
+			}
+		}
+		if (cnt == 0) {
+			if (tmp == 0) {
+				return -1;
+			}
+			r = socket_send_file(shard, sock, list[i], ret);
+			if (r != 0) {
+				return r;
+			}
+			continue;
+		}
+		sz = writev(sock->fd, iov, cnt);
+		socket_stat_write(sock, sz);
+		if (sz < 0) {
+			switch (errno) {
+			case EINTR:
+				continue;
+			case EAGAIN:
+				return -1;
+			}
+			fprintf(stderr, "socketlib write to fd %d (fd=%d) errno:%d.\n", sock->id, sock->fd, errno);
+			socket_force_close(shard, sock, ret);
+			return SOCKET_CLOSE;
+		}
+		sock->wb_size -= sz;
+		full = sz < total;
+		sz = socket_list_sent(sock, &sock->high, sz);
+		socket_list_sent(sock, &sock->low, sz);
+		if (full) {
+			return -1;
+		}
+	}
+}
+
+// Queued datagrams keep their own destination, flush them with sendmmsg.
 static int
-socket_forward_tcp(struct socket *sock, struct socket_message *ret) {
+socket_send_udp_list(struct socket_shard *shard, struct socket *sock, struct socket_message *ret) {
+	for (;;) {
+		struct buffer_list *list[2] = { &sock->high, &sock->low };
+		struct mmsghdr msg[MAX_UDP_BATCH];
+		union sockaddr_all sa[MAX_UDP_BATCH];
+		struct iovec *iov = shard->iov;
+		struct buffer *tmp;
+		int i, n, cnt = 0;
+		for (i = 0; i < 2 && cnt < MAX_UDP_BATCH; i++) {
+			for (tmp = list[i]->head; tmp && cnt < MAX_UDP_BATCH; tmp = tmp->next) {
+				iov[cnt].iov_base = tmp->ptr;
+				iov[cnt].iov_len = tmp->len;
+				memset(&msg[cnt], 0, sizeof(msg[cnt]));
+				msg[cnt].msg_hdr.msg_name = &sa[cnt];
+				msg[cnt].msg_hdr.msg_namelen = udp_socket_address(sock, tmp->udp_address, &sa[cnt]);
+				msg[cnt].msg_hdr.msg_iov = &iov[cnt];
+				msg[cnt].msg_hdr.msg_iovlen = 1;
+				cnt++;
+			}
+		}
+		if (cnt == 0) {
+			return -1;
+		}
+		n = sendmmsg(sock->fd, msg, cnt, 0);
+		socket_stat_write(sock, socket_mmsg_bytes(msg, n));
+		if (n < 0) {
+			switch (errno) {
+			case EINTR:
+				continue;
+			case EAGAIN:
+				return -1;
+			}
+			// drop the datagram that can't be sent, like a lost packet
+			fprintf(stderr, "socketlib udp (%d) sendto error %d.\n", sock->id, errno);
+			n = 1;
+		}
+		for (i = 0; i < n; i++) {
+			struct buffer_list *l = sock->high.head ? &sock->high : &sock->low;
+			sock->wb_size -= l->head->len;
+			socket_list_pop(l);
+		}
+		if (n < cnt) {
+			return -1;
+		}
+	}
+}
+
+static inline int
+socket_buffer_list_complete(struct buffer_list *list) {
+	struct buffer *wb = list->head;
+	if (wb == 0) {
+		return 1;
+	}
+	if (wb->send_object == SEND_SHARED) {
+		return wb->ptr == ((struct send_shared *)wb->buff)->data;
+	}
+	return (void *)wb->ptr == wb->buff;
+}
+
+static int
+socket_send_buffer(struct socket_shard *shard, struct socket *sock, struct socket_message *ret) {
+	int r;
+	if (sock->ring) {
+		// the completion of the send goes on
+		return -1;
+	}
+	assert(socket_buffer_list_complete(&sock->low));
+	if (sock->protocol == PROTOCOL_TCP) {
+		r = socket_send_tcp_list(shard, sock, ret);
+	} else {
+		r = socket_send_udp_list(shard, sock, ret);
+	}
+	if (r == SOCKET_CLOSE) {
+		return SOCKET_CLOSE;
+	}
+	if (sock->high.head == 0 && sock->low.head == 0) {
+		socket_event_write(shard, sock, 0);
+		if (sock->type == SOCKET_TYPE_HALFCLOSE) {
+			socket_force_close(shard, sock, ret);
+			return SOCKET_CLOSE;
+		}
+	}
+	return -1;
+}
+
+// With io_uring the head buffers of one list go out by an event_send, they stay
+// queued until it completes so nothing is written around them. One list at a
+// time, a high buffer queued meanwhile can't slip in between. Returns -1 if the
+// ring doesn't take them.
+static int
+socket_ring_send(struct socket_shard *shard, struct socket *sock) {
+	struct buffer_list *list = sock->high.head ? &sock->high : &sock->low;
+	struct buffer *tmp;
+	int cnt = 0;
+	if (!shard->ring_send || sock->protocol != PROTOCOL_TCP) {
+		return -1;
+	}
+	for (tmp = list->head; tmp && cnt < IOV_MAX && tmp->send_object != SEND_FILE; tmp = tmp->next) {
+		shard->iov[cnt].iov_base = tmp->ptr;
+		shard->iov[cnt].iov_len = tmp->len;
+		cnt++;
+	}
+	if (cnt == 0 || event_send(shard->event_fd, sock->fd, sock, shard->iov, cnt)) {
+		return -1;
+	}
+	sock->ring = list;
+	return 0;
+}
+
+// Start writing the buffers queued to an idle socket, a file goes out once the
+// socket is writable.
+static inline void
+socket_write_start(struct socket_shard *shard, struct socket *sock) {
+	if (socket_ring_send(shard, sock)) {
+		socket_event_write(shard, sock, 1);
+	}
+}
+
+static int
+socket_ring_sent(struct socket_shard *shard, struct socket *sock, struct event *ev, struct socket_message *ret) {
+	struct buffer_list *list = sock->ring;
+	int n = ev->res;
+	sock->ring = 0;
+	if (sock->type == SOCKET_TYPE_INVALID) {
+		socket_free_buffer_list(&sock->high);
+		socket_free_buffer_list(&sock->low);
+		socket_free_slot(sock);
+		return -1;
+	}
+	sock->stat.write_call++;
+	if (n < 0) {
+		fprintf(stderr, "socketlib write to %d (fd=%d) errno:%d.\n", sock->id, sock->fd, -n);
+		socket_force_close(shard, sock, ret);
+		return SOCKET_CLOSE;
+	}
+	sock->stat.write += n;
+	sock->wb_size -= n;
+	socket_list_sent(sock, list, n);
+	if (sock->high.head || sock->low.head) {
+		socket_write_start(shard, sock);
+	} else if (sock->type == SOCKET_TYPE_HALFCLOSE) {
+		socket_force_close(shard, sock, ret);
+		return SOCKET_CLOSE;
+	}
+	return -1;
+}
+
+static int
+socket_forward_tcp(struct socket_shard *shard, struct socket *sock, struct socket_message *ret) {
 	int n;
 	int sz = sock->p.size;
-	char *buffer = (char *)S.alloc(0, sz);
+	char *buffer = socket_data_alloc(sz);
 	n = (int)read(sock->fd, buffer, sz);
+	socket_stat_read(sock, n);
 	if (n < 0) {
-		S.alloc(buffer, 0);
+		socket_data_free(buffer);
 		switch (errno) {
 		case EINTR:
 			break;
@@ -499,19 +1293,19 @@ socket_forward_tcp(struct socket *sock, struct socket_message *ret) {
 			fprintf(stderr, "socketlib forward tcp EAGAIN capture.\n");
 			break;
 		default:
-			socket_force_close(sock, ret);
+			socket_force_close(shard, sock, ret);
 			ret->data = strerror(errno);
 			return SOCKET_ERR;
 		}
 		return -1;
 	}
 	if (n == 0) {
-		S.alloc(buffer, 0);
-		socket_force_close(sock, ret);
+		socket_data_free(buffer);
+		socket_force_close(shard, sock, ret);
 		return SOCKET_CLOSE;
 	}
 	if (sock->type == SOCKET_TYPE_HALFCLOSE) {
-		S.alloc(buffer, 0);
+		socket_data_free(buffer);
 		return -1;
 	}
 	if (n == sz) {
@@ -526,10 +1320,253 @@ socket_forward_tcp(struct socket *sock, struct socket_message *ret) {
 	return SOCKET_DATA;
 }
 
+// What the io_uring multishot recv got, with the later recvs of the socket in
+// the same batch, copied out of the ring buffers given back on the next wait.
+static int
+socket_recv_tcp(struct socket_shard *shard, struct socket *sock, struct event *ev, struct socket_message *ret) {
+	int n = ev->res;
+	int size, i;
+	char *buffer = 0;
+	sock->stat.read_call++;
+	if (n < 0) {
+		socket_force_close(shard, sock, ret);
+		ret->data = strerror(-n);
+		return SOCKET_ERR;
+	}
+	if (n == 0) {
+		socket_force_close(shard, sock, ret);
+		return SOCKET_CLOSE;
+	}
+	size = n;
+	for (i = shard->ev_idx; i < shard->ev_n; i++) {
+		struct event *e = &shard->ev[i];
+		if (e->ud == sock && e->type == EVENT_RECV && e->res > 0) {
+			size += e->res;
+		}
+	}
+	sock->stat.read += size;
+	if (sock->type != SOCKET_TYPE_HALFCLOSE) {
+		buffer = socket_data_alloc(size);
+		memcpy(buffer, ev->data, n);
+	}
+	for (i = shard->ev_idx; i < shard->ev_n; i++) {
+		struct event *e = &shard->ev[i];
+		if (e->ud == sock && e->type == EVENT_RECV && e->res > 0) {
+			sock->stat.read_call++;
+			if (buffer) {
+				memcpy(buffer + n, e->data, e->res);
+			}
+			n += e->res;
+			e->ud = 0;
+		}
+	}
+	if (buffer == 0) {
+		return -1;
+	}
+	ret->ud = sock->ud;
+	ret->id = sock->id;
+	ret->size = size;
+	ret->data = buffer;
+	return SOCKET_DATA;
+}
+
+// Edge triggered read: keep reading until EAGAIN and deliver everything as one
+// message. A short read is not enough, eof may be queued behind the data.
+// *again is set when the socket must be polled again because the read stopped
+// early (buffer limit, eof or error after data).
+static int
+socket_drain_tcp(struct socket_shard *shard, struct socket *sock, struct socket_message *ret, int *again) {
+	int sz = sock->p.size;
+	int n = 0;
+	char *buffer = socket_data_alloc(sz);
+	for (;;) {
+		int r = (int)read(sock->fd, buffer + n, sz - n);
+		socket_stat_read(sock, r);
+		if (r < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == EAGAIN) {
+				break;
+			}
+			if (n > 0) {
+				*again = 1;
+				break;
+			}
+			socket_data_free(buffer);
+			socket_force_close(shard, sock, ret);
+			ret->data = strerror(errno);
+			return SOCKET_ERR;
+		}
+		if (r == 0) {
+			if (n > 0) {
+				*again = 1;
+				break;
+			}
+			socket_data_free(buffer);
+			socket_force_close(shard, sock, ret);
+			return SOCKET_CLOSE;
+		}
+		n += r;
+		if (n < sz) {
+			continue;
+		}
+		if (sz >= MAX_SOCK_DRAIN) {
+			*again = 1;
+			break;
+		} else {
+			char *tmp = socket_data_alloc(sz * 2);
+			memcpy(tmp, buffer, n);
+			socket_data_free(buffer);
+			buffer = tmp;
+			sz *= 2;
+		}
+	}
+	if (n == 0 || sock->type == SOCKET_TYPE_HALFCLOSE) {
+		socket_data_free(buffer);
+		return -1;
+	}
+	if (n >= sock->p.size) {
+		if (sock->p.size < MAX_SOCK_DRAIN) {
+			sock->p.size *= 2;
+		}
+	} else if (sock->p.size > MIN_SOCK_BUFF && n * 2 < sock->p.size) {
+		sock->p.size /= 2;
+	}
+	ret->ud = sock->ud;
+	ret->id = sock->id;
+	ret->size = n;
+	ret->data = buffer;
+	return SOCKET_DATA;
+}
+
+// Add data, from socket_data_alloc, to the bytes not split yet.
+static void
+socket_frame_add(struct socket_frame *f, char *data, int size, int front) {
+	int left;
+	char *tmp;
+	if (f->raw == 0) {
+		f->raw = data;
+		f->raw_size = size;
+		f->raw_off = 0;
+		return;
+	}
+	left = f->raw_size - f->raw_off;
+	tmp = socket_data_alloc(size + left);
+	if (front) {
+		memcpy(tmp, data, size);
+		memcpy(tmp + size, f->raw + f->raw_off, left);
+	} else {
+		memcpy(tmp, f->raw + f->raw_off, left);
+		memcpy(tmp + left, data, size);
+	}
+	socket_data_free(data);
+	socket_data_free(f->raw);
+	f->raw = tmp;
+	f->raw_size = size + left;
+	f->raw_off = 0;
+}
+
+// Turn the package being assembled back into stream bytes, for a new header.
+static void
+socket_frame_rewind(struct socket_frame *f) {
+	int n = f->head_n + f->read;
+	if (n > 0) {
+		char *data = socket_data_alloc(n);
+		memcpy(data, f->head, f->head_n);
+		if (f->read > 0) {
+			memcpy(data + f->head_n, f->buffer, f->read);
+		}
+		socket_frame_add(f, data, n, 0);
+	}
+	if (f->buffer) {
+		S.alloc(f->buffer, 0);
+		f->buffer = 0;
+	}
+	f->head_n = 0;
+	f->read = 0;
+}
+
+// A read of a framed socket is split from the top of socket_poll, one package
+// per call. A read done while a redirect waits for the old owner is kept until
+// it gives back what it holds, the new owner gets both in order.
+static inline int
+socket_frame_read(struct socket_shard *shard, struct socket *sock, struct socket_message *ret, int type) {
+	if (type != SOCKET_DATA || sock->frame == 0) {
+		return type;
+	}
+	socket_frame_add(sock->frame, ret->data, ret->size, 0);
+	if (!(sock->paused & PAUSE_REDIRECT)) {
+		shard->drain = sock;
+	}
+	return -1;
+}
+
+// The next package of the bytes not split yet, -1 once they are used up.
+static int
+socket_frame_pop(struct socket_shard *shard, struct socket *sock, struct socket_message *ret) {
+	struct socket_frame *f = sock->frame;
+	for (;;) {
+		int left = f->raw_size - f->raw_off;
+		int n;
+		if (f->head_n < f->header) {
+			n = f->header - f->head_n;
+			if (n > left) {
+				n = left;
+			}
+			memcpy(f->head + f->head_n, f->raw + f->raw_off, n);
+			f->head_n += n;
+			f->raw_off += n;
+			left -= n;
+			if (f->head_n < f->header) {
+				break;
+			}
+			if (f->header == 2) {
+				f->size = f->head[0] << 8 | f->head[1];
+			} else {
+				f->size = (int)((uint32_t)f->head[0] << 24 | f->head[1] << 16 | f->head[2] << 8 | f->head[3]);
+			}
+			if (f->size < 0 || f->size > MAX_PACKAGE) {
+				socket_force_close(shard, sock, ret);
+				ret->data = (char *)"package too large";
+				return SOCKET_ERR;
+			}
+			f->buffer = (char *)S.alloc(0, f->size);
+			f->read = 0;
+		}
+		n = f->size - f->read;
+		if (n > left) {
+			n = left;
+		}
+		if (n > 0) {
+			memcpy(f->buffer + f->read, f->raw + f->raw_off, n);
+			f->read += n;
+			f->raw_off += n;
+		}
+		if (f->read < f->size) {
+			break;
+		}
+		ret->id = sock->id;
+		ret->ud = sock->ud;
+		ret->data = f->buffer;
+		ret->size = f->size;
+		f->buffer = 0;
+		f->head_n = 0;
+		f->read = 0;
+		return SOCKET_PACKAGE;
+	}
+	socket_data_free(f->raw);
+	f->raw = 0;
+	return -1;
+}
+
 static int
 gen_udp_address(int protocol, union sockaddr_all *sa, uint8_t *udp_address) {
 	int addrsize = 1;
 	udp_address[0] = (uint8_t)protocol;
+	if (protocol == PROTOCOL_UNIX) {
+		return addrsize;
+	}
 	if (protocol == PROTOCOL_UDP) {
 		memcpy(udp_address + addrsize, &sa->v4.sin_port, sizeof(sa->v4.sin_port));
 		addrsize += sizeof(sa->v4.sin_port);
@@ -544,43 +1581,79 @@ gen_udp_address(int protocol, union sockaddr_all *sa, uint8_t *udp_address) {
 	return addrsize;
 }
 
+// Drain up to MAX_UDP_RECV datagrams with one recvmmsg, a single datagram is
+// delivered as SOCKET_UDP, more are packed into one SOCKET_UDPBATCH message.
 static int
-socket_forward_udp(struct socket *sock, struct socket_message *ret) {
-	uint8_t *data;
-	union sockaddr_all sa;
-	socklen_t slen = sizeof(sa);
-	int n = recvfrom(sock->fd, S.udpbuffer, MAX_UDP_PACKAGE, 0, &sa.s, &slen);
+socket_forward_udp(struct socket_shard *shard, struct socket *sock, struct socket_message *ret) {
+	struct mmsghdr msg[MAX_UDP_RECV];
+	union sockaddr_all sa[MAX_UDP_RECV];
+	uint8_t address[UDP_ADDRESS_SIZE];
+	char *data, *ptr;
+	int i, n, sz = 0, count = 0;
+	if (shard->udpbuffer == 0) {
+		shard->udpbuffer = (uint8_t *)S.alloc(0, MAX_UDP_RECV * MAX_UDP_PACKAGE);
+	}
+	for (i = 0; i < MAX_UDP_RECV; i++) {
+		shard->iov[i].iov_base = shard->udpbuffer + i * MAX_UDP_PACKAGE;
+		shard->iov[i].iov_len = MAX_UDP_PACKAGE;
+		memset(&msg[i], 0, sizeof(msg[i]));
+		msg[i].msg_hdr.msg_name = &sa[i];
+		msg[i].msg_hdr.msg_namelen = sizeof(sa[i]);
+		msg[i].msg_hdr.msg_iov = &shard->iov[i];
+		msg[i].msg_hdr.msg_iovlen = 1;
+	}
+	n = recvmmsg(sock->fd, msg, MAX_UDP_RECV, 0, 0);
+	socket_stat_read(sock, socket_mmsg_bytes(msg, n));
 	if (n < 0) {
 		switch (errno) {
 		case EINTR:
 		case EAGAIN:
 			break;
 		default:
-			socket_force_close(sock, ret);
+			socket_force_close(shard, sock, ret);
 			ret->data = strerror(errno);
 			return SOCKET_ERR;
 		}
 		return -1;
 	}
-	if (slen == sizeof(sa.v4)) {
-		if (sock->protocol != PROTOCOL_UDP) {
-			return -1;
+	for (i = 0; i < n; i++) {
+		// drop datagrams from the other address family
+		int protocol = msg[i].msg_hdr.msg_namelen == sizeof(sa[i].v4) ? PROTOCOL_UDP : PROTOCOL_UDPv6;
+		if (sock->protocol == PROTOCOL_UNIX) {
+			protocol = PROTOCOL_UNIX;
 		}
-		data = (uint8_t *)S.alloc(0, n + 1 + 2 + 4);
-		gen_udp_address(PROTOCOL_UDP, &sa, data + n);
-	} else {
-		if (sock->protocol != PROTOCOL_UDPv6) {
-			return -1;
+		if (protocol != sock->protocol) {
+			continue;
+		}
+		if (count != i) {
+			msg[count] = msg[i];
+			sa[count] = sa[i];
 		}
-		data = (uint8_t *)S.alloc(0, n + 1 + 2 + 16);
-		gen_udp_address(PROTOCOL_UDPv6, &sa, data + n);
+		sz += 2 + gen_udp_address(protocol, &sa[count], address) + msg[count].msg_len;
+		count++;
+	}
+	if (count == 0) {
+		return -1;
 	}
-	memcpy(data, S.udpbuffer, n);
 	ret->ud = sock->ud;
 	ret->id = sock->id;
-	ret->size = n;
-	ret->data = (char *)data;
-	return SOCKET_UDP;
+	if (count == 1) {
+		n = msg[0].msg_len;
+		data = socket_data_alloc(n + UDP_ADDRESS_SIZE);
+		memcpy(data, msg[0].msg_hdr.msg_iov->iov_base, n);
+		gen_udp_address(sock->protocol, &sa[0], (uint8_t *)data + n);
+		ret->size = n;
+		ret->data = data;
+		return SOCKET_UDP;
+	}
+	data = ptr = socket_data_alloc(sz);
+	for (i = 0; i < count; i++) {
+		gen_udp_address(sock->protocol, &sa[i], address);
+		ptr += socket_udppack(ptr, (const char *)address, msg[i].msg_hdr.msg_iov->iov_base, msg[i].msg_len);
+	}
+	ret->size = sz;
+	ret->data = data;
+	return SOCKET_UDPBATCH;
 }
 
 static struct buffer *
@@ -603,17 +1676,18 @@ socket_append_buffer_list(struct buffer_list *list, struct send_req *req, int si
 	return buf;
 }
 
+// A partially written buffer always goes to high, the low list must stay complete.
 static void
 socket_append_sendbuffer(struct socket *sock, struct send_req *req, int n) {
 	struct buffer *buf;
-	if (req->priority == SOCKET_PRIORITY_HIGH) {
+	if (req->priority == SOCKET_PRIORITY_HIGH || n > 0) {
 		buf = socket_append_buffer_list(&sock->high, req, SIZEOF_TCPBUFFER, n);
 	} else if (req->priority == SOCKET_PRIORITY_LOW) {
 		buf = socket_append_buffer_list(&sock->low, req, SIZEOF_TCPBUFFER, n);
 	} else {
 		return;
 	}
-	sock->wb_size += buf->len;
+	socket_wb_add(sock, buf->len);
 }
 
 static void
@@ -627,12 +1701,12 @@ socket_append_udp_sendbuffer(struct socket *sock, struct send_req *req, const ui
 		return;
 	}
 	memcpy(buf->udp_address, udp_address, UDP_ADDRESS_SIZE);
-	sock->wb_size += buf->len;
+	socket_wb_add(sock, buf->len);
 }
 
 static int
-socket_req_close(struct close_req *req, struct socket_message *msg) {
-	struct socket * sock = &S.slot[HASH_ID(req->id)];
+socket_req_close(struct socket_shard *shard, struct close_req *req, struct socket_message *msg) {
+	struct socket * sock = socket_slot(req->id);
 	if (sock->type == SOCKET_TYPE_INVALID || sock->id != req->id) {
 		msg->id = req->id;
 		msg->ud = req->ud;
@@ -640,12 +1714,21 @@ socket_req_close(struct close_req *req, struct socket_message *msg) {
 		msg->size = 0;
 		return SOCKET_CLOSE;
 	}
+	if (sock->type == SOCKET_TYPE_RESERVE) {
+		// still resolving, the lookup result is dropped when it comes back
+		socket_release(sock);
+		msg->id = req->id;
+		msg->ud = req->ud;
+		msg->data = (char *)"closed";
+		msg->size = 0;
+		return SOCKET_CLOSE;
+	}
 	if (sock->high.head != 0 || sock->low.head != 0) {
-		int type = socket_send_buffer(sock, msg);
+		int type = socket_send_buffer(shard, sock, msg);
 		if (type != -1) return type;
 	}
 	if (sock->high.head == 0 && sock->low.head == 0) {
-		socket_force_close(sock, msg);
+		socket_force_close(shard, sock, msg);
 		msg->id = req->id;
 		msg->ud = req->ud;
 		msg->data = (char *)"closed";
@@ -657,8 +1740,8 @@ socket_req_close(struct close_req *req, struct socket_message *msg) {
 }
 
 static int
-socket_req_listen(struct listen_req *req, struct socket_message *msg) {
-	struct socket *sock = socket_new(req->fd, req->id, PROTOCOL_TCP, req->ud, 0);
+socket_req_listen(struct socket_shard *shard, struct listen_req *req, struct socket_message *msg) {
+	struct socket *sock = socket_new(shard, req->fd, req->id, PROTOCOL_TCP, req->ud, 0);
 	if (sock == 0) {
 		goto _failed;
 	}
@@ -670,40 +1753,75 @@ _failed:
 	msg->id = req->id;
 	msg->data = (char *)"socket limit";
 	msg->size = 0;
-	S.slot[HASH_ID(req->id)].type = SOCKET_TYPE_INVALID;
+	socket_release(socket_slot(req->id));
 	return SOCKET_ERR;
 }
 
+// A unix stream connect completes at once or fails, EAGAIN is a full backlog.
 static int
-socket_req_open(struct open_req *req, struct socket_message *msg) {
+socket_open_unix(struct socket_shard *shard, struct open_req *req, struct sockaddr_un *su, socklen_t len, struct socket_message *msg) {
 	struct socket *sock;
-	int status;
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		msg->data = strerror(errno);
+		goto _failed;
+	}
+	socket_nonblocking(fd);
+	if (connect(fd, (struct sockaddr *)su, len) != 0) {
+		msg->data = strerror(errno);
+		close(fd);
+		goto _failed;
+	}
+	sock = socket_new(shard, fd, req->id, PROTOCOL_TCP, req->ud, 1);
+	if (sock == 0) {
+		close(fd);
+		msg->data = (char *)"socket limit";
+		goto _failed;
+	}
+	sock->type = SOCKET_TYPE_OPENED;
+	event_recv(shard->event_fd, fd);
+	snprintf(shard->buffer, sizeof(shard->buffer), "%s", req->host);
+	msg->data = shard->buffer;
+	return SOCKET_OPEN;
+_failed:
+	socket_release(socket_slot(req->id));
+	return SOCKET_ERR;
+}
+
+static void
+socket_set_port(struct sockaddr_storage *addr, int port) {
+	if (addr->ss_family == AF_INET) {
+		((struct sockaddr_in *)addr)->sin_port = htons(port);
+	} else if (addr->ss_family == AF_INET6) {
+		((struct sockaddr_in6 *)addr)->sin6_port = htons(port);
+	}
+}
+
+// Connect to the first address of the host that accepts, ra comes from the resolver.
+static int
+socket_open_addr(struct socket_shard *shard, struct open_req *req, const struct resolver_addr *ra, struct socket_message *msg) {
+	struct socket *sock;
+	struct sockaddr_storage addr;
+	int status = -1;
 	int fd = -1;
-	struct addrinfo ai_hints;
-	struct addrinfo *ai_list = 0;
-	struct addrinfo *ai_ptr = 0;
-	char port[16];
+	int i;
 	msg->id = req->id;
 	msg->ud = req->ud;
 	msg->size = 0;
-	sprintf(port, "%d", req->port);
-	memset(&ai_hints, 0, sizeof(ai_hints));
-	ai_hints.ai_family = AF_UNSPEC;
-	ai_hints.ai_socktype = SOCK_STREAM;
-	ai_hints.ai_protocol = IPPROTO_TCP;
-	status = getaddrinfo(req->host, port, &ai_hints, &ai_list);
-	if (status != 0) {
-		msg->data = (char *)gai_strerror(status);
+	if (ra->err != 0) {
+		msg->data = (char *)gai_strerror(ra->err);
 		goto _failed;
 	}
-	for (ai_ptr = ai_list; ai_ptr != 0; ai_ptr = ai_ptr->ai_next) {
-		fd = socket(ai_ptr->ai_family, ai_ptr->ai_socktype, ai_ptr->ai_protocol);
+	for (i = 0; i < ra->n; i++) {
+		addr = ra->addr[i];
+		socket_set_port(&addr, req->port);
+		fd = socket(addr.ss_family, SOCK_STREAM, IPPROTO_TCP);
 		if (fd < 0) {
 			continue;
 		}
 		socket_keepalive(fd);
 		socket_nonblocking(fd);
-		status = connect(fd, ai_ptr->ai_addr, ai_ptr->ai_addrlen);
+		status = connect(fd, (struct sockaddr *)&addr, ra->len[i]);
 		if (status != 0 && errno != EINPROGRESS) {
 			close(fd);
 			fd = -1;
@@ -715,7 +1833,7 @@ socket_req_open(struct open_req *req, struct socket_message *msg) {
 		msg->data = strerror(errno);
 		goto _failed;
 	}
-	sock = socket_new(fd, req->id, PROTOCOL_TCP, req->ud, 1);
+	sock = socket_new(shard, fd, req->id, PROTOCOL_TCP, req->ud, 1);
 	if (sock == 0) {
 		close(fd);
 		msg->data = (char *)"socket limit";
@@ -723,46 +1841,100 @@ socket_req_open(struct open_req *req, struct socket_message *msg) {
 	}
 	if (status == 0) {
 		sock->type = SOCKET_TYPE_OPENED;
-		struct sockaddr *addr = ai_ptr->ai_addr;
-		void *sin_addr = (ai_ptr->ai_family == AF_INET) ? (void *)&((struct sockaddr_in *)addr)->sin_addr : (void *)&((struct sockaddr_in6 *)addr)->sin6_addr;
-		int sin_port = ntohs((ai_ptr->ai_family == AF_INET) ? ((struct sockaddr_in *)addr)->sin_port : ((struct sockaddr_in6 *)addr)->sin6_port);
+		event_recv(shard->event_fd, fd);
+		void *sin_addr = (addr.ss_family == AF_INET) ? (void *)&((struct sockaddr_in *)&addr)->sin_addr : (void *)&((struct sockaddr_in6 *)&addr)->sin6_addr;
 		char tmp[INET6_ADDRSTRLEN];
-		if (inet_ntop(ai_ptr->ai_family, sin_addr, tmp, sizeof(tmp))) {
-			snprintf(S.buffer, sizeof(S.buffer), "%s:%d", tmp, sin_port);
-			msg->data = S.buffer;
+		if (inet_ntop(addr.ss_family, sin_addr, tmp, sizeof(tmp))) {
+			snprintf(shard->buffer, sizeof(shard->buffer), "%s:%d", tmp, req->port);
+			msg->data = shard->buffer;
 		}
-		freeaddrinfo(ai_list);
 		return SOCKET_OPEN;
 	} else {
 		sock->type = SOCKET_TYPE_OPENING;
-		event_write(S.event_fd, sock->fd, sock, 1);
+		socket_event_write(shard, sock, 1);
 	}
-	freeaddrinfo(ai_list);
 	return -1;
 _failed:
-	freeaddrinfo(ai_list);
-	S.slot[HASH_ID(req->id)].type = SOCKET_TYPE_INVALID;
+	socket_release(socket_slot(req->id));
 	return SOCKET_ERR;
 }
 
+// Called on a resolver thread, the open goes back to the shard owning the id.
+static void
+socket_resolved(void *ud) {
+	struct resolve_req *r = (struct resolve_req *)ud;
+	struct socket_req req;
+	memset(&req, 0, sizeof req);
+	req.req = SOCKET_REQ_RESOLVED;
+	req.u.resolved = r;
+	socket_send_req(SOCKET_SHARD(r->open.id), &req);
+}
+
+static int
+socket_req_open(struct socket_shard *shard, struct open_req *req, struct socket_message *msg) {
+	struct resolve_req *r;
+	struct sockaddr_un su;
+	socklen_t len;
+	int status, type;
+	msg->id = req->id;
+	msg->ud = req->ud;
+	msg->size = 0;
+	status = socket_unix_address(req->host, &su, &len);
+	if (status < 0) {
+		msg->data = (char *)"unix socket path too long";
+		socket_release(socket_slot(req->id));
+		return SOCKET_ERR;
+	} else if (status > 0) {
+		return socket_open_unix(shard, req, &su, len, msg);
+	}
+	r = (struct resolve_req *)S.alloc(0, sizeof(*r));
+	r->open = *req;
+	if (resolver_query(req->host, &r->addr, socket_resolved, r)) {
+		return -1;
+	}
+	type = socket_open_addr(shard, req, &r->addr, msg);
+	S.alloc(r, 0);
+	return type;
+}
+
+// The id may have been closed, and even reused, while its host was resolved.
+static int
+socket_req_resolved(struct socket_shard *shard, struct resolve_req *r, struct socket_message *msg) {
+	struct socket *sock = socket_slot(r->open.id);
+	int type = -1;
+	if (sock->type == SOCKET_TYPE_RESERVE && sock->id == r->open.id) {
+		type = socket_open_addr(shard, &r->open, &r->addr, msg);
+	}
+	S.alloc(r, 0);
+	return type;
+}
+
 static int
-socket_req_start(struct start_req *req, struct socket_message *msg) {
+socket_req_start(struct socket_shard *shard, struct start_req *req, struct socket_message *msg) {
 	struct socket *sock;
 	msg->id = req->id;
 	msg->ud = req->ud;
 	msg->size = 0;
-	sock = &S.slot[HASH_ID(req->id)];
+	sock = socket_slot(req->id);
 	if (sock->type == SOCKET_TYPE_INVALID || sock->id != req->id) {
 		msg->data = (char *)"socket invalid id";
 		return SOCKET_ERR;
 	}
 	if (sock->type == SOCKET_TYPE_PACCEPT || sock->type == SOCKET_TYPE_PLISTEN) {
-		if (event_add(S.event_fd, sock->fd, sock)) {
-			sock->type = SOCKET_TYPE_INVALID;
+		if (event_add(shard->event_fd, sock->fd, sock)) {
+			socket_release(sock);
 			msg->data = strerror(errno);
 			return SOCKET_ERR;
 		}
 		sock->ud = req->ud;
+		if (sock->type == SOCKET_TYPE_PACCEPT) {
+			event_recv(shard->event_fd, sock->fd);
+		} else {
+			event_accept(shard->event_fd, sock->fd);
+		}
+		if (sock->paused) {
+			event_mod(shard->event_fd, sock->fd, sock, 0, sock->writing);
+		}
 		if (sock->type == SOCKET_TYPE_PACCEPT) {
 			sock->type = SOCKET_TYPE_OPENED;
 			msg->data = (char *)"start";
@@ -780,13 +1952,14 @@ socket_req_start(struct start_req *req, struct socket_message *msg) {
 }
 
 static int
-socket_req_bind(struct bind_req *req, struct socket_message *msg) {
+socket_req_bind(struct socket_shard *shard, struct bind_req *req, struct socket_message *msg) {
 	struct socket *sock;
 	msg->id = req->id;
 	msg->ud = req->ud;
 	msg->size = 0;
-	sock = socket_new(req->fd, req->id, PROTOCOL_TCP, req->ud, 1);
+	sock = socket_new(shard, req->fd, req->id, PROTOCOL_TCP, req->ud, 1);
 	if (sock == 0) {
+		socket_release(socket_slot(req->id));
 		msg->data = (char *)"socket limit";
 		return SOCKET_ERR;
 	}
@@ -796,34 +1969,8 @@ socket_req_bind(struct bind_req *req, struct socket_message *msg) {
 	return SOCKET_OPEN;
 }
 
-static socklen_t
-udp_socket_address(struct socket *sock, const uint8_t udp_address[UDP_ADDRESS_SIZE], union sockaddr_all *sa) {
-	uint16_t port = 0;
-	uint8_t type = udp_address[0];
-	if (type != sock->protocol) {
-		return 0;
-	}
-	memcpy(&port, udp_address + 1, sizeof(uint16_t));
-	switch (sock->protocol) {
-	case PROTOCOL_UDP:
-		memset(&sa->v4, 0, sizeof(sa->v4));
-		sa->s.sa_family = AF_INET;
-		sa->v4.sin_port = port;
-		memcpy(&sa->v4.sin_addr, udp_address + 1 + sizeof(uint16_t), sizeof(sa->v4.sin_addr));
-		return sizeof(sa->v4);
-	case PROTOCOL_UDPv6:
-		memset(&sa->v6, 0, sizeof(sa->v6));
-		sa->s.sa_family = AF_INET6;
-		sa->v6.sin6_port = port;
-		memcpy(&sa->v6.sin6_addr, udp_address + 1 + sizeof(uint16_t), sizeof(sa->v6.sin6_addr));
-		return sizeof(sa->v6);
-	}
-	return 0;
-}
-
 static int
-socket_req_send(struct send_req *req, struct socket_message *msg, const uint8_t *udp_address) {
-	struct socket * sock = &S.slot[HASH_ID(req->id)];
+socket_req_send_(struct socket_shard *shard, struct socket *sock, struct send_req *req, struct socket_message *msg, const uint8_t *udp_address) {
 	struct socket_send_object so;
 	socket_send_object_init(&so, req->data, req->size);
 	if (sock->type == SOCKET_TYPE_INVALID || sock->id != req->id || sock->type == SOCKET_TYPE_HALFCLOSE
@@ -838,7 +1985,12 @@ socket_req_send(struct send_req *req, struct socket_message *msg, const uint8_t
 	}
 	if (sock->high.head == 0 && sock->low.head == 0 && sock->type == SOCKET_TYPE_OPENED) {
 		if (sock->protocol == PROTOCOL_TCP) {
-			int n = write(sock->fd, so.data, so.size);
+			int n = 0;
+			// the ring sends it along with the other sockets at the next wait
+			if (!shard->ring_send) {
+				n = write(sock->fd, (char *)so.data + req->offset, so.size - req->offset);
+				socket_stat_write(sock, n);
+			}
 			if (n < 0) {
 				switch (errno) {
 				case EINTR:
@@ -847,11 +1999,12 @@ socket_req_send(struct send_req *req, struct socket_message *msg, const uint8_t
 					break;
 				default:
 					fprintf(stderr, "socketlib write to %d (fd=%d) errno:%d\n", sock->id, sock->fd, errno);
-					socket_force_close(sock, msg);
+					socket_force_close(shard, sock, msg);
 					so.free(req->data);
 					return SOCKET_CLOSE;
 				}
 			}
+			n += req->offset;
 			if (n == so.size) {
 				so.free(req->data);
 				return -1;
@@ -866,6 +2019,7 @@ socket_req_send(struct send_req *req, struct socket_message *msg, const uint8_t
 			}
 			sa_size = udp_socket_address(sock, udp_address, &sa);
 			n = sendto(sock->fd, so.data, so.size, 0, &sa.s, sa_size);
+			socket_stat_write(sock, n);
 			if (n != req->size) {
 				socket_append_udp_sendbuffer(sock, req, udp_address);
 			} else {
@@ -873,10 +2027,10 @@ socket_req_send(struct send_req *req, struct socket_message *msg, const uint8_t
 				return -1;
 			}
 		}
-		event_write(S.event_fd, sock->fd, sock, 1);
+		socket_write_start(shard, sock);
 	} else {
 		if (sock->protocol == PROTOCOL_TCP) {
-			socket_append_sendbuffer(sock, req, 0);
+			socket_append_sendbuffer(sock, req, req->offset);
 		} else {
 			if (!udp_address) {
 				udp_address = sock->p.udp_address;
@@ -894,10 +2048,168 @@ socket_req_send(struct send_req *req, struct socket_message *msg, const uint8_t
 	return -1;
 }
 
+static int
+socket_req_send(struct socket_shard *shard, struct send_req *req, struct socket_message *msg, const uint8_t *udp_address) {
+	struct socket * sock = socket_slot(req->id);
+	int r = socket_req_send_(shard, sock, req, msg, udp_address);
+	socket_dec_sending(sock, req->id);
+	return r;
+}
+
+// The file goes behind the data queued before it, and is sent right away if
+// nothing is queued, the edge of a writable socket may never come.
+static int
+socket_req_sendfile_(struct socket_shard *shard, struct socket *sock, struct sendfile_req *req, struct socket_message *msg) {
+	struct buffer_list *list;
+	struct send_file *f;
+	struct buffer *buf;
+	int idle;
+	if (sock->type != SOCKET_TYPE_OPENED && sock->type != SOCKET_TYPE_OPENING) {
+		close(req->fd);
+		return -1;
+	}
+	if (sock->id != req->id || sock->protocol != PROTOCOL_TCP || req->size <= 0) {
+		close(req->fd);
+		return -1;
+	}
+	list = req->priority == SOCKET_PRIORITY_HIGH ? &sock->high : &sock->low;
+	idle = sock->high.head == 0 && sock->low.head == 0;
+	f = (struct send_file *)S.alloc(0, sizeof *f);
+	f->fd = req->fd;
+	f->offset = req->offset;
+	f->left = req->size;
+	buf = (struct buffer *)S.alloc(0, SIZEOF_TCPBUFFER);
+	buf->send_object = SEND_FILE;
+	buf->buff = buf->ptr = (char *)f;
+	buf->len = 0;
+	buf->next = 0;
+	if (list->head == 0) {
+		list->head = list->tail = buf;
+	} else {
+		list->tail->next = buf;
+		list->tail = buf;
+	}
+	if (idle && sock->type == SOCKET_TYPE_OPENED) {
+		if (socket_send_tcp_list(shard, sock, msg) == SOCKET_CLOSE) {
+			return SOCKET_CLOSE;
+		}
+		if (sock->high.head || sock->low.head) {
+			socket_event_write(shard, sock, 1);
+		}
+	}
+	return -1;
+}
+
+static int
+socket_req_sendfile(struct socket_shard *shard, struct sendfile_req *req, struct socket_message *msg) {
+	struct socket *sock = socket_slot(req->id);
+	int r = socket_req_sendfile_(shard, sock, req, msg);
+	socket_dec_sending(sock, req->id);
+	return r;
+}
+
+static void
+socket_append_udp_record(struct socket *sock, const char *address, const char *data, int size) {
+	struct send_req req;
+	memset(&req, 0, sizeof req);
+	req.id = sock->id;
+	req.data = (char *)S.alloc(0, size);
+	req.size = size;
+	req.priority = SOCKET_PRIORITY_HIGH;
+	memcpy(req.data, data, size);
+	socket_append_udp_sendbuffer(sock, &req, (const uint8_t *)address);
+}
+
+// Send a packed udp batch, datagrams that can't go out now are queued one by one.
+static int
+socket_req_sendudpv(struct socket_shard *shard, struct send_req *req, struct socket_message *msg) {
+	struct socket *sock = socket_slot(req->id);
+	const char *ptr = req->data;
+	int left = req->size;
+	if (sock->type != SOCKET_TYPE_OPENED || sock->id != req->id || sock->protocol == PROTOCOL_TCP) {
+		S.alloc(req->data, 0);
+		socket_dec_sending(sock, req->id);
+		return -1;
+	}
+	while (left > 0 && sock->high.head == 0 && sock->low.head == 0) {
+		struct mmsghdr mmsg[MAX_UDP_BATCH];
+		union sockaddr_all sa[MAX_UDP_BATCH];
+		const char *p = ptr;
+		int cnt, n, l = left;
+		for (cnt = 0; cnt < MAX_UDP_BATCH && l > 0; cnt++) {
+			const char *address, *data;
+			int asz, dsz;
+			int r = socket_udpunpack(p, l, &address, &asz, &data, &dsz);
+			if (r < 0) {
+				break;
+			}
+			shard->iov[cnt].iov_base = (void *)data;
+			shard->iov[cnt].iov_len = dsz;
+			memset(&mmsg[cnt], 0, sizeof(mmsg[cnt]));
+			mmsg[cnt].msg_hdr.msg_name = &sa[cnt];
+			mmsg[cnt].msg_hdr.msg_namelen = udp_socket_address(sock, (const uint8_t *)address, &sa[cnt]);
+			mmsg[cnt].msg_hdr.msg_iov = &shard->iov[cnt];
+			mmsg[cnt].msg_hdr.msg_iovlen = 1;
+			p += r;
+			l -= r;
+		}
+		if (cnt == 0) {
+			fprintf(stderr, "socketlib udp (%d) invalid batch.\n", sock->id);
+			left = 0;
+			break;
+		}
+		n = sendmmsg(sock->fd, mmsg, cnt, 0);
+		socket_stat_write(sock, socket_mmsg_bytes(mmsg, n));
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == EAGAIN) {
+				break;
+			}
+			fprintf(stderr, "socketlib udp (%d) sendto error %d.\n", sock->id, errno);
+			n = 1;
+		}
+		for (; n > 0; n--) {
+			const char *address, *data;
+			int asz, dsz;
+			int r = socket_udpunpack(ptr, left, &address, &asz, &data, &dsz);
+			ptr += r;
+			left -= r;
+		}
+	}
+	if (left > 0) {
+		if (sock->high.head == 0 && sock->low.head == 0) {
+			socket_event_write(shard, sock, 1);
+		}
+		while (left > 0) {
+			const char *address, *data;
+			int asz, dsz;
+			int r = socket_udpunpack(ptr, left, &address, &asz, &data, &dsz);
+			if (r < 0) {
+				break;
+			}
+			socket_append_udp_record(sock, address, data, dsz);
+			ptr += r;
+			left -= r;
+		}
+	}
+	S.alloc(req->data, 0);
+	socket_dec_sending(sock, req->id);
+	if (sock->wb_size > 1024 * 1024) {
+		msg->id = sock->id;
+		msg->ud = sock->ud;
+		msg->data = 0;
+		msg->size = (int)(sock->wb_size / 1024);
+		return SOCKET_WARNING;
+	}
+	return -1;
+}
+
 static int
 socket_req_opt(struct opt_req *req, struct socket_message *msg) {
 	struct socket *sock;
-	sock = &S.slot[HASH_ID(req->id)];
+	sock = socket_slot(req->id);
 	if (sock->type == SOCKET_TYPE_INVALID || sock->id != req->id) {
 		return -1;
 	}
@@ -905,12 +2217,165 @@ socket_req_opt(struct opt_req *req, struct socket_message *msg) {
 	return -1;
 }
 
+// Paused sockets stay in the poller for writes and errors, only reading stops.
+static void
+socket_set_paused(struct socket_shard *shard, struct socket *sock, int paused) {
+	sock->paused = paused;
+	if (sock->type == SOCKET_TYPE_OPENED || sock->type == SOCKET_TYPE_HALFCLOSE) {
+		event_mod(shard->event_fd, sock->fd, sock, !sock->paused, sock->writing);
+	}
+}
+
+static int
+socket_req_pause(struct socket_shard *shard, struct pause_req *req) {
+	struct socket *sock = socket_slot(req->id);
+	int paused;
+	if (sock->type == SOCKET_TYPE_INVALID || sock->id != req->id) {
+		return -1;
+	}
+	paused = req->pause ? (sock->paused | req->what) : (sock->paused & ~req->what);
+	if (paused != sock->paused) {
+		socket_set_paused(shard, sock, paused);
+	}
+	return -1;
+}
+
+// Reading stops until the old owner, told by the returned message, gives back
+// what it has not consumed with SOCKET_REQ_REDIRECTED.
+static int
+socket_req_redirect(struct socket_shard *shard, struct redirect_req *req, struct socket_message *msg) {
+	struct socket *sock = socket_slot(req->id);
+	struct socket_frame *f;
+	if (sock->type != SOCKET_TYPE_OPENED || sock->id != req->id || sock->protocol != PROTOCOL_TCP || (sock->paused & PAUSE_REDIRECT)) {
+		return -1;
+	}
+	msg->id = sock->id;
+	msg->ud = sock->ud;
+	msg->data = 0;
+	msg->size = 0;
+	sock->ud = req->ud;
+	socket_set_paused(shard, sock, sock->paused | PAUSE_REDIRECT);
+	f = sock->frame;
+	if (f == 0) {
+		f = (struct socket_frame *)S.alloc(0, sizeof(*f));
+		memset(f, 0, sizeof(*f));
+		sock->frame = f;
+	} else if (f->header != req->header) {
+		socket_frame_rewind(f);
+	}
+	f->header = req->header;
+	return SOCKET_REDIRECT;
+}
+
+static int
+socket_req_redirected(struct socket_shard *shard, struct redirected_req *req, struct socket_message *msg) {
+	struct socket *sock = socket_slot(req->id);
+	struct socket_frame *f;
+	if (sock->type == SOCKET_TYPE_INVALID || sock->id != req->id || !(sock->paused & PAUSE_REDIRECT)) {
+		if (req->data) {
+			socket_data_free(req->data);
+		}
+		return -1;
+	}
+	socket_set_paused(shard, sock, sock->paused & ~PAUSE_REDIRECT);
+	f = sock->frame;
+	if (req->data) {
+		socket_frame_add(f, req->data, req->size, 1);
+	}
+	if (f->header) {
+		if (f->raw) {
+			shard->drain = sock;
+		}
+		return -1;
+	}
+	// a plain stream, what was held goes as it is
+	if (f->raw == 0) {
+		socket_frame_free(f);
+		sock->frame = 0;
+		return -1;
+	}
+	msg->id = sock->id;
+	msg->ud = sock->ud;
+	msg->size = f->raw_size - f->raw_off;
+	if (f->raw_off > 0) {
+		msg->data = socket_data_alloc(msg->size);
+		memcpy(msg->data, f->raw + f->raw_off, msg->size);
+		socket_data_free(f->raw);
+	} else {
+		msg->data = f->raw;
+	}
+	f->raw = 0;
+	socket_frame_free(f);
+	sock->frame = 0;
+	return SOCKET_DATA;
+}
+
+// Like a send of the shared block, but a write error is left for the write
+// event to find, a request returns one message at most.
+static void
+socket_send_shared(struct socket_shard *shard, struct socket *sock, int id, struct send_shared *shared, int priority) {
+	struct buffer_list *list;
+	struct buffer *buf;
+	int n = 0;
+	int idle = 0;
+	if (sock->type == SOCKET_TYPE_INVALID || sock->id != id || sock->type == SOCKET_TYPE_HALFCLOSE
+		|| sock->type == SOCKET_TYPE_PACCEPT || sock->type == SOCKET_TYPE_PLISTEN
+		|| sock->type == SOCKET_TYPE_LISTEN || sock->protocol != PROTOCOL_TCP) {
+		return;
+	}
+	if (sock->high.head == 0 && sock->low.head == 0 && sock->type == SOCKET_TYPE_OPENED) {
+		idle = 1;
+		if (!shard->ring_send) {
+			n = write(sock->fd, shared->data, shared->size);
+			socket_stat_write(sock, n);
+			if (n == shared->size) {
+				return;
+			}
+			if (n < 0) {
+				n = 0;
+			}
+		}
+	}
+	list = (priority == SOCKET_PRIORITY_HIGH || n > 0) ? &sock->high : &sock->low;
+	buf = (struct buffer *)S.alloc(0, SIZEOF_TCPBUFFER);
+	buf->send_object = SEND_SHARED;
+	buf->buff = (char *)shared;
+	buf->ptr = shared->data + n;
+	buf->len = shared->size - n;
+	buf->next = 0;
+	if (list->head == 0) {
+		list->head = list->tail = buf;
+	} else {
+		list->tail->next = buf;
+		list->tail = buf;
+	}
+	atom_inc(&shared->ref);
+	socket_wb_add(sock, buf->len);
+	if (idle) {
+		socket_write_start(shard, sock);
+	}
+}
+
+static int
+socket_req_sendmulti(struct socket_shard *shard, struct sendmulti_req *req) {
+	int i;
+	for (i = 0; i < req->n; i++) {
+		int id = req->ids[i];
+		struct socket *sock = socket_slot(id);
+		socket_send_shared(shard, sock, id, req->shared, req->priority);
+		socket_dec_sending(sock, id);
+	}
+	S.alloc(req->ids, 0);
+	socket_shared_release(req->shared);
+	return -1;
+}
+
 static int
 socket_req_setudp(struct setudp_req *req, struct socket_message *msg) {
 	int id = req->id;
 	int type;
 	struct socket *sock;
-	sock = &S.slot[HASH_ID(req->id)];
+	sock = socket_slot(req->id);
 	if (sock->type == SOCKET_TYPE_INVALID || sock->id != id) {
 		return -1;
 	}
@@ -922,28 +2387,50 @@ socket_req_setudp(struct setudp_req *req, struct socket_message *msg) {
 		msg->size = 0;
 		return SOCKET_ERR;
 	}
-	if (type == PROTOCOL_UDP) {
-		memcpy(sock->p.udp_address, req->address, 1 + 2 + 4);
-	} else {
-		memcpy(sock->p.udp_address, req->address, 1 + 2 + 16);
+	memcpy(sock->p.udp_address, req->address, udp_address_size(req->address));
+	return -1;
+}
+
+// Unix datagrams carry no address, the socket is connected to its peer instead.
+static int
+socket_req_udpconnect(struct open_req *req, struct socket_message *msg) {
+	struct socket *sock = socket_slot(req->id);
+	struct sockaddr_un su;
+	socklen_t len;
+	if (sock->type != SOCKET_TYPE_OPENED || sock->id != req->id || sock->protocol != PROTOCOL_UNIX) {
+		return -1;
+	}
+	msg->ud = sock->ud;
+	msg->id = req->id;
+	msg->size = 0;
+	if (socket_unix_address(req->host, &su, &len) <= 0) {
+		msg->data = (char *)"invalid unix socket path";
+		return SOCKET_ERR;
+	}
+	if (connect(sock->fd, (struct sockaddr *)&su, len) != 0) {
+		msg->data = strerror(errno);
+		return SOCKET_ERR;
 	}
+	sock->p.udp_address[0] = PROTOCOL_UNIX;
 	return -1;
 }
 
 static int
-socket_req_udp(struct udp_req *req, struct socket_message *msg) {
+socket_req_udp(struct socket_shard *shard, struct udp_req *req, struct socket_message *msg) {
 	int id = req->id;
 	int protocol;
 	struct socket *sock;
 	if (req->family == AF_INET6) {
 		protocol = PROTOCOL_UDPv6;
+	} else if (req->family == AF_UNIX) {
+		protocol = PROTOCOL_UNIX;
 	} else {
 		protocol = PROTOCOL_UDP;
 	}
-	sock = socket_new(req->fd, id, protocol, req->ud, 1);
+	sock = socket_new(shard, req->fd, id, protocol, req->ud, 1);
 	if (!sock) {
 		close(req->fd);
-		S.slot[HASH_ID(id)].type = SOCKET_TYPE_INVALID;
+		socket_release(socket_slot(id));
 		return -1;
 	}
 	sock->type = SOCKET_TYPE_OPENED;
@@ -952,12 +2439,8 @@ socket_req_udp(struct udp_req *req, struct socket_message *msg) {
 }
 
 static int
-socket_handle_req(struct socket_message *msg) {
-	struct socket_req req;
-	if (socket_recv_req(&req)) {
-		return -1;
-	}
-	switch (req.req) {
+socket_handle_req(struct socket_shard *shard, struct socket_req *req, struct socket_message *msg) {
+	switch (req->req) {
 	case SOCKET_REQ_EXIT:
 		msg->id = 0;
 		msg->ud = 0;
@@ -965,38 +2448,54 @@ socket_handle_req(struct socket_message *msg) {
 		msg->size = 0;
 		return SOCKET_EXIT;
 	case SOCKET_REQ_CLOSE:
-		return socket_req_close(&req.u.close, msg);
+		return socket_req_close(shard, &req->u.close, msg);
 	case SOCKET_REQ_LISTEN:
-		return socket_req_listen(&req.u.listen, msg);
+		return socket_req_listen(shard, &req->u.listen, msg);
 	case SOCKET_REQ_OPEN:
-		return socket_req_open(&req.u.open, msg);
+		return socket_req_open(shard, &req->u.open, msg);
 	case SOCKET_REQ_START:
-		return socket_req_start(&req.u.start, msg);
+		return socket_req_start(shard, &req->u.start, msg);
 	case SOCKET_REQ_BIND:
-		return socket_req_bind(&req.u.bind, msg);
+		return socket_req_bind(shard, &req->u.bind, msg);
 	case SOCKET_REQ_SEND:
-		return socket_req_send(&req.u.send, msg, 0);
+		return socket_req_send(shard, &req->u.send, msg, 0);
 	case SOCKET_REQ_OPT:
-		return socket_req_opt(&req.u.opt, msg);
+		return socket_req_opt(&req->u.opt, msg);
 	case SOCKET_REQ_SETUDP:
-		return socket_req_setudp(&req.u.setudp, msg);
+		return socket_req_setudp(&req->u.setudp, msg);
+	case SOCKET_REQ_UDPCONNECT:
+		return socket_req_udpconnect(&req->u.open, msg);
 	case SOCKET_REQ_UDP:
-		return socket_req_udp(&req.u.udp, msg);
+		return socket_req_udp(shard, &req->u.udp, msg);
 	case SOCKET_REQ_SENDUDP:
-		return socket_req_send(&req.u.sendudp.send, msg, req.u.sendudp.address);
+		return socket_req_send(shard, &req->u.sendudp.send, msg, req->u.sendudp.address);
+	case SOCKET_REQ_SENDUDPV:
+		return socket_req_sendudpv(shard, &req->u.send, msg);
+	case SOCKET_REQ_PAUSE:
+		return socket_req_pause(shard, &req->u.pause);
+	case SOCKET_REQ_SENDFILE:
+		return socket_req_sendfile(shard, &req->u.sendfile, msg);
+	case SOCKET_REQ_RESOLVED:
+		return socket_req_resolved(shard, req->u.resolved, msg);
+	case SOCKET_REQ_REDIRECT:
+		return socket_req_redirect(shard, &req->u.redirect, msg);
+	case SOCKET_REQ_REDIRECTED:
+		return socket_req_redirected(shard, &req->u.redirected, msg);
+	case SOCKET_REQ_SENDMULTI:
+		return socket_req_sendmulti(shard, &req->u.sendmulti);
 	default:
-		fprintf(stderr, "socketlib unknown request:%d.\n", req.req);
+		fprintf(stderr, "socketlib unknown request:%d.\n", req->req);
 	}
 	return -1;
 }
 
 static int
-socket_try_open(struct socket *sock, struct socket_message *msg) {
+socket_try_open(struct socket_shard *shard, struct socket *sock, struct socket_message *msg) {
 	int error, code;
 	socklen_t len = sizeof(error);
 	code = getsockopt(sock->fd, SOL_SOCKET, SO_ERROR, (char *)&error, &len);
 	if (code < 0 || error) {
-		socket_force_close(sock, msg);
+		socket_force_close(shard, sock, msg);
     if (code > 0) {
       msg->data = strerror(error);
     } else {
@@ -1008,15 +2507,16 @@ socket_try_open(struct socket *sock, struct socket_message *msg) {
 		socklen_t slen = sizeof(u);
 		sock->type = SOCKET_TYPE_OPENED;
 		if (sock->high.head == 0 && sock->low.head == 0) {
-			event_write(S.event_fd, sock->fd, sock, 0);
+			socket_event_write(shard, sock, 0);
 		}
+		event_recv(shard->event_fd, sock->fd);
 		if (getpeername(sock->fd, &u.s, &slen) == 0) {
 			void *sin_addr = (u.s.sa_family == AF_INET) ? (void *)&u.v4.sin_addr : (void *)&u.v6.sin6_addr;
 			int sin_port = ntohs((u.s.sa_family == AF_INET) ? u.v4.sin_port : u.v6.sin6_port);
 			char tmp[INET6_ADDRSTRLEN];
 			if (inet_ntop(u.s.sa_family, sin_addr, tmp, sizeof(tmp))) {
-				snprintf(S.buffer, sizeof(S.buffer), "%s:%d", tmp, sin_port);
-				msg->data = S.buffer;
+				snprintf(shard->buffer, sizeof(shard->buffer), "%s:%d", tmp, sin_port);
+				msg->data = shard->buffer;
 			}
 		}
 		return SOCKET_OPEN;
@@ -1024,104 +2524,324 @@ socket_try_open(struct socket *sock, struct socket_message *msg) {
 }
 
 static int
-socket_try_accept(struct socket *sock, struct socket_message *msg) {
-	union sockaddr_all u;
-	socklen_t len = sizeof(u);
+socket_accepted(struct socket_shard *shard, struct socket *sock, int client_fd, int id, union sockaddr_all *u, struct socket_message *msg) {
 	struct socket *newsock;
 	void * sin_addr;
 	int sin_port;
+	struct socket_shard *target;
+	if (u->s.sa_family != AF_UNIX) {
+		socket_keepalive(client_fd);
+	}
+	target = SOCKET_SHARD(id);
+	newsock = socket_new(target, client_fd, id, PROTOCOL_TCP, sock->ud, 0);
+	if (newsock == 0) {
+		close(client_fd);
+		socket_release(socket_slot(id));
+		return -1;
+	}
+	newsock->type = SOCKET_TYPE_PACCEPT;
+	msg->id = sock->id;
+	msg->size = newsock->id;
+	if (u->s.sa_family == AF_UNIX) {
+		msg->data = (char *)"unix";
+		return SOCKET_ACCEPT;
+	}
+	sin_addr = (u->s.sa_family == AF_INET) ? (void*)&u->v4.sin_addr : (void *)&u->v6.sin6_addr;
+	sin_port = ntohs((u->s.sa_family == AF_INET) ? u->v4.sin_port : u->v6.sin6_port);
+	char tmp[INET6_ADDRSTRLEN];
+	if (inet_ntop(u->s.sa_family, sin_addr, tmp, sizeof(tmp))) {
+		snprintf(shard->buffer, sizeof(shard->buffer), "%s:%d", tmp, sin_port);
+		msg->data = shard->buffer;
+	}
+	return SOCKET_ACCEPT;
+}
+
+static int
+socket_try_accept(struct socket_shard *shard, struct socket *sock, struct socket_message *msg) {
+	union sockaddr_all u;
+	socklen_t len;
 	int client_fd, id;
-	client_fd = accept(sock->fd, &u.s, &len);
-	if (client_fd < 0) {
-		if (errno == EMFILE || errno == ENFILE) {
-			msg->data = strerror(errno);
-			return SOCKET_ERR;
-		} else {
+	for (;;) {
+		len = sizeof(u);
+		client_fd = accept4(sock->fd, &u.s, &len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (client_fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) {
+				continue;
+			}
+			if (errno == EMFILE || errno == ENFILE) {
+				msg->data = strerror(errno);
+				return SOCKET_ERR;
+			}
 			return -1;
 		}
+		id = socket_next_id();
+		if (id >= 0) {
+			break;
+		}
+		// out of slots, drop it and go on draining the backlog
+		close(client_fd);
+	}
+	return socket_accepted(shard, sock, client_fd, id, &u, msg);
+}
+
+// An fd accepted by the io_uring multishot accept, without the peer address.
+static int
+socket_accept_event(struct socket_shard *shard, struct socket *sock, struct event *ev, struct socket_message *msg) {
+	union sockaddr_all u;
+	socklen_t len = sizeof(u);
+	int id;
+	if (ev->res < 0) {
+		if (ev->res == -EMFILE || ev->res == -ENFILE) {
+			msg->data = strerror(-ev->res);
+			return SOCKET_ERR;
+		}
+		return -1;
 	}
 	id = socket_next_id();
 	if (id < 0) {
-		close(client_fd);
+		close(ev->res);
+		return -1;
+	}
+	if (getpeername(ev->res, &u.s, &len) != 0) {
+		u.s.sa_family = AF_UNIX;
+	}
+	return socket_accepted(shard, sock, ev->res, id, &u, msg);
+}
+
+static int
+socket_shard_init(struct socket_shard *shard, int index) {
+	int fd;
+	shard->index = index;
+	spinlock_init(&shard->free_lock);
+	shard->free_head = shard->free_tail = -1;
+	shard->event_fd = event_new(S.edge, S.uring);
+	if (!shard->event_fd) {
+		fprintf(stderr, "socketlib event new errno:%d.\n", errno);
+		return -1;
+	}
+	fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (fd < 0) {
+		fprintf(stderr, "socketlib eventfd errno:%d.\n", errno);
+		event_free(shard->event_fd);
+		return -1;
+	}
+	if (event_add(shard->event_fd, fd, shard)) {
+		close(fd);
+		event_free(shard->event_fd);
+		fprintf(stderr, "socketlib event add errno:%d.\n", errno);
+		return -1;
+	}
+	shard->ctrl_fd = fd;
+	shard->ctrl_notify = 0;
+	shard->cmd_head = shard->cmd_tail = (struct socket_cmd *)S.alloc(0, sizeof(struct socket_cmd));
+	shard->cmd_head->next = 0;
+	shard->check_ctrl = 1;
+	shard->ev_idx = shard->ev_n = 0;
+	shard->accept_n = 0;
+	shard->ring_send = event_send(shard->event_fd, -1, 0, 0, 0) == 0;
+	shard->udpbuffer = 0;
+	shard->drain = 0;
+	shard->wakeup = shard->event = shard->request = 0;
+	return 0;
+}
+
+static void
+socket_shard_unit(struct socket_shard *shard) {
+	struct socket_cmd *cmd = shard->cmd_head;
+	while (cmd) {
+		struct socket_cmd *next = cmd->next;
+		if (cmd != shard->cmd_head && cmd->req.req == SOCKET_REQ_RESOLVED) {
+			S.alloc(cmd->req.u.resolved, 0);
+		}
+		if (cmd != shard->cmd_head && cmd->req.req == SOCKET_REQ_REDIRECTED && cmd->req.u.redirected.data) {
+			socket_data_free(cmd->req.u.redirected.data);
+		}
+		if (cmd != shard->cmd_head && cmd->req.req == SOCKET_REQ_SENDMULTI) {
+			S.alloc(cmd->req.u.sendmulti.ids, 0);
+			socket_shared_release(cmd->req.u.sendmulti.shared);
+		}
+		S.alloc(cmd, 0);
+		cmd = next;
+	}
+	if (shard->udpbuffer) {
+		S.alloc(shard->udpbuffer, 0);
+	}
+	close(shard->ctrl_fd);
+	event_free(shard->event_fd);
+	spinlock_unit(&shard->free_lock);
+}
+
+int
+socket_init(socket_alloc alloc, const struct socket_config *config) {
+	int i, max;
+	int thread = 1;
+	memset(&S, 0, sizeof(S));
+	while (thread * 2 <= config->thread && thread * 2 <= MAX_SOCKET_THREAD) {
+		thread *= 2;
+	}
+	S.thread = thread;
+	S.edge = config->edge;
+	S.uring = config->uring;
+	S.headroom = config->headroom;
+	S.balance = 0;
+	if (resolver_init(config->resolver, config->dns_ttl, config->nameserver)) {
+		fprintf(stderr, "socketlib resolver init failed.\n");
 		return -1;
 	}
-	socket_keepalive(client_fd);
-	socket_nonblocking(client_fd);
-	newsock = socket_new(client_fd, id, PROTOCOL_TCP, sock->ud, 0);
-	if (newsock == 0) {
-		close(client_fd);
-		return -1;
+	S.alloc = alloc;
+	max = config->max > 0 ? config->max : MAX_SOCKET;
+	if (max > (1 << MAX_SOCKET_LIMIT_P)) {
+		max = 1 << MAX_SOCKET_LIMIT_P;
+	}
+	S.slot_p = SLOT_PAGE_P;
+	while ((1 << S.slot_p) < max) {
+		S.slot_p++;
+	}
+	S.slot_mask = (1 << S.slot_p) - 1;
+	S.gen_mask = 0x7fffffff >> S.slot_p;
+	S.page_n = 0;
+	S.page_max = (max + SLOT_PAGE - 1) / SLOT_PAGE;
+	S.page = (struct socket **)alloc(0, (1 << (S.slot_p - SLOT_PAGE_P)) * sizeof(struct socket *));
+	memset(S.page, 0, (1 << (S.slot_p - SLOT_PAGE_P)) * sizeof(struct socket *));
+	spinlock_init(&S.page_lock);
+	S.invalid.type = SOCKET_TYPE_INVALID;
+	S.invalid.id = -1;
+	S.shard = (struct socket_shard *)alloc(0, thread * sizeof(struct socket_shard));
+	for (i = 0; i < thread; i++) {
+		if (socket_shard_init(&S.shard[i], i)) {
+			while (--i >= 0) {
+				socket_shard_unit(&S.shard[i]);
+			}
+			alloc(S.shard, 0);
+			alloc(S.page, 0);
+			resolver_unit();
+			return -1;
+		}
+	}
+	return 0;
+}
+
+void
+socket_unit(void) {
+	int i;
+	resolver_unit();
+	for (i = 0; i < S.page_n * SLOT_PAGE; i++) {
+		struct socket *sock = socket_index(i);
+		if (sock->type != SOCKET_TYPE_RESERVE && sock->type != SOCKET_TYPE_INVALID) {
+			struct socket_message ret;
+			socket_force_close(SOCKET_SHARD(sock->id), sock, &ret);
+		}
+	}
+	for (i = 0; i < S.thread; i++) {
+		socket_shard_unit(&S.shard[i]);
 	}
-	newsock->type = SOCKET_TYPE_PACCEPT;
-	msg->id = sock->id;
-	msg->size = newsock->id;
-	sin_addr = (u.s.sa_family == AF_INET) ? (void*)&u.v4.sin_addr : (void *)&u.v6.sin6_addr;
-	sin_port = ntohs((u.s.sa_family == AF_INET) ? u.v4.sin_port : u.v6.sin6_port);
-	char tmp[INET6_ADDRSTRLEN];
-	if (inet_ntop(u.s.sa_family, sin_addr, tmp, sizeof(tmp))) {
-		snprintf(S.buffer, sizeof(S.buffer), "%s:%d", tmp, sin_port);
-		msg->data = S.buffer;
+	// the sends cancelled by the close are over with the ring
+	for (i = 0; i < S.page_n * SLOT_PAGE; i++) {
+		struct socket *sock = socket_index(i);
+		if (sock->ring) {
+			socket_free_buffer_list(&sock->high);
+			socket_free_buffer_list(&sock->low);
+		}
 	}
-	return SOCKET_ACCEPT;
+	for (i = 0; i < S.page_n; i++) {
+		S.alloc(S.page[i], 0);
+	}
+	spinlock_unit(&S.page_lock);
+	S.alloc(S.page, 0);
+	S.alloc(S.shard, 0);
 }
 
 int
-socket_init(socket_alloc alloc) {
-	int i;
-	int fd[2];
-	memset(&S, 0, sizeof(S));
-	S.event_fd = event_new();
-	if (pipe(fd)) {
-		fprintf(stderr, "socketlib pipe errno:%d.\n", errno);
-		event_free(S.event_fd);
-		return -1;
+socket_thread(void) {
+	return S.thread;
+}
+
+static const char *
+socket_type_name(struct socket *sock, int type) {
+	switch (type) {
+	case SOCKET_TYPE_OPENING:
+		return "opening";
+	case SOCKET_TYPE_OPENED:
+	case SOCKET_TYPE_PACCEPT:
+		if (sock->protocol == PROTOCOL_TCP) {
+			return "tcp";
+		}
+		return sock->protocol == PROTOCOL_UNIX ? "unix" : "udp";
+	case SOCKET_TYPE_LISTEN:
+	case SOCKET_TYPE_PLISTEN:
+		return "listen";
+	case SOCKET_TYPE_BIND:
+		return "bind";
+	case SOCKET_TYPE_HALFCLOSE:
+		return "closing";
 	}
-	if (event_add(S.event_fd, fd[0], 0)) {
-		close(fd[0]);
-		close(fd[1]);
-		event_free(S.event_fd);
-		fprintf(stderr, "socketlib event add errno:%d.\n", errno);
-		return -1;
+	return 0;
+}
+
+int
+socket_owned(int id, void *ud) {
+	struct socket *sock = socket_slot(id);
+	atom_sync();
+	if (sock->id != id || sock->ud != ud || sock->type == SOCKET_TYPE_HALFCLOSE) {
+		return 0;
 	}
-	S.recvctl_fd = fd[0];
-	S.sendctl_fd = fd[1];
-	socket_nonblocking(S.recvctl_fd);
-	socket_nonblocking(S.sendctl_fd);
-	S.check_ctrl = 1;
-	FD_ZERO(&S.rfds);
-	for (i = 0; i < MAX_SOCKET; i++) {
-		struct socket *sock = &S.slot[i];
-		sock->type = SOCKET_TYPE_INVALID;
-		sock->fd = sock->id = 0;
-		sock->high.head = sock->high.tail = 0;
-		sock->low.head = sock->low.tail = 0;
+	return socket_type_name(sock, sock->type) != 0;
+}
+
+int
+socket_info(struct socket_info *si, int n) {
+	int i, total, count = 0;
+	long now = socket_time();
+	total = S.page_n * SLOT_PAGE;
+	atom_sync();
+	for (i = 0; i < total; i++) {
+		struct socket *sock = socket_index(i);
+		const char *type = socket_type_name(sock, sock->type);
+		if (type == 0) {
+			continue;
+		}
+		if (count < n) {
+			struct socket_info *info = &si[count];
+			info->id = sock->id;
+			info->type = type;
+			info->ud = sock->ud;
+			info->paused = sock->paused != 0;
+			info->age = now - sock->stat.start;
+			info->read = sock->stat.read;
+			info->write = sock->stat.write;
+			info->read_call = sock->stat.read_call;
+			info->write_call = sock->stat.write_call;
+			info->read_again = sock->stat.read_again;
+			info->write_again = sock->stat.write_again;
+			info->wb_size = sock->wb_size;
+			info->wb_peak = sock->stat.wb_peak;
+		}
+		count++;
 	}
-	S.ev_idx = S.ev_n = 0;
-	S.alloc = alloc;
-	return 0;
+	return count;
 }
 
 void
-socket_unit(void) {
+socket_stat(struct socket_stat *stat) {
 	int i;
-	for (i = 0; i < MAX_SOCKET; i++) {
-		struct socket *sock = &S.slot[i];
-		if (sock->type != SOCKET_TYPE_RESERVE && sock->type != SOCKET_TYPE_INVALID) {
-			struct socket_message ret;
-			socket_force_close(sock, &ret);
-		}
+	memset(stat, 0, sizeof(*stat));
+	for (i = 0; i < S.thread; i++) {
+		struct socket_shard *shard = &S.shard[i];
+		stat->wakeup += shard->wakeup;
+		stat->event += shard->event;
+		stat->request += shard->request;
 	}
-	close(S.sendctl_fd);
-	close(S.recvctl_fd);
-	event_free(S.event_fd);
 }
 
 void
 socket_exit(void) {
+	int i;
 	struct socket_req req;
 	memset(&req, 0, sizeof req);
 	req.req = SOCKET_REQ_EXIT;
-	socket_send_req(&req);
+	for (i = 0; i < S.thread; i++) {
+		socket_send_req(&S.shard[i], &req);
+	}
 }
 
 void
@@ -1131,69 +2851,105 @@ socket_start(int id, void *ud) {
 	req.req = SOCKET_REQ_START;
 	req.u.start.id = id;
 	req.u.start.ud = ud;
-	socket_send_req(&req);
-}
-
-void
-socket_close(int id, void *ud) {
-	struct socket_req req;
-	memset(&req, 0, sizeof req);
-	req.req = SOCKET_REQ_CLOSE;
-	req.u.close.id = id;
-	req.u.close.ud = ud;
-	socket_send_req(&req);
+	socket_send_req(SOCKET_SHARD(id), &req);
 }
 
 int
 socket_open(const char *host, int port, void *ud) {
 	struct socket_req req;
+	int id = socket_next_id();
+	if (id < 0) return -1;
 	memset(&req, 0, sizeof req);
 	req.req = SOCKET_REQ_OPEN;
-	req.u.open.id = socket_next_id();
+	req.u.open.id = id;
 	req.u.open.ud = ud;
 	req.u.open.port = port;
 	strcpy(req.u.open.host, host);
-	socket_send_req(&req);
-	return req.u.open.id;
+	socket_send_req(SOCKET_SHARD(id), &req);
+	return id;
 }
 
-int
-socket_listen(const char *host, int port, void *ud) {
+static int
+socket_listen_(const char *host, int port, int reuseport, void *ud) {
 	struct socket_req req;
-	int fd = _socket_listen(host, port);
+	int id;
+	int fd = _socket_listen(host, port, reuseport);
 	if (fd < 0) return -1;
+	id = socket_next_id();
+	if (id < 0) {
+		close(fd);
+		return -1;
+	}
 	memset(&req, 0, sizeof req);
 	req.req = SOCKET_REQ_LISTEN;
-	req.u.listen.id = socket_next_id();
+	req.u.listen.id = id;
 	req.u.listen.fd = fd;
 	req.u.listen.ud = ud;
-	socket_send_req(&req);
-	return req.u.listen.id;
+	socket_send_req(SOCKET_SHARD(id), &req);
+	return id;
+}
+
+int
+socket_listen(const char *host, int port, void *ud) {
+	return socket_listen_(host, port, 0, ud);
+}
+
+// Each listener of a group binds the same address with SO_REUSEPORT, the kernel
+// spreads incoming connections between them.
+int
+socket_listen_reuseport(const char *host, int port, void *ud) {
+	return socket_listen_(host, port, 1, ud);
 }
 
 int
 socket_bind(int fd, void *ud) {
 	struct socket_req req;
+	int id = socket_next_id();
+	if (id < 0) return -1;
 	memset(&req, 0, sizeof req);
 	req.req = SOCKET_REQ_BIND;
-	req.u.bind.id = socket_next_id();
+	req.u.bind.id = id;
 	req.u.bind.fd = fd;
 	req.u.bind.ud = ud;
-	socket_send_req(&req);
-	return req.u.bind.id;
+	socket_send_req(SOCKET_SHARD(id), &req);
+	return id;
 }
 
-static inline void
-freebuffer(void *data, int size) {
-	struct socket_send_object so;
-	socket_send_object_init(&so, data, size);
-	so.free(data);
+// Try to write from the calling thread when nothing is queued for the socket.
+// Returns 1 if the whole buffer went out, otherwise the request (with the bytes
+// already written in req->offset) must be queued to the socket thread. With
+// io_uring sends the socket thread batches them instead.
+static int
+socket_direct_write(struct socket *sock, struct send_req *req) {
+	if (sock->protocol != PROTOCOL_TCP || SOCKET_SHARD(req->id)->ring_send
+		|| (sock->sending & 0xffff) != 0 || !spinlock_trylock(&sock->dw_lock)) {
+		socket_inc_sending(sock, req->id);
+		return 0;
+	}
+	if (sock->id == req->id && sock->type == SOCKET_TYPE_OPENED && (sock->sending & 0xffff) == 0
+		&& sock->high.head == 0 && sock->low.head == 0) {
+		struct socket_send_object so;
+		int n;
+		socket_send_object_init(&so, req->data, req->size);
+		n = write(sock->fd, so.data, so.size);
+		socket_stat_write(sock, n);
+		if (n == so.size) {
+			spinlock_unlock(&sock->dw_lock);
+			so.free(req->data);
+			return 1;
+		}
+		if (n > 0) {
+			req->offset = n;
+		}
+	}
+	socket_inc_sending(sock, req->id);
+	spinlock_unlock(&sock->dw_lock);
+	return 0;
 }
 
-long
-socket_send(int id, const void *data, int size, int priority) {
+static long
+socket_send_(struct socket *sock, int id, const void *data, int size, int priority) {
 	struct socket_req req;
-	struct socket * sock = &S.slot[HASH_ID(id)];
 	if (sock->id != id || sock->type == SOCKET_TYPE_INVALID) {
 		freebuffer((void *)data, size);
 		return -1;
@@ -1204,10 +2960,255 @@ socket_send(int id, const void *data, int size, int priority) {
 	req.u.send.data = (char *)data;
 	req.u.send.size = size;
 	req.u.send.priority = priority;
-	socket_send_req(&req);
+	if (socket_direct_write(sock, &req.u.send)) {
+		return sock->wb_size;
+	}
+	socket_send_req(SOCKET_SHARD(id), &req);
+	return sock->wb_size;
+}
+
+static void
+socket_cork_flush(int i) {
+	struct socket_cork_buffer *b = &C.b[i];
+	socket_send_(socket_slot(b->id), b->id, b->data, b->size, b->priority);
+	C.b[i] = C.b[--C.n];
+}
+
+static int
+socket_cork_find(int id) {
+	int i;
+	for (i = 0; i < C.n; i++) {
+		if (C.b[i].id == id) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+// Returns 0 if data is kept in the cork, otherwise it must be sent now.
+// The first send of a socket keeps its own buffer, the next ones are copied
+// behind it into one buffer.
+static int
+socket_cork_append(int id, const void *data, int size, int priority) {
+	struct socket_cork_buffer *b;
+	int i = socket_cork_find(id);
+	if (i >= 0 && (C.b[i].priority != priority || C.b[i].size + size > MAX_CORK_SIZE)) {
+		socket_cork_flush(i);
+		i = -1;
+	}
+	if (size > MAX_CORK_COPY) {
+		if (i >= 0) {
+			socket_cork_flush(i);
+		}
+		return -1;
+	}
+	if (i < 0) {
+		if (C.n == MAX_CORK_SOCKET) {
+			return -1;
+		}
+		b = &C.b[C.n++];
+		b->id = id;
+		b->priority = priority;
+		b->data = (char *)data;
+		b->size = size;
+		b->cap = 0;
+		return 0;
+	}
+	b = &C.b[i];
+	if (b->size + size > b->cap) {
+		int cap = b->cap ? b->cap : MIN_CORK_BUFF;
+		char *tmp;
+		while (cap < b->size + size) {
+			cap *= 2;
+		}
+		tmp = (char *)S.alloc(0, cap);
+		memcpy(tmp, b->data, b->size);
+		S.alloc(b->data, 0);
+		b->data = tmp;
+		b->cap = cap;
+	}
+	memcpy(b->data + b->size, data, size);
+	b->size += size;
+	S.alloc((void *)data, 0);
+	return 0;
+}
+
+long
+socket_send(int id, const void *data, int size, int priority) {
+	struct socket * sock = socket_slot(id);
+	if (C.corked && size >= 0 && sock->protocol == PROTOCOL_TCP && sock->id == id && sock->type != SOCKET_TYPE_INVALID) {
+		if (socket_cork_append(id, data, size, priority) == 0) {
+			return sock->wb_size;
+		}
+	} else if (C.corked) {
+		// a socket object can't be corked, what is corked for the id goes first
+		socket_flush(id);
+	}
+	return socket_send_(sock, id, data, size, priority);
+}
+
+void
+socket_cork(void) {
+	C.corked = 1;
+}
+
+void
+socket_uncork(void) {
+	socket_flush(-1);
+	C.corked = 0;
+}
+
+void
+socket_flush(int id) {
+	if (id < 0) {
+		while (C.n > 0) {
+			socket_cork_flush(C.n - 1);
+		}
+	} else {
+		int i = socket_cork_find(id);
+		if (i >= 0) {
+			socket_cork_flush(i);
+		}
+	}
+}
+
+// One request per socket thread carries the ids it serves, the block is shared
+// by all of them.
+void
+socket_sendmulti(const int *ids, int n, const void *data, int size, int priority) {
+	struct send_shared *shared;
+	int count[MAX_SOCKET_THREAD];
+	int i, t;
+	if (n <= 0 || size <= 0) {
+		freebuffer((void *)data, size);
+		return;
+	}
+	if (C.n > 0) {
+		// corked sends to these sockets go first
+		for (i = 0; i < n && C.n > 0; i++) {
+			socket_flush(ids[i]);
+		}
+	}
+	shared = (struct send_shared *)S.alloc(0, sizeof(*shared));
+	shared->ref = 1;
+	shared->size = size;
+	shared->data = (char *)data;
+	memset(count, 0, sizeof(count));
+	for (i = 0; i < n; i++) {
+		count[SHARD_ID(ids[i])]++;
+	}
+	for (t = 0; t < S.thread; t++) {
+		struct socket_req req;
+		int k = 0;
+		if (count[t] == 0) {
+			continue;
+		}
+		memset(&req, 0, sizeof req);
+		req.req = SOCKET_REQ_SENDMULTI;
+		req.u.sendmulti.n = count[t];
+		req.u.sendmulti.priority = priority;
+		req.u.sendmulti.ids = (int *)S.alloc(0, count[t] * sizeof(int));
+		req.u.sendmulti.shared = shared;
+		for (i = 0; i < n; i++) {
+			if (SHARD_ID(ids[i]) == t) {
+				req.u.sendmulti.ids[k++] = ids[i];
+				socket_inc_sending(socket_slot(ids[i]), ids[i]);
+			}
+		}
+		atom_inc(&shared->ref);
+		socket_send_req(&S.shard[t], &req);
+	}
+	socket_shared_release(shared);
+}
+
+// The socket takes the file fd, it's closed once sent or when the socket closes.
+long
+socket_sendfile(int id, int fd, long offset, long size, int priority) {
+	struct socket_req req;
+	struct socket *sock = socket_slot(id);
+	socket_flush(id);
+	if (sock->id != id || sock->type == SOCKET_TYPE_INVALID) {
+		close(fd);
+		return -1;
+	}
+	memset(&req, 0, sizeof req);
+	req.req = SOCKET_REQ_SENDFILE;
+	req.u.sendfile.id = id;
+	req.u.sendfile.fd = fd;
+	req.u.sendfile.priority = priority;
+	req.u.sendfile.offset = offset;
+	req.u.sendfile.size = size;
+	socket_inc_sending(sock, id);
+	socket_send_req(SOCKET_SHARD(id), &req);
 	return sock->wb_size;
 }
 
+void
+socket_close(int id, void *ud) {
+	struct socket_req req;
+	socket_flush(id);
+	memset(&req, 0, sizeof req);
+	req.req = SOCKET_REQ_CLOSE;
+	req.u.close.id = id;
+	req.u.close.ud = ud;
+	socket_send_req(SOCKET_SHARD(id), &req);
+}
+
+static void
+socket_pause_(int id, int pause, int what) {
+	struct socket_req req;
+	memset(&req, 0, sizeof req);
+	req.req = SOCKET_REQ_PAUSE;
+	req.u.pause.id = id;
+	req.u.pause.pause = pause;
+	req.u.pause.what = what;
+	socket_send_req(SOCKET_SHARD(id), &req);
+}
+
+void
+socket_pause(int id) {
+	socket_pause_(id, 1, PAUSE_USER);
+}
+
+void
+socket_resume(int id) {
+	socket_pause_(id, 0, PAUSE_USER);
+}
+
+void
+socket_throttle(int id, int on) {
+	socket_pause_(id, on, PAUSE_AUTO);
+}
+
+int
+socket_redirect(int id, void *ud, int header) {
+	struct socket_req req;
+	if (header != 0 && header != 2 && header != 4) {
+		return -1;
+	}
+	memset(&req, 0, sizeof req);
+	req.req = SOCKET_REQ_REDIRECT;
+	req.u.redirect.id = id;
+	req.u.redirect.header = header;
+	req.u.redirect.ud = ud;
+	socket_send_req(SOCKET_SHARD(id), &req);
+	return 0;
+}
+
+void
+socket_redirected(int id, const void *data, int size) {
+	struct socket_req req;
+	memset(&req, 0, sizeof req);
+	req.req = SOCKET_REQ_REDIRECTED;
+	req.u.redirected.id = id;
+	if (size > 0) {
+		req.u.redirected.data = socket_data_alloc(size);
+		req.u.redirected.size = size;
+		memcpy(req.u.redirected.data, data, size);
+	}
+	socket_send_req(SOCKET_SHARD(id), &req);
+}
+
 void
 socket_nodelay(int id) {
 	struct socket_req req;
@@ -1216,64 +3217,76 @@ socket_nodelay(int id) {
 	req.u.opt.id = id;
 	req.u.opt.what = TCP_NODELAY;
 	req.u.opt.value = 1;
-	socket_send_req(&req);
+	socket_send_req(SOCKET_SHARD(id), &req);
 }
 
 static void
-clear_closed(int id, int type) {
+clear_closed(struct socket_shard *shard, int id, int type) {
 	if (type == SOCKET_CLOSE || type == SOCKET_ERR) {
+		struct socket *s = socket_slot(id);
 		int i;
-		for (i = S.ev_idx; i < S.ev_n; i++) {
-			struct event *e = &S.ev[i];
-			struct socket *s = (struct socket *)e->ud;
-			if (s) {
-				if (s->type == SOCKET_TYPE_INVALID && s->id == id) {
-					e->ud = 0;
-					break;
-				}
+		if (s->id == id && s->type != SOCKET_TYPE_INVALID) {
+			return;
+		}
+		// the slot may already be reserved again by another thread, match it by
+		// address. io_uring may have a poll and several recvs of it in the batch,
+		// a send still frees its buffers.
+		for (i = shard->ev_idx; i < shard->ev_n; i++) {
+			struct event *e = &shard->ev[i];
+			if (e->ud == s && e->type != EVENT_SEND) {
+				e->ud = 0;
 			}
 		}
 	}
 }
 
-static inline int
-_socket_has_ctrl(void) {
-	struct timeval tv = { 0, 0 };
-	FD_SET(S.recvctl_fd, &S.rfds);
-	int ret = select(S.recvctl_fd + 1, &S.rfds, 0, 0, &tv);
-	return ret > 0;
-}
-
 int
-socket_poll(struct socket_message *sm) {
+socket_poll(int thread, struct socket_message *sm) {
 	int r = 0;
+	struct socket_shard *shard = &S.shard[thread];
 	for (;;) {
 		struct socket *sock;
 		struct event *ev;
-		if (S.check_ctrl) {
-			if (_socket_has_ctrl()) {
-				r = socket_handle_req(sm);
+		if (shard->drain) {
+			r = socket_frame_pop(shard, shard->drain, sm);
+			if (r != -1) {
+				goto ret;
+			}
+			shard->drain = 0;
+			continue;
+		}
+		if (shard->check_ctrl) {
+			struct socket_req req;
+			if (socket_recv_req(shard, &req) == 0) {
+				shard->request++;
+				r = socket_handle_req(shard, &req, sm);
 				if (-1 != r) {
-					clear_closed(sm->id, r);
 					goto ret;
 				}
 				continue;
 			} else {
-				S.check_ctrl = 0;
+				shard->check_ctrl = 0;
 			}
 		}
-		if (S.ev_idx == S.ev_n) {
-			S.ev_n = event_wait(S.event_fd, S.ev, MAX_EVENT);
-			S.check_ctrl = 1;
-			S.ev_idx = 0;
-			if (S.ev_n <= 0) {
-				S.ev_n = 0;
+		if (shard->ev_idx == shard->ev_n) {
+			shard->ev_n = event_wait(shard->event_fd, shard->ev, MAX_EVENT);
+			shard->check_ctrl = 1;
+			shard->ev_idx = 0;
+			if (shard->ev_n <= 0) {
+				shard->ev_n = 0;
 				if (errno == EINTR) continue;
 				fprintf(stderr, "socketlib event wait errno:%d.\n", errno);
 				return 0;
 			}
+			shard->wakeup++;
+			shard->event += shard->ev_n;
+		}
+		ev = &shard->ev[shard->ev_idx++];
+		if (ev->ud == shard) {
+			socket_ctrl_reset(shard);
+			shard->check_ctrl = 1;
+			continue;
 		}
-		ev = &S.ev[S.ev_idx++];
 		sock = (struct socket *)ev->ud;
 		if (!sock) {
 			continue;
@@ -1282,36 +3295,83 @@ socket_poll(struct socket_message *sm) {
 		sm->ud = sock->ud;
 		sm->data = 0;
 		sm->size = 0;
+		if (ev->type == EVENT_SEND) {
+			r = socket_ring_sent(shard, sock, ev, sm);
+			if (r == -1) continue;
+			goto ret;
+		}
 		switch (sock->type) {
 		case SOCKET_TYPE_OPENING:
-			r = socket_try_open(sock, sm);
+			r = socket_try_open(shard, sock, sm);
+			if (S.edge && r == SOCKET_OPEN) {
+				// the edge won't come again, poll it once more for data and queued writes
+				--shard->ev_idx;
+			}
 			goto ret;
 		case SOCKET_TYPE_LISTEN:
-			r = socket_try_accept(sock, sm);
-			if (r == -1) break;
+			if (ev->type == EVENT_ACCEPT) {
+				r = socket_accept_event(shard, sock, ev, sm);
+				if (r == -1) break;
+				goto ret;
+			}
+			r = socket_try_accept(shard, sock, sm);
+			if (r != SOCKET_ACCEPT) {
+				shard->accept_n = 0;
+				if (r == -1) break;
+				goto ret;
+			}
+			// keep accepting from the backlog, a level triggered listener yields
+			// to the other events after a batch
+			if (S.edge || ++shard->accept_n < MAX_ACCEPT_BATCH) {
+				--shard->ev_idx;
+			} else {
+				shard->accept_n = 0;
+			}
 			goto ret;
 		case SOCKET_TYPE_INVALID:
+		case SOCKET_TYPE_RESERVE:
 			break;
 		default:
+			if (ev->type == EVENT_RECV) {
+				r = socket_recv_tcp(shard, sock, ev, sm);
+				r = socket_frame_read(shard, sock, sm, r);
+				if (r == -1) break;
+				goto ret;
+			}
 			if (ev->read) {
 				if (sock->protocol == PROTOCOL_TCP) {
-					r = socket_forward_tcp(sock, sm);
+					if (S.edge) {
+						int again = 0;
+						r = socket_drain_tcp(shard, sock, sm, &again);
+						r = socket_frame_read(shard, sock, sm, r);
+						// a paused socket is polled again for reading on resume
+						if (again && !sock->paused) {
+							--shard->ev_idx;
+							if (r == -1) break;
+							goto ret;
+						}
+					} else {
+						r = socket_forward_tcp(shard, sock, sm);
+						r = socket_frame_read(shard, sock, sm, r);
+					}
 				} else {
-					r = socket_forward_udp(sock, sm);
-					if (r == SOCKET_UDP) {
-						--S.ev_idx;
+					r = socket_forward_udp(shard, sock, sm);
+					if (r == SOCKET_UDP || r == SOCKET_UDPBATCH) {
+						if (!sock->paused) {
+							--shard->ev_idx;
+						}
 						goto ret;
 					}
 				}
 				if (ev->write && r != SOCKET_CLOSE && r != SOCKET_ERR) {
 					ev->read = 0;
-					--S.ev_idx;
+					--shard->ev_idx;
 				}
 				if (r == -1) break;
 				goto ret;
 			}
 			if (ev->write) {
-				r = socket_send_buffer(sock, sm);
+				r = socket_send_buffer(shard, sock, sm);
 				if (r == -1) break;
 				goto ret;
 			}
@@ -1319,6 +3379,7 @@ socket_poll(struct socket_message *sm) {
 		}
 	}
 ret:
+	clear_closed(shard, sm->id, r);
 	sm->type = r;
 	return r != SOCKET_EXIT;
 }
@@ -1326,10 +3387,10 @@ ret:
 int
 socket_udp(const char *host, int port, void *ud) {
 	struct socket_req req;
-	int fd;
+	int fd, id;
 	int family;
 	if (port != 0 || host != 0) {
-		fd = _socket_bind(host, port, IPPROTO_UDP, &family);
+		fd = _socket_bind(host, port, IPPROTO_UDP, 0, &family);
 		if (fd < 0) {
 			return -1;
 		}
@@ -1341,14 +3402,19 @@ socket_udp(const char *host, int port, void *ud) {
 		}
 	}
 	socket_nonblocking(fd);
+	id = socket_next_id();
+	if (id < 0) {
+		close(fd);
+		return -1;
+	}
 	memset(&req, 0, sizeof req);
 	req.req = SOCKET_REQ_UDP;
-	req.u.udp.id = socket_next_id();
+	req.u.udp.id = id;
 	req.u.udp.fd = fd;
 	req.u.udp.ud = ud;
 	req.u.udp.family = family;
-	socket_send_req(&req);
-	return req.u.udp.id;
+	socket_send_req(SOCKET_SHARD(id), &req);
+	return id;
 }
 
 int
@@ -1356,8 +3422,22 @@ socket_udpopen(int id, const char *host, int port) {
 	struct socket_req req;
 	struct addrinfo ai_hints;
 	struct addrinfo *ai_list = 0;
+	struct sockaddr_un su;
+	socklen_t len;
 	char portstr[16];
 	int status, protocol;
+	status = socket_unix_address(host, &su, &len);
+	if (status != 0) {
+		if (status < 0) {
+			return -1;
+		}
+		memset(&req, 0, sizeof req);
+		req.req = SOCKET_REQ_UDPCONNECT;
+		req.u.open.id = id;
+		strcpy(req.u.open.host, host);
+		socket_send_req(SOCKET_SHARD(id), &req);
+		return 0;
+	}
 	sprintf(portstr, "%d", port);
 	memset(&ai_hints, 0, sizeof(ai_hints));
 	ai_hints.ai_family = AF_UNSPEC;
@@ -1380,7 +3460,7 @@ socket_udpopen(int id, const char *host, int port) {
 	freeaddrinfo(ai_list);
 	req.req = SOCKET_REQ_SETUDP;
 	req.u.setudp.id = id;
-	socket_send_req(&req);
+	socket_send_req(SOCKET_SHARD(id), &req);
 	return 0;
 }
 
@@ -1389,7 +3469,7 @@ socket_udpsend(int id, const char *address, const void *data, int size) {
 	const uint8_t *udp_address;
 	int addrsize;
 	struct socket_req req;
-	struct socket * sock = &S.slot[HASH_ID(id)];
+	struct socket * sock = socket_slot(id);
 	if (sock->id != id || sock->type == SOCKET_TYPE_INVALID) {
 		freebuffer((void *)data, size);
 		return -1;
@@ -1400,39 +3480,79 @@ socket_udpsend(int id, const char *address, const void *data, int size) {
 	req.u.sendudp.send.data = (char *)data;
 	req.u.sendudp.send.size = size;
 	udp_address = (const uint8_t *)address;
-	switch (udp_address[0]) {
-	case PROTOCOL_UDP:
-		addrsize = 1 + 2 + 4;
-		break;
-	case PROTOCOL_UDPv6:
-		addrsize = 1 + 2 + 16;
-		break;
-	default:
+	addrsize = udp_address_size(udp_address);
+	if (addrsize == 0) {
 		freebuffer((void *)data, size);
 		return -1;
 	}
 	memcpy(req.u.sendudp.address, udp_address, addrsize);
-	socket_send_req(&req);
+	socket_inc_sending(sock, id);
+	socket_send_req(SOCKET_SHARD(id), &req);
 	return sock->wb_size;
 }
 
 const char *
 socket_udpaddress(struct socket_message *m, int *address_size) {
 	uint8_t *udp_address = (uint8_t *)(m->data + m->size);
-	int type = udp_address[0];
-	switch (type) {
-	case PROTOCOL_UDP:
-		*address_size = 1 + 2 + 4;
-		break;
-	case PROTOCOL_UDPv6:
-		*address_size = 1 + 2 + 16;
-		break;
-	default:
+	*address_size = udp_address_size(udp_address);
+	if (*address_size == 0) {
 		return 0;
 	}
 	return (const char *)udp_address;
 }
 
+int
+socket_udppack(char *buffer, const char *addr, const void *data, int size) {
+	uint16_t sz = (uint16_t)size;
+	int addrsize = udp_address_size((const uint8_t *)addr);
+	if (addrsize == 0 || size < 0 || size > MAX_UDP_PACKAGE) {
+		return -1;
+	}
+	if (buffer) {
+		memcpy(buffer, &sz, sizeof(sz));
+		memcpy(buffer + 2, addr, addrsize);
+		memcpy(buffer + 2 + addrsize, data, size);
+	}
+	return 2 + addrsize + size;
+}
+
+int
+socket_udpunpack(const char *buffer, int size, const char **addr, int *address_size, const char **data, int *data_size) {
+	uint16_t sz;
+	int addrsize;
+	if (size < 3) {
+		return -1;
+	}
+	memcpy(&sz, buffer, sizeof(sz));
+	addrsize = udp_address_size((const uint8_t *)buffer + 2);
+	if (addrsize == 0 || 2 + addrsize + sz > size) {
+		return -1;
+	}
+	*addr = buffer + 2;
+	*address_size = addrsize;
+	*data = buffer + 2 + addrsize;
+	*data_size = sz;
+	return 2 + addrsize + sz;
+}
+
+long
+socket_udpsendv(int id, const void *batch, int size) {
+	struct socket_req req;
+	struct socket * sock = socket_slot(id);
+	if (sock->id != id || sock->type == SOCKET_TYPE_INVALID) {
+		S.alloc((void *)batch, 0);
+		return -1;
+	}
+	memset(&req, 0, sizeof req);
+	req.req = SOCKET_REQ_SENDUDPV;
+	req.u.send.id = id;
+	req.u.send.data = (char *)batch;
+	req.u.send.size = size;
+	socket_inc_sending(sock, id);
+	socket_send_req(SOCKET_SHARD(id), &req);
+	return sock->wb_size;
+}
+
 void
 socket_object(struct socket_object_interface *soi) {
 	S.soi = *soi;
@@ -9,6 +9,9 @@
 #define SOCKET_ERR 5
 #define SOCKET_UDP 6
 #define SOCKET_WARNING 7
+#define SOCKET_UDPBATCH 8
+#define SOCKET_REDIRECT 9
+#define SOCKET_PACKAGE 10
 
 #define SOCKET_PRIORITY_HIGH 0
 #define SOCKET_PRIORITY_LOW 1
@@ -24,24 +27,75 @@ struct socket_message {
 
 typedef void *(*socket_alloc)(void *, int size);
 
-int socket_init(socket_alloc);
+struct socket_config {
+	int thread;
+	int edge;	// edge triggered events, read each socket until EAGAIN
+	int uring;	// io_uring instead of epoll if the kernel can, tcp sends go through the ring, from linux 6.0 it accepts and reads tcp too
+	int headroom;	// bytes reserved in front of received data
+	int max;	// connection capacity, slots are allocated as they are used
+	int resolver;	// threads resolving host names for socket_open
+	int dns_ttl;	// seconds a resolved host is cached, 0 disables the cache
+	const char *nameserver;	// ip[:port] asked for host names instead of getaddrinfo, or 0
+};
+
+int socket_init(socket_alloc, const struct socket_config *config);
 void socket_unit(void);
+int socket_thread(void);
 
 void socket_exit(void);
 void socket_start(int id, void *ud);
 void socket_close(int id, void *ud);
+// Returns 1 while id is open and ud owns it. Read without a lock, the owner may
+// close it right after.
+int socket_owned(int id, void *ud);
 void socket_nodelay(int id);
+// Stop and restart reading a socket, data already read is still delivered.
+void socket_pause(int id);
+void socket_resume(int id);
+// The pause of the flow control, kept apart from socket_pause: reading resumes
+// only once neither of them is on.
+void socket_throttle(int id, int on);
+// Hand an opened tcp socket to ud, without a gap or a reorder: reading stops and
+// the old owner gets SOCKET_REDIRECT behind the data it was sent, it answers with
+// socket_redirected. With a header of 2 or 4 the stream is split into packages
+// with a big endian size of that many bytes in front, each one is a
+// SOCKET_PACKAGE message without headroom. Otherwise the new owner gets
+// SOCKET_DATA. Returns -1 for another header.
+int socket_redirect(int id, void *ud, int header);
+// data: what the old owner was sent but did not consume, it goes out first.
+void socket_redirected(int id, const void *data, int size);
+// A host starting with "/" or "./" is a unix socket path, "@name" an abstract
+// unix socket, the port is ignored then. Unix datagram sockets have no peer
+// address, socket_udpopen connects them to the peer path.
 int socket_open(const char *host, int port, void *ud);
 int socket_listen(const char *host, int port, void *ud);
+int socket_listen_reuseport(const char *host, int port, void *ud);
 int socket_bind(int fd, void *ud);
 long socket_send(int id, const void *data, int size, int priority);
-int socket_poll(struct socket_message *sm);
+// Queue one buffer to n tcp sockets with a request per socket thread, it's freed
+// after the last socket sent it, size can't be negative. Write errors close the
+// sockets later and no SOCKET_WARNING is given.
+void socket_sendmulti(const int *ids, int n, const void *data, int size, int priority);
+// Send size bytes of the file fd from offset with sendfile, the socket owns fd.
+long socket_sendfile(int id, int fd, long offset, long size, int priority);
+// Between socket_cork and socket_uncork the tcp sends of the calling thread are
+// coalesced per socket, socket_flush(id) sends them now (all of them if id < 0).
+void socket_cork(void);
+void socket_uncork(void);
+void socket_flush(int id);
+int socket_poll(int thread, struct socket_message *sm);
 
 int socket_udp(const char *host, int port, void *ud);
 int socket_udpopen(int id, const char *host, int port);
 long socket_udpsend(int id, const char *addr, const void *data, int size);
 const char *socket_udpaddress(struct socket_message *m, int *address_size);
 
+// A udp batch is a sequence of records: uint16_t size, udp address, data.
+// SOCKET_UDPBATCH messages carry one, and socket_udpsendv sends one.
+int socket_udppack(char *buffer, const char *addr, const void *data, int size);
+int socket_udpunpack(const char *buffer, int size, const char **addr, int *address_size, const char **data, int *data_size);
+long socket_udpsendv(int id, const void *batch, int size);
+
 struct socket_object_interface {
 	void *(*data)(void *);
 	int(*size)(void *);
@@ -49,5 +103,32 @@ struct socket_object_interface {
 };
 void socket_object(struct socket_object_interface *soi);
 
+struct socket_info {
+	int id;
+	const char *type;	// tcp, udp, unix, listen, bind, opening or closing
+	void *ud;
+	int paused;
+	long age;	// ms since the socket was opened
+	long read;	// bytes received
+	long write;	// bytes sent
+	long read_call;	// read syscalls, or io_uring recv completions
+	long write_call;	// write syscalls, direct writes from other threads included, or io_uring send completions
+	long read_again;	// calls that returned EAGAIN
+	long write_again;
+	long wb_size;	// bytes waiting to be sent
+	long wb_peak;
+};
+
+struct socket_stat {
+	long wakeup;	// event waits that returned events
+	long event;	// events returned by them
+	long request;	// control requests handled
+};
+
+// Fills at most n entries, returns the number of live sockets. The counters are
+// read without a lock and may be a little behind.
+int socket_info(struct socket_info *si, int n);
+void socket_stat(struct socket_stat *stat);
+
 
 #endif // _socket_h_
@@ -0,0 +1,717 @@
+#include "uring.h"
+#include "event.h"
+
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Readiness events from io_uring poll requests. Arming, updating and removing a
+// poll only fills a submission entry, the entries go to the kernel together with
+// the next wait in a single io_uring_enter. Level triggered mode uses one shot
+// polls armed again once their event is handed out, edge triggered mode uses
+// multishot polls.
+// On kernels with multishot recv (6.0) an fd can be read by the ring itself:
+// listen sockets by a multishot accept, stream sockets by a multishot recv into
+// a ring of provided buffers. Those completions come as EVENT_ACCEPT and
+// EVENT_RECV, the poll of such an fd only looks for POLLOUT.
+// Sends are a sendmsg each, queued like the rest and handed back as EVENT_SEND.
+// A send has its own record and no generation, its owner hears of it even if
+// the fd went away meanwhile.
+
+#define URING_ENTRIES 1024
+#define URING_BUFS 256
+#define URING_BUF_SIZE (16 * 1024)
+#define URING_BGID 0
+
+#define URING_IDLE 0
+#define URING_ARMED 1
+#define URING_PENDING 2
+#define URING_CANCEL 3
+
+#define URING_POLL 0
+#define URING_ACCEPT 1
+#define URING_RECV 2
+
+// set in the user_data of an accept or a recv
+#define URING_READ 0x80000000u
+// set in the user_data of a send, the low bits are the index of its record
+#define URING_SEND 0x40000000u
+
+struct uring_fd {
+	void *ud;
+	uint32_t gen;	// of the poll
+	uint32_t rgen;	// of the accept or the recv
+	uint16_t mask;
+	uint8_t state;
+	uint8_t rstate;
+	uint8_t mode;
+	uint8_t read;	// reads wanted in accept and recv mode
+	int send;	// the record of the send in flight + 1, or 0
+};
+
+struct uring_send {
+	void *ud;
+	int fd;
+	int next;	// in the free list
+	int cap;
+	struct msghdr msg;
+	struct iovec iov[1];
+};
+
+struct uring {
+	int fd;
+	int edge;
+	unsigned flags;
+	void *ring;
+	size_t ring_size;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned sq_mask;
+	unsigned sq_entries;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned cq_mask;
+	struct io_uring_cqe *cqes;
+	struct uring_fd *fds;
+	int fd_cap;
+	int *arm;
+	int arm_n;
+	int arm_cap;
+	int complete;	// multishot accept and recv work
+	struct io_uring_buf_ring *br;
+	size_t br_size;
+	unsigned short br_tail;
+	char *buf;
+	int used[URING_BUFS];	// buffers handed out by the last wait
+	int used_n;
+	struct uring_send **send;
+	int send_n;
+	int send_free;
+};
+
+static inline int
+uring_enter(struct uring *u, unsigned submit, unsigned wait) {
+	return (int)syscall(__NR_io_uring_enter, u->fd, submit, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+}
+
+static inline unsigned
+uring_unsubmitted(struct uring *u) {
+	return *u->sq_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+}
+
+static void
+uring_buf_put(struct uring *u, int bid) {
+	struct io_uring_buf *b = &u->br->bufs[u->br_tail & (URING_BUFS - 1)];
+	b->addr = (uint64_t)(uintptr_t)(u->buf + (size_t)bid * URING_BUF_SIZE);
+	b->len = URING_BUF_SIZE;
+	b->bid = (uint16_t)bid;
+	u->br_tail++;
+	__atomic_store_n(&u->br->tail, u->br_tail, __ATOMIC_RELEASE);
+}
+
+// IORING_OP_SEND_ZC came with multishot recv, a kernel that knows it has both
+// multishot accept and recv.
+static int
+uring_complete_init(struct uring *u) {
+	struct io_uring_probe *probe;
+	struct io_uring_buf_reg reg;
+	size_t probe_size = sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op);
+	int ok, i;
+	probe = (struct io_uring_probe *)malloc(probe_size);
+	memset(probe, 0, probe_size);
+	ok = syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_PROBE, probe, 256) == 0
+		&& probe->last_op >= IORING_OP_SEND_ZC
+		&& (probe->ops[IORING_OP_RECV].flags & IO_URING_OP_SUPPORTED);
+	free(probe);
+	if (!ok) {
+		return -1;
+	}
+	u->br_size = URING_BUFS * sizeof(struct io_uring_buf);
+	u->br = (struct io_uring_buf_ring *)mmap(0, u->br_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (u->br == MAP_FAILED) {
+		u->br = NULL;
+		return -1;
+	}
+	memset(&reg, 0, sizeof reg);
+	reg.ring_addr = (uint64_t)(uintptr_t)u->br;
+	reg.ring_entries = URING_BUFS;
+	reg.bgid = URING_BGID;
+	if (syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+		munmap(u->br, u->br_size);
+		u->br = NULL;
+		return -1;
+	}
+	u->buf = (char *)malloc((size_t)URING_BUFS * URING_BUF_SIZE);
+	for (i = 0; i < URING_BUFS; i++) {
+		uring_buf_put(u, i);
+	}
+	return 0;
+}
+
+struct uring *
+uring_new(int edge) {
+	struct io_uring_params p;
+	struct uring *u;
+	unsigned *array;
+	size_t sq_size, cq_size;
+	unsigned i;
+	int fd;
+	memset(&p, 0, sizeof p);
+	fd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+	if (fd < 0) {
+		return NULL;
+	}
+	// multishot polls and poll updates came with the resource tags
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_NODROP)
+		|| !(p.features & IORING_FEAT_RSRC_TAGS)) {
+		close(fd);
+		errno = ENOSYS;
+		return NULL;
+	}
+	u = (struct uring *)malloc(sizeof *u);
+	memset(u, 0, sizeof *u);
+	u->fd = fd;
+	u->edge = edge;
+	u->send_free = -1;
+	if (p.features & IORING_FEAT_CQE_SKIP) {
+		u->flags = IOSQE_CQE_SKIP_SUCCESS;
+	}
+	sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	u->ring_size = sq_size > cq_size ? sq_size : cq_size;
+	u->ring = mmap(0, u->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (u->ring == MAP_FAILED) {
+		goto _failed;
+	}
+	u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	u->sqes = (struct io_uring_sqe *)mmap(0, u->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED) {
+		munmap(u->ring, u->ring_size);
+		goto _failed;
+	}
+	u->sq_head = (unsigned *)((char *)u->ring + p.sq_off.head);
+	u->sq_tail = (unsigned *)((char *)u->ring + p.sq_off.tail);
+	u->sq_mask = *(unsigned *)((char *)u->ring + p.sq_off.ring_mask);
+	u->sq_entries = p.sq_entries;
+	u->cq_head = (unsigned *)((char *)u->ring + p.cq_off.head);
+	u->cq_tail = (unsigned *)((char *)u->ring + p.cq_off.tail);
+	u->cq_mask = *(unsigned *)((char *)u->ring + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)((char *)u->ring + p.cq_off.cqes);
+	// entries are always filled in ring order
+	array = (unsigned *)((char *)u->ring + p.sq_off.array);
+	for (i = 0; i < p.sq_entries; i++) {
+		array[i] = i;
+	}
+	u->complete = uring_complete_init(u) == 0;
+	return u;
+_failed:
+	close(fd);
+	free(u);
+	return NULL;
+}
+
+void
+uring_free(struct uring *u) {
+	int i;
+	// the removals of the fds deleted last, an accept left armed keeps its
+	// listen socket bound until the ring is torn down in the background
+	if (uring_unsubmitted(u) > 0) {
+		uring_enter(u, uring_unsubmitted(u), 0);
+	}
+	if (u->br) {
+		munmap(u->br, u->br_size);
+	}
+	free(u->buf);
+	munmap(u->sqes, u->sqes_size);
+	munmap(u->ring, u->ring_size);
+	close(u->fd);
+	for (i = 0; i < u->send_n; i++) {
+		free(u->send[i]);
+	}
+	free(u->send);
+	free(u->fds);
+	free(u->arm);
+	free(u);
+}
+
+// Returns a cleared submission entry, or NULL if the ring stays full.
+static struct io_uring_sqe *
+uring_sqe(struct uring *u) {
+	struct io_uring_sqe *sqe;
+	if (uring_unsubmitted(u) >= u->sq_entries) {
+		if (uring_enter(u, u->sq_entries, 0) < 0 || uring_unsubmitted(u) >= u->sq_entries) {
+			fprintf(stderr, "socketlib io_uring submit errno:%d.\n", errno);
+			return NULL;
+		}
+	}
+	sqe = &u->sqes[*u->sq_tail & u->sq_mask];
+	memset(sqe, 0, sizeof *sqe);
+	return sqe;
+}
+
+static inline void
+uring_push(struct uring *u) {
+	__atomic_store_n(u->sq_tail, *u->sq_tail + 1, __ATOMIC_RELEASE);
+}
+
+static inline uint64_t
+uring_data(struct uring_fd *f, int fd) {
+	return ((uint64_t)f->gen << 32) | (uint32_t)fd;
+}
+
+static inline uint64_t
+uring_rdata(struct uring_fd *f, int fd) {
+	return ((uint64_t)f->rgen << 32) | (uint32_t)fd | URING_READ;
+}
+
+static void
+uring_queue(struct uring *u, int fd) {
+	if (u->arm_n == u->arm_cap) {
+		u->arm_cap = u->arm_cap ? u->arm_cap * 2 : 64;
+		u->arm = (int *)realloc(u->arm, u->arm_cap * sizeof(int));
+	}
+	u->arm[u->arm_n++] = fd;
+}
+
+static void
+uring_pending(struct uring *u, int fd) {
+	uring_queue(u, fd);
+	u->fds[fd].state = URING_PENDING;
+}
+
+static void
+uring_rpending(struct uring *u, int fd) {
+	uring_queue(u, fd);
+	u->fds[fd].rstate = URING_PENDING;
+}
+
+// Removes the poll, an accept or a recv of the fd, completions already on the
+// way are told apart by the generation in their user_data.
+static void
+uring_cancel(struct uring *u, int opcode, uint64_t data) {
+	struct io_uring_sqe *sqe = uring_sqe(u);
+	if (sqe) {
+		sqe->opcode = opcode;
+		sqe->fd = -1;
+		sqe->flags = u->flags;
+		sqe->addr = data;
+		uring_push(u);
+	}
+}
+
+// Queue a poll, an accept or a recv for every fd waiting for one, the fds left
+// over when the ring is full stay for the next round.
+static void
+uring_arm(struct uring *u) {
+	int i;
+	for (i = 0; i < u->arm_n; i++) {
+		int fd = u->arm[i];
+		struct uring_fd *f = &u->fds[fd];
+		struct io_uring_sqe *sqe;
+		if (f->state == URING_PENDING) {
+			sqe = uring_sqe(u);
+			if (sqe == NULL) {
+				break;
+			}
+			sqe->opcode = IORING_OP_POLL_ADD;
+			sqe->fd = fd;
+			sqe->poll32_events = f->mask;
+			sqe->len = u->edge ? IORING_POLL_ADD_MULTI : 0;
+			sqe->user_data = uring_data(f, fd);
+			uring_push(u);
+			f->state = URING_ARMED;
+		}
+		if (f->rstate == URING_PENDING) {
+			sqe = uring_sqe(u);
+			if (sqe == NULL) {
+				break;
+			}
+			sqe->fd = fd;
+			if (f->mode == URING_ACCEPT) {
+				sqe->opcode = IORING_OP_ACCEPT;
+				sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+				sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+			} else {
+				sqe->opcode = IORING_OP_RECV;
+				sqe->ioprio = IORING_RECV_MULTISHOT;
+				sqe->flags = IOSQE_BUFFER_SELECT;
+				sqe->buf_group = URING_BGID;
+			}
+			sqe->user_data = uring_rdata(f, fd);
+			uring_push(u);
+			f->rstate = URING_ARMED;
+		}
+	}
+	memmove(u->arm, u->arm + i, (u->arm_n - i) * sizeof(int));
+	u->arm_n -= i;
+}
+
+int
+uring_add(struct uring *u, int fd, void *ud) {
+	struct uring_fd *f;
+	if (fd >= u->fd_cap) {
+		int cap = u->fd_cap ? u->fd_cap : 64;
+		while (cap <= fd) {
+			cap *= 2;
+		}
+		u->fds = (struct uring_fd *)realloc(u->fds, cap * sizeof(struct uring_fd));
+		memset(u->fds + u->fd_cap, 0, (cap - u->fd_cap) * sizeof(struct uring_fd));
+		u->fd_cap = cap;
+	}
+	f = &u->fds[fd];
+	f->ud = ud;
+	f->gen++;
+	f->rgen++;
+	f->mask = u->edge ? (POLLIN | POLLOUT) : POLLIN;
+	f->rstate = URING_IDLE;
+	f->mode = URING_POLL;
+	f->read = 0;
+	uring_pending(u, fd);
+	return 0;
+}
+
+// The fd may be closed right after, a poll already submitted holds its own
+// reference to the file until the removal goes in with the next wait.
+void
+uring_del(struct uring *u, int fd) {
+	struct uring_fd *f;
+	if (fd < 0 || fd >= u->fd_cap) {
+		return;
+	}
+	f = &u->fds[fd];
+	if (f->state == URING_ARMED) {
+		uring_cancel(u, IORING_OP_POLL_REMOVE, uring_data(f, fd));
+	}
+	if (f->rstate == URING_ARMED) {
+		uring_cancel(u, IORING_OP_ASYNC_CANCEL, uring_rdata(f, fd));
+	}
+	f->gen++;
+	f->rgen++;
+	f->state = URING_IDLE;
+	f->rstate = URING_IDLE;
+	f->ud = NULL;
+	if (f->send) {
+		uring_cancel(u, IORING_OP_ASYNC_CANCEL, (f->send - 1) | URING_SEND);
+		f->send = 0;
+	}
+}
+
+// Without POLLIN an fd read by the ring has no poll at all while it needs no
+// POLLOUT either.
+static void
+uring_poll_mask(struct uring *u, int fd, uint16_t mask) {
+	struct uring_fd *f = &u->fds[fd];
+	if (f->mask == mask) {
+		return;
+	}
+	f->mask = mask;
+	if (f->mode != URING_POLL) {
+		if (mask == 0) {
+			if (f->state == URING_ARMED) {
+				uring_cancel(u, IORING_OP_POLL_REMOVE, uring_data(f, fd));
+				f->gen++;
+			}
+			f->state = URING_IDLE;
+			return;
+		}
+		if (f->state == URING_IDLE) {
+			uring_pending(u, fd);
+			return;
+		}
+	}
+	if (f->state == URING_ARMED) {
+		// if the poll fires first the update fails and it's armed again with the new mask
+		struct io_uring_sqe *sqe = uring_sqe(u);
+		if (sqe) {
+			sqe->opcode = IORING_OP_POLL_REMOVE;
+			sqe->fd = -1;
+			sqe->flags = u->flags;
+			sqe->addr = uring_data(f, fd);
+			if (u->edge) {
+				// an updated multishot poll misses what became ready while it was
+				// masked, so it's removed and a new one checks the fd again
+				f->gen++;
+				uring_pending(u, fd);
+			} else {
+				sqe->len = IORING_POLL_UPDATE_EVENTS;
+				sqe->poll32_events = mask;
+			}
+			uring_push(u);
+		}
+	}
+}
+
+// Turn the reads of an accept or a recv on or off, a recv being cancelled still
+// hands out what it got before.
+static void
+uring_read(struct uring *u, int fd, int read) {
+	struct uring_fd *f = &u->fds[fd];
+	f->read = read;
+	if (read) {
+		if (f->rstate == URING_IDLE) {
+			uring_rpending(u, fd);
+		}
+	} else if (f->rstate == URING_PENDING) {
+		f->rstate = URING_IDLE;
+	} else if (f->rstate == URING_ARMED) {
+		uring_cancel(u, IORING_OP_ASYNC_CANCEL, uring_rdata(f, fd));
+		f->rstate = URING_CANCEL;
+	}
+}
+
+void
+uring_mod(struct uring *u, int fd, void *ud, int read, int write) {
+	struct uring_fd *f;
+	if (fd < 0 || fd >= u->fd_cap) {
+		return;
+	}
+	f = &u->fds[fd];
+	f->ud = ud;
+	if (f->mode == URING_POLL) {
+		uring_poll_mask(u, fd, (read ? POLLIN : 0) | ((write || u->edge) ? POLLOUT : 0));
+		return;
+	}
+	if (f->mode == URING_RECV) {
+		uring_poll_mask(u, fd, (write || u->edge) ? POLLOUT : 0);
+	}
+	read = read != 0;
+	if (read != f->read) {
+		uring_read(u, fd, read);
+	}
+}
+
+static int
+uring_complete(struct uring *u, int fd, int mode) {
+	struct uring_fd *f;
+	int read;
+	if (!u->complete || fd < 0 || fd >= u->fd_cap) {
+		return -1;
+	}
+	f = &u->fds[fd];
+	f->mode = mode;
+	f->read = 0;
+	read = (f->mask & POLLIN) != 0;
+	if (mode == URING_ACCEPT) {
+		uring_poll_mask(u, fd, 0);
+	} else {
+		uring_poll_mask(u, fd, f->mask & ~POLLIN);
+	}
+	if (read) {
+		uring_read(u, fd, 1);
+	}
+	return 0;
+}
+
+int
+uring_accept(struct uring *u, int fd) {
+	return uring_complete(u, fd, URING_ACCEPT);
+}
+
+int
+uring_recv(struct uring *u, int fd) {
+	return uring_complete(u, fd, URING_RECV);
+}
+
+// A completion of an accept or a recv, the buffers and fds of the ones nobody
+// waits for any more go back at once.
+static int
+uring_read_event(struct uring *u, struct io_uring_cqe *cqe, struct event *e) {
+	int fd = (int)(uint32_t)(cqe->user_data & ~URING_READ);
+	struct uring_fd *f = fd < u->fd_cap ? &u->fds[fd] : NULL;
+	int bid = -1;
+	if (cqe->flags & IORING_CQE_F_BUFFER) {
+		bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+	}
+	if (f == NULL || f->rgen != (uint32_t)(cqe->user_data >> 32)
+		|| (f->rstate != URING_ARMED && f->rstate != URING_CANCEL)) {
+		if (bid >= 0) {
+			uring_buf_put(u, bid);
+		} else if (cqe->res > 0) {
+			// received bytes always have a buffer, this is an accepted fd
+			close(cqe->res);
+		}
+		return 0;
+	}
+	if (!(cqe->flags & IORING_CQE_F_MORE)) {
+		// out of buffers or cancelled, go on if the reads are still wanted
+		int again = cqe->res == -ENOBUFS || cqe->res == -ECANCELED;
+		f->rstate = URING_IDLE;
+		if (f->read && (again || cqe->res > 0 || f->mode == URING_ACCEPT)) {
+			uring_rpending(u, fd);
+		}
+		if (again) {
+			return 0;
+		}
+	}
+	e->type = f->mode == URING_ACCEPT ? EVENT_ACCEPT : EVENT_RECV;
+	e->ud = f->ud;
+	e->read = 0;
+	e->write = 0;
+	e->res = cqe->res;
+	e->data = NULL;
+	if (bid >= 0) {
+		e->data = u->buf + (size_t)bid * URING_BUF_SIZE;
+		u->used[u->used_n++] = bid;
+	}
+	return 1;
+}
+
+// Queue a sendmsg of iov, only the iovecs are copied. n 0 queues nothing and
+// tells if sends go through the ring at all.
+int
+uring_send(struct uring *u, int fd, void *ud, const struct iovec *iov, int n) {
+	struct uring_send *s;
+	struct io_uring_sqe *sqe;
+	int index;
+	if (n == 0) {
+		return 0;
+	}
+	if (fd < 0 || fd >= u->fd_cap || u->fds[fd].send) {
+		return -1;
+	}
+	sqe = uring_sqe(u);
+	if (sqe == NULL) {
+		return -1;
+	}
+	if (u->send_free >= 0) {
+		index = u->send_free;
+		s = u->send[index];
+		u->send_free = s->next;
+	} else {
+		index = u->send_n++;
+		u->send = (struct uring_send **)realloc(u->send, u->send_n * sizeof(*u->send));
+		s = NULL;
+	}
+	if (s == NULL || s->cap < n) {
+		// a record keeps the most iovecs it had to hold
+		s = (struct uring_send *)realloc(s, sizeof(*s) + (n - 1) * sizeof(*iov));
+		s->cap = n;
+		u->send[index] = s;
+	}
+	s->ud = ud;
+	s->fd = fd;
+	memcpy(s->iov, iov, n * sizeof(*iov));
+	memset(&s->msg, 0, sizeof(s->msg));
+	s->msg.msg_iov = s->iov;
+	s->msg.msg_iovlen = n;
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = fd;
+	sqe->addr = (uint64_t)(uintptr_t)&s->msg;
+	sqe->len = 1;
+	sqe->msg_flags = MSG_NOSIGNAL;
+	sqe->user_data = (uint64_t)index | URING_SEND;
+	uring_push(u);
+	u->fds[fd].send = index + 1;
+	return 0;
+}
+
+static int
+uring_send_event(struct uring *u, struct io_uring_cqe *cqe, struct event *e) {
+	int index = (int)(uint32_t)(cqe->user_data & ~URING_SEND);
+	struct uring_send *s = u->send[index];
+	if (s->fd < u->fd_cap && u->fds[s->fd].send == index + 1) {
+		u->fds[s->fd].send = 0;
+	}
+	e->type = EVENT_SEND;
+	e->ud = s->ud;
+	e->read = 0;
+	e->write = 0;
+	e->res = cqe->res;
+	e->data = NULL;
+	s->next = u->send_free;
+	u->send_free = index;
+	return 1;
+}
+
+static int
+uring_event(struct uring *u, struct io_uring_cqe *cqe, struct event *e) {
+	int fd = (int)(uint32_t)cqe->user_data;
+	struct uring_fd *f;
+	if (cqe->user_data & URING_READ) {
+		return uring_read_event(u, cqe, e);
+	}
+	if (cqe->user_data & URING_SEND) {
+		return uring_send_event(u, cqe, e);
+	}
+	if (cqe->user_data == 0 || fd >= u->fd_cap) {
+		// removals and updates, or a poll of an fd deleted since
+		return 0;
+	}
+	f = &u->fds[fd];
+	if (f->gen != (uint32_t)(cqe->user_data >> 32) || f->state != URING_ARMED) {
+		return 0;
+	}
+	e->type = EVENT_POLL;
+	e->ud = f->ud;
+	if (cqe->res < 0) {
+		// the poll can't be armed on this fd, let the owner find the error
+		f->state = URING_IDLE;
+		e->read = 1;
+		e->write = 0;
+		return 1;
+	}
+	if (!(cqe->flags & IORING_CQE_F_MORE)) {
+		uring_pending(u, fd);
+	}
+	e->read = (cqe->res & POLLIN) != 0;
+	e->write = (cqe->res & POLLOUT) != 0;
+	if (f->mode != URING_POLL) {
+		// the recv reads and finds the errors
+		e->read = 0;
+		return e->write;
+	}
+	if (!e->read && !e->write) {
+		// POLLERR or POLLHUP alone
+		e->read = 1;
+	}
+	return 1;
+}
+
+int
+uring_wait(struct uring *u, struct event *e, int maxev) {
+	int n = 0;
+	int i;
+	// the caller is done with the data of the last wait
+	for (i = 0; i < u->used_n; i++) {
+		uring_buf_put(u, u->used[i]);
+	}
+	u->used_n = 0;
+	while (n == 0) {
+		unsigned head, tail;
+		uring_arm(u);
+		head = *u->cq_head;
+		tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+		if (head == tail || uring_unsubmitted(u) > 0) {
+			if (uring_enter(u, uring_unsubmitted(u), head == tail ? 1 : 0) < 0) {
+				if (errno == EBUSY || errno == EAGAIN) {
+					// the completion queue is backed up, drain it first
+					if (head != tail) {
+						goto _reap;
+					}
+				}
+				return -1;
+			}
+			tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+		}
+_reap:
+		while (head != tail && n < maxev) {
+			if (uring_event(u, &u->cqes[head & u->cq_mask], &e[n])) {
+				n++;
+			}
+			head++;
+		}
+		__atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+	}
+	return n;
+}
@@ -0,0 +1,19 @@
+#ifndef _uring_h_
+#define _uring_h_
+
+struct event;
+struct iovec;
+struct uring;
+
+struct uring *uring_new(int edge);
+void uring_free(struct uring *u);
+int uring_add(struct uring *u, int fd, void *ud);
+void uring_del(struct uring *u, int fd);
+void uring_mod(struct uring *u, int fd, void *ud, int read, int write);
+int uring_wait(struct uring *u, struct event *e, int maxev);
+// The ring reads fd itself from now on, -1 if the kernel can't.
+int uring_accept(struct uring *u, int fd);
+int uring_recv(struct uring *u, int fd);
+int uring_send(struct uring *u, int fd, void *ud, const struct iovec *iov, int n);
+
+#endif // _uring_h_
@@ -0,0 +1,127 @@
+local service = require "service"
+local c = require "service.c"
+local socket = require "socket"
+local crypt = require "crypt"
+
+-- gate throughput benchmark: conn clients pass the handshake of the C gate and
+-- push n packages of size bytes each, the gate hands them to one agent per
+-- user. Counts packages/s from the first write to the last package counted.
+-- With "redirect" after the size the sockets go to the agents themselves.
+-- Then more clients than maxclient connect and leave one after another.
+local mode = ...
+
+local HOST = "127.0.0.1"
+local PORT = 8014
+
+if mode == "agent" then
+
+	local count = 0
+
+	service.protocol {
+		name = "client",
+		id = service.proto_client,
+		unpack = function(msg, sz)
+			return sz
+		end,
+		dispatch = function()
+			count = count + 1
+		end,
+	}
+
+	local request = {}
+
+	function request:count()
+		return count
+	end
+
+	function request:exit()
+		service.exit()
+	end
+
+	service.start(function()
+		service.serve(request)
+	end)
+
+else
+
+	local conn, n, size, redirect = ...
+	conn = tonumber(conn) or 16
+	n = tonumber(n) or 10000
+	size = tonumber(size) or 32
+
+	local function handshake(id, username, secret, index)
+		local text = username .. ":" .. (index or 1)
+		local hmac = crypt.base64encode(crypt.hmac_hash(secret, text))
+		socket.write(id, string.pack(">s2", text .. ":" .. hmac))
+		local len = string.unpack(">I2", assert(socket.read(id, 2)))
+		return socket.read(id, len)
+	end
+
+	service.start(function()
+		local gated = c.gate(string.format("%d %s %d %d 1 0 %d", service.handle, HOST, PORT, conn,
+			redirect == "redirect" and 1 or 0))
+		assert(gated ~= 0, "gate listen failed")
+		local auth = 0
+		service.dispatch("text", function(_, _, msg)
+			if msg:match "^auth" then
+				auth = auth + 1
+			end
+		end)
+
+		local users = {}
+		for i=1, conn do
+			local u = {
+				name = "user" .. i,
+				secret = crypt.randomkey(),
+				agent = service.create(SERVICE_NAME, "agent"),
+			}
+			service.send(gated, "text", string.format("login %s %s %d", u.name, crypt.hexencode(u.secret), u.agent))
+			users[i] = u
+		end
+
+		-- a bad hmac is turned away
+		local id = assert(socket.open(HOST, PORT))
+		assert(handshake(id, "user1", string.rep("x", 8)) == "401 Unauthorized")
+		socket.close(id)
+
+		local batch = string.rep(string.pack(">s2", string.rep("x", size)), 100)
+		local start = service.now()
+		local left = conn
+		for _, u in ipairs(users) do
+			service.fork(function()
+				local id = assert(socket.open(HOST, PORT))
+				assert(handshake(id, u.name, u.secret) == "200 OK")
+				for i=1, n // 100 do
+					socket.write(id, batch)
+				end
+				while service.req(u.agent, "count") < n // 100 * 100 do
+					service.sleep(1)
+				end
+				socket.close(id)
+				left = left - 1
+			end)
+		end
+		while left > 0 do
+			service.sleep(10)
+		end
+		local ti = math.max(service.now() - start, 1)
+		local total = n // 100 * 100 * conn
+		print(string.format("gate %s %d packages of %d bytes from %d clients (%d auth), %d packages/s",
+			redirect == "redirect" and "redirected" or "forwarded", total, size, conn, auth, total / ti * 100))
+
+		-- maxclient is conn, the clients that came and went don't hold a place,
+		-- each handshake of a user needs a higher index than the last one
+		for i=1, conn * 2 + 1 do
+			local u = users[(i - 1) % conn + 1]
+			local id = assert(socket.open(HOST, PORT))
+			assert(handshake(id, u.name, u.secret, i + 1) == "200 OK", i)
+			socket.close(id)
+		end
+
+		for _, u in ipairs(users) do
+			service.send(u.agent, "lua", "exit")
+		end
+		c.exit(gated)
+	end)
+
+end
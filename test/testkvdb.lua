@@ -0,0 +1,130 @@
+local service = require "service"
+local kvdb = require "kvdb"
+
+-- The key value store in C against example/simpledb, a lua table behind
+-- service.serve: n gets and sets from a few coroutines each, then the same
+-- keys in mget/mset batches. After it the log of the store is loaded by a new
+-- one, rewritten and loaded again.
+local n, batch, path = ...
+n = tonumber(n) or 100000
+batch = tonumber(batch) or 100
+path = path or "/tmp/testkvdb.log"
+
+local WORKER = 10
+
+local function bench(name, set, get)
+	local start = service.now()
+	local left = WORKER
+	for w = 1, WORKER do
+		service.fork(function()
+			for i = w, n, WORKER do
+				set("key:" .. i, "value:" .. i)
+			end
+			for i = w, n, WORKER do
+				assert(get("key:" .. i) == "value:" .. i)
+			end
+			left = left - 1
+		end)
+	end
+	while left > 0 do
+		service.sleep(1)
+	end
+	local ti = math.max(service.now() - start, 1)
+	print(string.format("%s: %d sets and gets, %d ops/s", name, n, n * 2 / ti * 100))
+end
+
+local function check(db, expect)
+	local keys = {}
+	for k in pairs(expect) do
+		keys[#keys+1] = k
+	end
+	keys[#keys+1] = "nothing"
+	local map = db:mget(keys)
+	for k, v in pairs(expect) do
+		assert(map[k] == v, k)
+	end
+	assert(map.nothing == nil)
+	assert(db:info().keys == #keys - 1)
+end
+
+service.start(function()
+	service.create "simpledb"
+	bench("simpledb", function(k, v)
+		service.req("SIMPLEDB", "set", k, v)
+	end, function(k)
+		return service.req("SIMPLEDB", "get", k)
+	end)
+
+	os.remove(path)
+	local db = kvdb.new(path)
+	bench("kvdb", function(k, v)
+		db:set(k, v)
+	end, function(k)
+		return db:get(k)
+	end)
+
+	local start = service.now()
+	for i = 1, n, batch do
+		local t = {}
+		for j = i, math.min(i + batch - 1, n) do
+			t["key:" .. j] = "batch:" .. j
+		end
+		db:mset(t)
+	end
+	for i = 1, n, batch do
+		local keys = {}
+		for j = i, math.min(i + batch - 1, n) do
+			keys[#keys+1] = "key:" .. j
+		end
+		local map = db:mget(keys)
+		for _, k in ipairs(keys) do
+			assert(map[k] == "batch:" .. k:sub(5))
+		end
+	end
+	local ti = math.max(service.now() - start, 1)
+	print(string.format("kvdb batches of %d: %d sets and gets, %d ops/s", batch, n, n * 2 / ti * 100))
+
+	-- overwrite, delete and restart from the log
+	assert(db:set("hello", "world") == nil)
+	assert(db:set("hello", "again") == "world")
+	assert(db:get("hello") == "again")
+	assert(db:del("hello") == "again")
+	assert(db:get("hello") == nil)
+	local expect = {}
+	for i = 1, 1000 do
+		local k = "key:" .. i
+		if i % 3 == 0 then
+			db:del(k)
+		else
+			expect[k] = string.rep("x", i)
+			db:set(k, expect[k])
+		end
+	end
+	for i = 1001, n do
+		db:del("key:" .. i)
+	end
+	db:set("empty", "")
+	expect.empty = ""
+	local before = db:info()
+	db:exit()
+
+	db = kvdb.new(path)
+	check(db, expect)
+
+	db:rewrite()
+	local info = db:info()
+	while info.log >= before.log do
+		service.sleep(1)
+		info = db:info()
+	end
+	print(string.format("log rewritten from %d to %d bytes, %d keys", before.log, info.log, info.keys))
+	db:set("after", "rewrite")
+	expect.after = "rewrite"
+	db:exit()
+
+	db = kvdb.new(path, "KVDB")
+	check(kvdb.open "KVDB", expect)
+	db:exit()
+	os.remove(path)
+	print("kvdb ok")
+end)
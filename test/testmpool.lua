@@ -0,0 +1,45 @@
+local service = require "service"
+local socket = require "socket"
+
+-- allocation count benchmark: echo small packets over loopback and report
+-- how many service_alloc calls and real mallocs each round trip costs.
+local round = ...
+round = tonumber(round) or 10000
+
+local HOST = "127.0.0.1"
+local PORT = 8007
+local PACKET = string.rep("m", 64)
+
+service.start(function()
+	local listen = socket.listen(HOST, PORT)
+	socket.start(listen, function(id, addr)
+		socket.start(id)
+		service.fork(function()
+			while true do
+				local str = socket.read(id)
+				if not str then
+					break
+				end
+				socket.write(id, str)
+			end
+			socket.close(id)
+			socket.close(listen)
+		end)
+	end)
+
+	local id = assert(socket.open(HOST, PORT))
+	-- warm up the pool
+	for i=1, 100 do
+		socket.write(id, PACKET)
+		assert(socket.read(id, #PACKET))
+	end
+	local s0 = service.mpool()
+	for i=1, round do
+		socket.write(id, PACKET)
+		assert(socket.read(id, #PACKET))
+	end
+	local s1 = service.mpool()
+	print(string.format("%d round trips: %.2f allocs, %.4f mallocs per round trip, %d bytes cached",
+		round, (s1.alloc - s0.alloc) / round, (s1.malloc - s0.malloc) / round, s1.cached))
+	socket.close(id)
+end)
@@ -0,0 +1,45 @@
+local service = require "service"
+
+-- The name registry: n names are registered, queried m times each from
+-- several coroutines, and removed. Prints the ops/s of each.
+local n, m = ...
+n = tonumber(n) or 100000
+m = tonumber(m) or 10
+
+service.start(function()
+	local names = {}
+	for i = 1, n do
+		names[i] = "service.name." .. i
+	end
+
+	local start = service.now()
+	for i = 1, n do
+		service.name(names[i], i)
+	end
+	local ti = math.max(service.now() - start, 1)
+	print(string.format("name: %d names, %d ops/s", n, n / ti * 100))
+
+	start = service.now()
+	for _ = 1, m do
+		for i = 1, n do
+			assert(service.query(names[i]) == i)
+		end
+	end
+	assert(service.query "service.name.none" == nil)
+	ti = math.max(service.now() - start, 1)
+	print(string.format("query: %d queries, %d ops/s", n * m, n * m / ti * 100))
+
+	-- a name taken again points to the new handle, handle 0 removes it
+	service.name(names[1], 42)
+	assert(service.query(names[1]) == 42)
+	start = service.now()
+	for i = 1, n do
+		service.name(names[i], 0)
+	end
+	ti = math.max(service.now() - start, 1)
+	for i = 1, n do
+		assert(service.query(names[i]) == nil)
+	end
+	print(string.format("remove: %d names, %d ops/s", n, n / ti * 100))
+	service.exit()
+end)
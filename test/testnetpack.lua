@@ -0,0 +1,125 @@
+local service = require "service"
+local socket = require "socket"
+local netpack = require "netpack"
+local sc = require "socket.c"
+
+-- the client streams packages of up to size bytes with a 2, 4 byte or varint
+-- header, split at random points. The server splits them again with
+-- netpack.filter and checks every package arrives whole and in order.
+local mode = ...
+
+local HOST = "127.0.0.1"
+local PORT = 8016
+
+if mode == "server" then
+
+	local _, header = ...
+	header = tonumber(header) or header
+	local queue = netpack.queue(header)
+	local count = 0
+	local bytes = 0
+	local closed = false
+
+	local function package(fd, msg, sz)
+		local str = netpack.tostring(msg, sz)
+		local i, len, pos = str:match "^(%d+):(%d+):()"
+		count = count + 1
+		assert(tonumber(i) == count and tonumber(len) == #str - pos + 1, str:sub(1, 32))
+		bytes = bytes + #str
+	end
+
+	local SOCKET = {}
+
+	function SOCKET.data(fd, msg, sz)
+		package(fd, msg, sz)
+	end
+
+	function SOCKET.more()
+		for fd, msg, sz in netpack.pop, queue do
+			package(fd, msg, sz)
+		end
+	end
+
+	function SOCKET.open(fd, addr)
+		sc.start(fd)
+	end
+
+	function SOCKET.close(fd)
+		closed = true
+	end
+
+	function SOCKET.error(fd, err)
+		service.err("netpack error on %d, %s\n", fd, err)
+		closed = true
+	end
+
+	service.protocol {
+		name = "socket",
+		id = service.proto_socket,
+		unpack = function(msg, sz)
+			return netpack.filter(queue, msg, sz)
+		end,
+		dispatch = function(_, _, q, t, ...)
+			queue = q
+			if t then
+				SOCKET[t](...)
+			end
+		end
+	}
+
+	local request = {}
+
+	function request:wait()
+		while not closed do
+			service.sleep(1)
+		end
+		netpack.clear(queue)
+		return count, bytes
+	end
+
+	service.start(function()
+		local listen = sc.listen(HOST, PORT)
+		sc.start(listen)
+		service.serve(request)
+	end)
+
+else
+
+	local header, n, size = ...
+	header = tonumber(header) or header or 4
+	n = tonumber(n) or 1000
+	size = tonumber(size) or (header == 2 and 65535 or 1024 * 1024)
+
+	service.start(function()
+		local server = service.create(SERVICE_NAME, "server", header)
+		local id = socket.open(HOST, PORT)
+		while not id do
+			service.sleep(1)
+			id = socket.open(HOST, PORT)
+		end
+		local stream = {}
+		local total = 0
+		for i=1, n do
+			local len = math.random() < 0.9 and math.random(8, 64) or math.random(8, size - 32)
+			local str = string.format("%d:%d:", i, len) .. string.rep("x", len)
+			stream[i] = netpack.pack_string(str, header)
+			total = total + #str
+		end
+		stream = table.concat(stream)
+		local start = service.now()
+		local pos = 1
+		while pos <= #stream do
+			local k = math.random(1, 65536)
+			socket.write(id, stream:sub(pos, pos + k - 1))
+			pos = pos + k
+			if math.random(4) == 1 then
+				service.sleep(0)
+			end
+		end
+		socket.close(id)
+		local count, bytes = service.req(server, "wait")
+		print(string.format("%s header: %d packages, %d bytes in %d ticks", header, count, bytes, service.now() - start))
+		assert(count == n and bytes == total)
+	end)
+
+end
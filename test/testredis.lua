@@ -0,0 +1,149 @@
+local service = require "service"
+local socket = require "socket"
+local redis = require "redis"
+
+-- redis client against a small stand-in server speaking RESP: conn coroutines
+-- each run n commands over a pool of connections, their requests are pipelined
+-- on the sockets. Prints commands/s and the commands the server got per read.
+local mode = ...
+
+local HOST = "127.0.0.1"
+local PORT = 8019
+
+if mode == "server" then
+
+	local store = {}
+	local reads, commands = 0, 0
+
+	local function bulk(v)
+		if v == nil then
+			return "$-1\r\n"
+		end
+		return string.format("$%d\r\n%s\r\n", #v, v)
+	end
+
+	local handler = {}
+
+	function handler.SET(k, v)
+		store[k] = v
+		return "+OK\r\n"
+	end
+
+	function handler.GET(k)
+		return bulk(store[k])
+	end
+
+	function handler.INCR(k)
+		local v = tonumber(store[k] or 0) + 1
+		store[k] = tostring(v)
+		return string.format(":%d\r\n", v)
+	end
+
+	function handler.MGET(...)
+		local r = { string.format("*%d\r\n", select("#", ...)) }
+		for i = 1, select("#", ...) do
+			r[i+1] = bulk(store[select(i, ...)])
+		end
+		return table.concat(r)
+	end
+
+	function handler.SELECT()
+		return "+OK\r\n"
+	end
+
+	function handler.STAT()
+		return string.format("*2\r\n:%d\r\n:%d\r\n", reads, commands)
+	end
+
+	local function serve(id)
+		socket.start(id)
+		local buffer = ""
+		while true do
+			local data = socket.read(id)
+			if not data then
+				break
+			end
+			reads = reads + 1
+			buffer = buffer .. data
+			local pos, replies = 1, {}
+			while true do
+				local nextpos, _, cmd = redis.parse(buffer, pos)
+				if not nextpos then
+					break
+				end
+				pos = nextpos
+				commands = commands + 1
+				local f = handler[cmd[1]:upper()]
+				if f then
+					replies[#replies+1] = f(table.unpack(cmd, 2))
+				else
+					replies[#replies+1] = string.format("-ERR unknown command '%s'\r\n", cmd[1])
+				end
+			end
+			buffer = buffer:sub(pos)
+			socket.write(id, table.concat(replies))
+		end
+		socket.close(id)
+	end
+
+	service.start(function()
+		local listen = socket.listen(HOST, PORT)
+		socket.start(listen, function(id, addr)
+			service.fork(serve, id)
+		end)
+	end)
+
+else
+
+	local conn, n, pool = ...
+	conn = tonumber(conn) or 100
+	n = tonumber(n) or 1000
+	pool = tonumber(pool) or 2
+
+	service.start(function()
+		service.create(SERVICE_NAME, "server")
+		service.sleep(10)
+		local db = redis.connect { host = HOST, port = PORT, db = 1, pool = pool }
+
+		assert(db:set("hello", "world") == "OK")
+		assert(db:get("hello") == "world")
+		assert(db:get("nothing") == nil)
+		local ok, err = pcall(db.nosuch, db, "x")
+		assert(not ok and err:find "unknown command", err)
+		local result, okf = db:pipeline { { "SET", "a", 1 }, { "GET", "a" }, { "NOSUCH" }, { "INCR", "a" } }
+		assert(result[1] == "OK" and result[2] == "1" and okf[3] == false and result[4] == 2)
+
+		local start = service.now()
+		local left = conn
+		for i=1, conn do
+			service.fork(function()
+				local keys = {}
+				for j=1, n do
+					local k = string.format("key:%d:%d", i, j)
+					keys[j] = k
+					if j % 2 == 1 then
+						db:set(k, j)
+					else
+						db:incr(k)
+					end
+					db:incr("counter")
+				end
+				local map = db:mgetmap(keys, 100)
+				for j=1, n do
+					assert(map[keys[j]] == (j % 2 == 1 and tostring(j) or "1"), keys[j])
+				end
+				left = left - 1
+			end)
+		end
+		while left > 0 do
+			service.sleep(1)
+		end
+		local ti = math.max(service.now() - start, 1)
+		assert(db:get("counter") == tostring(conn * n))
+		local stat = db:stat()
+		print(string.format("%d coroutines, %d commands on %d connections: %d commands/s, %.1f commands a read",
+			conn, conn * n * 2, pool, conn * n * 2 / ti * 100, stat[2] / stat[1]))
+		db:disconnect()
+	end)
+
+end
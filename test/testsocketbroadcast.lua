@@ -0,0 +1,65 @@
+local service = require "service"
+local socket = require "socket"
+
+-- broadcast benchmark: push many tiny updates to every client faster than
+-- they are drained, so the socket thread flushes long send queues.
+-- run it under `strace -f -c ./service config` to see writev per packet,
+-- and with `socket_uring = 1` to compare the poller syscalls with epoll.
+-- With "multi" after the size each packet goes to all clients in one sendmulti.
+local conn, n, size, multi = ...
+conn = tonumber(conn) or 16
+n = tonumber(n) or 10000
+size = tonumber(size) or 16
+
+local HOST = "127.0.0.1"
+local PORT = 8006
+
+service.start(function()
+	local clients = {}
+	local left = conn
+	local total = n * size
+	local start
+	local listen = socket.listen(HOST, PORT)
+	socket.start(listen, function(id, addr)
+		socket.start(id)
+		table.insert(clients, id)
+		if #clients == conn then
+			local packet = string.rep("b", size)
+			start = service.now()
+			for i=1, n do
+				if multi == "multi" then
+					socket.sendmulti(clients, packet)
+				else
+					for _, c in ipairs(clients) do
+						socket.write(c, packet)
+					end
+				end
+			end
+		end
+	end)
+
+	for i=1, conn do
+		service.fork(function()
+			local id = assert(socket.open(HOST, PORT))
+			local recv = 0
+			while recv < total do
+				local str = socket.read(id)
+				if not str then
+					break
+				end
+				recv = recv + #str
+			end
+			socket.close(id)
+			left = left - 1
+			if left == 0 then
+				local ti = math.max(service.now() - start, 1)
+				print(string.format("%s %d packets of %d bytes to %d clients, %d packets/s",
+					multi == "multi" and "sendmulti" or "broadcast", n, size, conn, n * conn / ti * 100))
+				for _, c in ipairs(clients) do
+					socket.close(c)
+				end
+				socket.close(listen)
+			end
+		end)
+	end
+end)
@@ -0,0 +1,69 @@
+local service = require "service"
+local socket = require "socket"
+
+-- every request is answered with many small writes, they are coalesced into
+-- one write when the dispatch returns. Compare the writes under
+-- `strace -f -c ./service config`, the replies must arrive in order.
+local mode, round, pieces = ...
+
+local HOST = "127.0.0.1"
+local PORT = 8008
+
+if mode == "server" then
+
+	pieces = tonumber(round)
+
+	service.start(function()
+		local listen = socket.listen(HOST, PORT)
+		socket.start(listen, function(id, addr)
+			socket.start(id)
+			service.fork(function()
+				while true do
+					local req = socket.read(id, 4)
+					if not req then
+						break
+					end
+					local n = string.unpack("<I4", req)
+					for i=1, pieces do
+						socket.write(id, string.pack("<I4I4", n, i))
+					end
+					if n % 100 == 0 then
+						-- sent before the sleep, not when the dispatch returns
+						socket.flush(id)
+						service.sleep(0)
+					end
+				end
+				socket.close(id)
+				socket.close(listen)
+			end)
+		end)
+	end)
+
+else
+
+	pieces = tonumber(round) or 10
+	round = tonumber(mode) or 10000
+
+	service.start(function()
+		service.create(SERVICE_NAME, "server", pieces)
+		local id = socket.open(HOST, PORT)
+		while not id do
+			service.sleep(1)
+			id = socket.open(HOST, PORT)
+		end
+		local start = service.now()
+		for n=1, round do
+			socket.write(id, string.pack("<I4", n))
+			socket.flush(id)
+			local reply = assert(socket.read(id, 8 * pieces))
+			for i=1, pieces do
+				local rn, ri = string.unpack("<I4I4", reply, i * 8 - 7)
+				assert(rn == n and ri == i, "reply out of order")
+			end
+		end
+		local ti = math.max(service.now() - start, 1)
+		print(string.format("%d requests with %d writes each, %d requests/s", round, pieces, round / ti * 100))
+		socket.close(id)
+	end)
+
+end
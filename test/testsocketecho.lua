@@ -0,0 +1,98 @@
+local service = require "service"
+local socket = require "socket"
+
+-- echo benchmark over loopback tcp.
+-- run it with different `socket_thread`, `socket_edge` and `socket_uring` values in config to compare:
+--	main = "testsocketecho"
+local mode, arg1, arg2, arg3 = ...
+
+local HOST = "127.0.0.1"
+local PORT = 8003
+local PACKET = string.rep("x", 64)
+
+if mode == "server" then
+
+	local function echo(id)
+		socket.start(id)
+		while true do
+			local str = socket.read(id)
+			if str then
+				socket.write(id, str)
+			else
+				socket.close(id)
+				return
+			end
+		end
+	end
+
+	service.start(function()
+		service.dispatch("lua", function(_,_, id)
+			service.fork(echo, id)
+		end)
+	end)
+
+elseif mode == "client" then
+
+	local conn, round = tonumber(arg1), tonumber(arg2)
+	local main = tonumber(arg3)
+
+	local function pingpong()
+		local id = assert(socket.open(HOST, PORT))
+		for i=1, round do
+			socket.write(id, PACKET)
+			assert(socket.read(id, #PACKET))
+		end
+		socket.close(id)
+	end
+
+	service.start(function()
+		local start = service.now()
+		local left = conn
+		for i=1, conn do
+			service.fork(function()
+				pingpong()
+				left = left - 1
+				if left == 0 then
+					service.send(main, "lua", service.now() - start)
+					service.exit()
+				end
+			end)
+		end
+	end)
+
+else
+
+	local worker = tonumber(mode) or 8
+	local conn = tonumber(arg1) or 64
+	local round = tonumber(arg2) or 1000
+
+	service.start(function()
+		local servers = {}
+		for i=1, worker do
+			servers[i] = service.create(SERVICE_NAME, "server")
+		end
+		local balance = 0
+		local listen = socket.listen(HOST, PORT)
+		socket.start(listen, function(id, addr)
+			balance = balance % worker + 1
+			service.send(servers[balance], "lua", id)
+		end)
+
+		local left = worker
+		local elapsed = 0
+		service.dispatch("lua", function(_,_, ti)
+			elapsed = math.max(elapsed, ti)
+			left = left - 1
+			if left == 0 then
+				local n = worker * conn * round
+				print(string.format("socket_thread = %s, socket_edge = %s, socket_uring = %s, %d connections, %d round trips, qps = %d",
+					service.getenv "socket_thread", service.getenv "socket_edge", service.getenv "socket_uring",
+					worker * conn, n, n / math.max(elapsed, 1) * 100))
+			end
+		end)
+		for i=1, worker do
+			service.create(SERVICE_NAME, "client", conn, round, service.handle)
+		end
+	end)
+
+end
@@ -0,0 +1,58 @@
+local service = require "service"
+local socket = require "socket"
+
+-- a few echo round trips, then the counters of both ends of the connection
+-- and of the socket threads. Every byte counted in is counted out again.
+local mode = ...
+
+local HOST = "127.0.0.1"
+local PORT = 8013
+local ROUND = 1000
+
+if mode == "server" then
+
+	service.start(function()
+		local listen = socket.listen(HOST, PORT)
+		socket.start(listen, function(id, addr)
+			socket.start(id)
+			socket.close(listen)
+			service.fork(function()
+				while true do
+					local str = socket.read(id, 64)
+					if not str then
+						break
+					end
+					socket.write(id, str)
+				end
+				socket.close(id)
+			end)
+		end)
+	end)
+
+else
+
+	service.start(function()
+		service.create(SERVICE_NAME, "server")
+		local id = socket.open(HOST, PORT)
+		while not id do
+			service.sleep(1)
+			id = socket.open(HOST, PORT)
+		end
+		local req = string.rep("x", 64)
+		for i=1, ROUND do
+			socket.write(id, req)
+			assert(socket.read(id, 64) == req)
+		end
+		for _, info in ipairs(socket.info()) do
+			if info.type == "tcp" then
+				print(string.format("socket %d of %x: read %d bytes in %d calls (%d EAGAIN), wrote %d bytes in %d calls, peak backlog %d, age %d ms",
+					info.id, info.service, info.read, info.read_call, info.read_again, info.write, info.write_call, info.wb_peak, info.age))
+				assert(info.read == 64 * ROUND and info.write == 64 * ROUND)
+			end
+		end
+		local stat = socket.stat()
+		print(string.format("%d wakeups, %.2f events each, %d requests", stat.wakeup, stat.event / math.max(stat.wakeup, 1), stat.request))
+		socket.close(id)
+	end)
+
+end
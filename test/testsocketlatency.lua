@@ -0,0 +1,53 @@
+local service = require "service"
+local socket = require "socket"
+
+-- ping-pong latency over one loopback tcp connection, the echo side
+-- answers from a worker thread so replies go through socket.write.
+local mode, round = ...
+
+local HOST = "127.0.0.1"
+local PORT = 8005
+local PACKET = string.rep("p", 64)
+
+if mode == "server" then
+
+	service.start(function()
+		local listen = socket.listen(HOST, PORT)
+		socket.start(listen, function(id, addr)
+			socket.start(id)
+			service.fork(function()
+				while true do
+					local str = socket.read(id)
+					if not str then
+						break
+					end
+					socket.write(id, str)
+				end
+				socket.close(id)
+				socket.close(listen)
+			end)
+		end)
+	end)
+
+else
+
+	round = tonumber(mode) or 100000
+
+	service.start(function()
+		service.create(SERVICE_NAME, "server")
+		local id = socket.open(HOST, PORT)
+		while not id do
+			service.sleep(1)
+			id = socket.open(HOST, PORT)
+		end
+		local start = service.now()
+		for i=1, round do
+			socket.write(id, PACKET)
+			assert(socket.read(id, #PACKET))
+		end
+		local ti = math.max(service.now() - start, 1)
+		print(string.format("%d round trips, avg rtt = %.1fus", round, ti * 10000 / round))
+		socket.close(id)
+	end)
+
+end
@@ -0,0 +1,74 @@
+local service = require "service"
+local socket = require "socket"
+
+-- a fast sender against a slow reader. Without flow control the data piles up
+-- in the reader's message queue, with `socket_pause` set in the config the
+-- reader's memory stays bounded and the sender is held back by the kernel
+-- buffers instead. The manual mode pauses the socket itself while it sleeps.
+local mode, total, manual = ...
+
+local HOST = "127.0.0.1"
+local PORT = 8009
+local CHUNK = 4096
+local READ = 65536
+
+if mode == "reader" then
+
+	manual = total == "manual"
+
+	service.start(function()
+		local listen = socket.listen(HOST, PORT)
+		socket.start(listen, function(id, addr)
+			socket.start(id)
+			socket.close(listen)
+			service.fork(function()
+				local bytes = 0
+				local peak = 0
+				while true do
+					local str = socket.read(id, READ)
+					if not str then
+						break
+					end
+					bytes = bytes + #str
+					peak = math.max(peak, collectgarbage("count"))
+					if manual then
+						socket.pause(id)
+						service.sleep(1)
+						socket.resume(id)
+					else
+						-- busy in the dispatch, the socket messages queue up
+						local t = os.clock()
+						while os.clock() - t < 0.01 do end
+					end
+				end
+				print(string.format("read %d bytes, peak lua memory %d KB", bytes, peak))
+				socket.close(id)
+			end)
+		end)
+	end)
+
+else
+
+	total = (tonumber(mode) or 16) * 1024 * 1024
+
+	service.start(function()
+		service.create(SERVICE_NAME, "reader", manual)
+		local id = socket.open(HOST, PORT)
+		while not id do
+			service.sleep(1)
+			id = socket.open(HOST, PORT)
+		end
+		local chunk = string.rep("x", CHUNK)
+		local start = service.now()
+		for i=1, total // CHUNK do
+			socket.write(id, chunk)
+			if i % 16 == 0 then
+				service.sleep(0)
+			end
+		end
+		local ti = math.max(service.now() - start, 1)
+		print(string.format("wrote %d bytes in %d ticks", total, ti))
+		socket.close(id)
+	end)
+
+end
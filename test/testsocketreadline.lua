@@ -0,0 +1,87 @@
+local service = require "service"
+local socket = require "socket"
+
+-- readline benchmark: the client pipelines n lines of up to size bytes ending
+-- with "\r\n" in writes of chunk bytes, the server reads them with readline.
+-- Long lines in small chunks show the cost of scanning again on every read.
+local mode = ...
+
+local HOST = "127.0.0.1"
+local PORT = 8018
+
+if mode == "server" then
+
+	local function serve(id)
+		socket.start(id)
+		local count, bytes = 0, 0
+		while true do
+			local line = socket.readline(id, "\r\n")
+			if not line then
+				break
+			end
+			count = count + 1
+			bytes = bytes + #line
+		end
+		socket.close(id)
+		return count, bytes
+	end
+
+	local request = {}
+	local result
+
+	function request:wait()
+		while not result do
+			service.sleep(1)
+		end
+		return table.unpack(result)
+	end
+
+	service.start(function()
+		local listen = socket.listen(HOST, PORT)
+		socket.start(listen, function(id, addr)
+			socket.close(listen)
+			service.fork(function()
+				result = { serve(id) }
+			end)
+		end)
+		service.serve(request)
+	end)
+
+else
+
+	local n, size, chunk = ...
+	n = tonumber(n) or 100000
+	size = tonumber(size) or 64
+	chunk = tonumber(chunk) or 65536
+
+	service.start(function()
+		local server = service.create(SERVICE_NAME, "server")
+		local id = socket.open(HOST, PORT)
+		while not id do
+			service.sleep(1)
+			id = socket.open(HOST, PORT)
+		end
+		local lines = {}
+		local total = 0
+		for i=1, n do
+			local len = math.random(1, size)
+			lines[i] = string.rep(string.char(97 + i % 26), len) .. "\r\n"
+			total = total + len
+		end
+		local stream = table.concat(lines)
+		local start = service.now()
+		for pos=1, #stream, chunk do
+			socket.write(id, stream:sub(pos, pos + chunk - 1))
+			if pos // chunk % 16 == 0 then
+				service.sleep(0)
+			end
+		end
+		socket.close(id)
+		local count, bytes = service.req(server, "wait")
+		local ti = math.max(service.now() - start, 1)
+		print(string.format("%d lines of up to %d bytes in %d byte writes: %d ticks, %d lines/s",
+			count, size, chunk, ti, count / ti * 100))
+		assert(count == n and bytes == total)
+	end)
+
+end
@@ -0,0 +1,84 @@
+local service = require "service"
+local socket = require "socket"
+
+-- the server reads a hello line and redirects the socket to an agent, the
+-- client writes the packages right behind the hello. The agent gets every one
+-- as a client message in order, the bytes the server had already read as well.
+local mode, agent = ...
+
+local HOST = "127.0.0.1"
+local PORT = 8015
+local N = 10000
+
+if mode == "agent" then
+
+	local seq = 0
+	local closed = false
+
+	service.protocol {
+		name = "client",
+		id = service.proto_client,
+		unpack = service.msgstring,
+		dispatch = function(_, _, msg)
+			seq = seq + 1
+			assert(tonumber(msg) == seq, msg)
+		end,
+	}
+
+	-- the socket messages of the redirected socket come here too
+	service.dispatch("socket", function(_, _, t)
+		if t == 1 then
+			closed = true
+		end
+	end)
+
+	local request = {}
+
+	function request:wait()
+		while not closed do
+			service.sleep(1)
+		end
+		return seq
+	end
+
+	service.start(function()
+		service.serve(request)
+	end)
+
+elseif mode == "server" then
+
+	service.start(function()
+		agent = tonumber(agent)
+		local listen = socket.listen(HOST, PORT)
+		socket.start(listen, function(id, addr)
+			socket.start(id)
+			socket.close(listen)
+			service.fork(function()
+				assert(socket.readline(id) == "hello")
+				socket.redirect(id, agent, 2)
+			end)
+		end)
+	end)
+
+else
+
+	service.start(function()
+		local agent = service.create(SERVICE_NAME, "agent")
+		service.create(SERVICE_NAME, "server", agent)
+		local id = socket.open(HOST, PORT)
+		while not id do
+			service.sleep(1)
+			id = socket.open(HOST, PORT)
+		end
+		local packages = { "hello\n" }
+		for i=1, N do
+			packages[#packages+1] = string.pack(">s2", tostring(i))
+		end
+		socket.write(id, table.concat(packages))
+		socket.close(id)
+		local seq = service.req(agent, "wait")
+		print(string.format("agent got %d of %d packages in order", seq, N))
+		assert(seq == N)
+	end)
+
+end
@@ -0,0 +1,110 @@
+local service = require "service"
+local socket = require "socket"
+
+-- opens to a host name that a stub name server answers slowly, while a
+-- loopback echo keeps going through the same socket thread. The echo never
+-- waits for the lookup, and the second open of the name is answered from the
+-- cache. Run it with socket_nameserver = "127.0.0.1:8053" in the config, the
+-- stub listens there.
+local mode, arg = ...
+
+local HOST = "127.0.0.1"
+local PORT = 8012
+local NAME = "slow.example.invalid"
+local DELAY = 50	-- ticks the stub takes to answer
+
+if mode == "server" then
+
+	service.start(function()
+		local listen = socket.listen(HOST, PORT)
+		socket.start(listen, function(id, addr)
+			socket.start(id)
+			service.fork(function()
+				while true do
+					local str = socket.read(id, 64)
+					if not str then
+						break
+					end
+					socket.write(id, str)
+				end
+				socket.close(id)
+			end)
+		end)
+	end)
+
+elseif mode == "dns" then
+
+	-- answers an A query with 127.0.0.1 and any other one with no record
+	local function reply(query)
+		local id = string.unpack(">I2", query)
+		local offset = 13
+		while query:byte(offset) ~= 0 do
+			offset = offset + query:byte(offset) + 1
+		end
+		local qtype = string.unpack(">I2", query, offset + 1)
+		local question = query:sub(13, offset + 4)
+		if qtype ~= 1 then
+			return string.pack(">I2I2I2I2I2I2", id, 0x8180, 1, 0, 0, 0) .. question
+		end
+		return string.pack(">I2I2I2I2I2I2", id, 0x8180, 1, 1, 0, 0) .. question
+			.. string.pack(">I2I2I2I4s2", 0xc00c, 1, 1, 60, "\127\0\0\1")
+	end
+
+	service.start(function()
+		local udp
+		udp = socket.udp(function(query, from)
+			service.fork(function()
+				service.sleep(DELAY)
+				socket.sendto(udp, from, reply(query))
+			end)
+		end, HOST, tonumber(arg))
+	end)
+
+else
+
+	service.start(function()
+		local ns = service.getenv "socket_nameserver"
+		local port = ns and ns:match("^127%.0%.0%.1:(%d+)$")
+		assert(port, "run with socket_nameserver = \"127.0.0.1:8053\" in the config")
+		service.create(SERVICE_NAME, "dns", port)
+		service.create(SERVICE_NAME, "server")
+		local id = socket.open(HOST, PORT)
+		while not id do
+			service.sleep(1)
+			id = socket.open(HOST, PORT)
+		end
+		local resolving = true
+		local first, cached, result
+		local function open()
+			local start = service.now()
+			local fd = socket.open(NAME, PORT)
+			if fd then
+				socket.close(fd)
+			end
+			return service.now() - start, fd and "opened" or "failed"
+		end
+		service.fork(function()
+			first, result = open()
+			cached = open()
+			resolving = false
+		end)
+		local stall = 0
+		local req = string.rep("x", 64)
+		while resolving do
+			local start = service.now()
+			socket.write(id, req)
+			assert(socket.read(id, 64) == req)
+			stall = math.max(stall, service.now() - start)
+			service.sleep(0)
+		end
+		socket.close(id)
+		print(string.format("open %s %s in %d ticks, again in %d ticks", NAME, result, first, cached))
+		print(string.format("longest echo round trip while resolving %d ticks", stall))
+		assert(result == "opened", "the stub answer was not used")
+		assert(first >= DELAY - 1, "the open did not wait for the name server")
+		assert(cached < DELAY // 10, "the second open missed the cache")
+		assert(stall < DELAY // 5, "the echo stalled behind the lookup")
+		print("resolver ok")
+	end)
+
+end
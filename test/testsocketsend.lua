@@ -0,0 +1,43 @@
+local service = require "service"
+local socket = require "socket"
+
+-- burst send benchmark: one service writes many small packets to a loopback
+-- connection while another drains it.
+-- run it under `strace -f -c ./service config` to see syscalls per message.
+local n, size = ...
+n = tonumber(n) or 100000
+size = tonumber(size) or 32
+
+local HOST = "127.0.0.1"
+local PORT = 8004
+
+service.start(function()
+	local total = n * size
+	local start
+	local listen = socket.listen(HOST, PORT)
+	socket.start(listen, function(id, addr)
+		socket.start(id)
+		service.fork(function()
+			local recv = 0
+			while recv < total do
+				local str = socket.read(id)
+				if not str then
+					break
+				end
+				recv = recv + #str
+			end
+			local ti = math.max(service.now() - start, 1)
+			print(string.format("send %d packets of %d bytes, %d msgs/s", n, size, n / ti * 100))
+			socket.close(id)
+			socket.close(listen)
+		end)
+	end)
+
+	local id = assert(socket.open(HOST, PORT))
+	local packet = string.rep("s", size)
+	start = service.now()
+	for i=1, n do
+		socket.write(id, packet)
+	end
+	socket.close(id)
+end)
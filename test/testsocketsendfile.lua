@@ -0,0 +1,63 @@
+local service = require "service"
+local socket = require "socket"
+
+-- a file served with socket.sendfile never passes through lua or the socket
+-- buffers, the server memory stays flat whatever the file size. The client
+-- checks every byte and that writes queued around the file keep their order.
+local mode = ...
+
+local HOST = "127.0.0.1"
+local PORT = 8010
+local FILE = "sendfile.tmp"
+local LINE = 1024
+
+local function line(i)
+	local s = string.format("%d\n", i)
+	return string.rep(".", LINE - #s) .. s
+end
+
+if mode == "server" then
+
+	service.start(function()
+		local listen = socket.listen(HOST, PORT)
+		socket.start(listen, function(id, addr)
+			socket.start(id)
+			socket.close(listen)
+			local before = collectgarbage("count")
+			socket.write(id, "head")
+			local size = assert(socket.sendfile(id, FILE))
+			socket.write(id, "tail")
+			print(string.format("sent %d bytes, lua memory %d KB -> %d KB", size, before, collectgarbage("count")))
+			socket.close(id)
+		end)
+	end)
+
+else
+
+	local lines = (tonumber(mode) or 64) * 1024 * 1024 // LINE
+
+	service.start(function()
+		local f = assert(io.open(FILE, "wb"))
+		for i=1, lines do
+			f:write(line(i))
+		end
+		f:close()
+		service.create(SERVICE_NAME, "server")
+		local id = socket.open(HOST, PORT)
+		while not id do
+			service.sleep(1)
+			id = socket.open(HOST, PORT)
+		end
+		local start = service.now()
+		assert(socket.read(id, 4) == "head")
+		for i=1, lines do
+			assert(socket.read(id, LINE) == line(i), "file data mismatch")
+		end
+		assert(socket.read(id, 4) == "tail")
+		local ti = math.max(service.now() - start, 1)
+		print(string.format("received %d MB, %d MB/s", lines * LINE // (1024 * 1024), lines * LINE / (1024 * 1024) / ti * 100))
+		socket.close(id)
+		os.remove(FILE)
+	end)
+
+end
@@ -0,0 +1,87 @@
+local service = require "service"
+local socket = require "socket"
+
+-- the client sends n records of a "key size\r\n" line and size bytes of body,
+-- the server parses them from slices of the received data and writes the body
+-- back. With "string" after the size the server reads strings to compare.
+local mode = ...
+
+local HOST = "127.0.0.1"
+local PORT = 8017
+
+if mode == "server" then
+
+	local _, kind = ...
+
+	local function serve(id)
+		socket.start(id)
+		if kind == "slice" then
+			socket.slice(id)
+		end
+		while true do
+			local line = socket.readline(id, "\r\n")
+			if not line then
+				break
+			end
+			local sp = assert(line:find(" ", 1, true))
+			local key, size = line:sub(1, sp - 1), tonumber(tostring(line:sub(sp + 1)))
+			assert(tostring(key):match "^k%d+$", tostring(line))
+			local body = assert(socket.read(id, size))
+			assert(#body == size and body:byte(1) == 35 and body:byte(-1) == 35)
+			socket.write(id, body)
+		end
+		socket.close(id)
+	end
+
+	service.start(function()
+		local listen = socket.listen(HOST, PORT)
+		socket.start(listen, function(id, addr)
+			socket.close(listen)
+			service.fork(serve, id)
+		end)
+	end)
+
+else
+
+	local n, size, str = ...
+	n = tonumber(n) or 10000
+	size = tonumber(size) or 4096
+
+	service.start(function()
+		local kind = str == "string" and "string" or "slice"
+		service.create(SERVICE_NAME, "server", kind)
+		local id = socket.open(HOST, PORT)
+		while not id do
+			service.sleep(1)
+			id = socket.open(HOST, PORT)
+		end
+		local bodies = {}
+		local stream = {}
+		for i=1, n do
+			local len = math.random(2, size)
+			local body = "#" .. string.rep(string.char(97 + i % 26), len - 2) .. "#"
+			bodies[i] = body
+			stream[i] = string.format("k%d %d\r\n", i, len) .. body
+		end
+		stream = table.concat(stream)
+		local start = service.now()
+		service.fork(function()
+			local pos = 1
+			while pos <= #stream do
+				local k = math.random(1, 65536)
+				socket.write(id, stream:sub(pos, pos + k - 1))
+				pos = pos + k
+			end
+		end)
+		local bytes = 0
+		for i=1, n do
+			local body = assert(socket.read(id, #bodies[i]))
+			assert(body == bodies[i], i)
+			bytes = bytes + #body
+		end
+		socket.close(id)
+		print(string.format("%s: %d records, %d bytes of body in %d ticks",
+			kind, n, bytes, service.now() - start))
+	end)
+
+end
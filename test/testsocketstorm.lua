@@ -0,0 +1,100 @@
+local service = require "service"
+local socket = require "socket"
+
+-- connection storm: clients connect, echo one packet and hang up as fast as
+-- they can. With more than one listener every listener service binds the port
+-- with SO_REUSEPORT and the kernel spreads the accepts between them.
+local mode, conn, para = ...
+
+local HOST = "127.0.0.1"
+local PORT = 8007
+local PACKET = "ping"
+
+if mode == "listener" then
+
+	local listen
+	local accepted = 0
+	local request = {}
+
+	function request:start(group)
+		if group then
+			listen = socket.listen_reuseport(HOST, PORT)
+		else
+			listen = socket.listen(HOST, PORT)
+		end
+		if listen < 0 then
+			return false
+		end
+		socket.start(listen, function(id, addr)
+			accepted = accepted + 1
+			socket.start(id)
+			service.fork(function()
+				local str = socket.read(id)
+				if str then
+					socket.write(id, str)
+				end
+				socket.close(id)
+			end)
+		end)
+		return true
+	end
+
+	function request:stop()
+		socket.close(listen)
+		return accepted
+	end
+
+	service.start(function()
+		service.serve(request)
+	end)
+
+else
+
+	local listeners = tonumber(mode) or 4
+	conn = tonumber(conn) or 20000
+	para = tonumber(para) or 64
+
+	service.start(function()
+		local group = {}
+		for i=1, listeners do
+			local l = service.create(SERVICE_NAME, "listener")
+			assert(service.req(l, "start", listeners > 1), "listen failed")
+			group[i] = l
+		end
+		local left = conn
+		local done = 0
+		local failed = 0
+		local co = coroutine.running()
+		local start = service.now()
+		for i=1, para do
+			service.fork(function()
+				while left > 0 do
+					left = left - 1
+					local id = socket.open(HOST, PORT)
+					if id then
+						socket.write(id, PACKET)
+						if not socket.read(id, #PACKET) then
+							failed = failed + 1
+						end
+						socket.close(id)
+					else
+						failed = failed + 1
+					end
+				end
+				done = done + 1
+				if done == para then
+					service.wakeup(co)
+				end
+			end)
+		end
+		service.wait(co)
+		local ti = math.max(service.now() - start, 1)
+		local accepted = {}
+		for i, l in ipairs(group) do
+			accepted[i] = service.req(l, "stop")
+		end
+		print(string.format("%d connections through %d listeners (accepted %s), %d failed, %d conn/s",
+			conn, listeners, table.concat(accepted, "/"), failed, conn / ti * 100))
+	end)
+
+end
@@ -0,0 +1,65 @@
+local service = require "service"
+local socket = require "socket"
+
+-- request/response round trips to a local server over a unix socket and over
+-- loopback tcp, the same service code serves both.
+local mode, round = ...
+local size
+
+local UNIX = "./testsocketunix.sock"
+local HOST = "127.0.0.1:8011"
+
+if mode == "server" then
+
+	service.start(function()
+		for _, addr in ipairs { UNIX, HOST } do
+			local listen = socket.listen(addr)
+			assert(listen >= 0, "listen failed")
+			socket.start(listen, function(id, addr)
+				socket.start(id)
+				service.fork(function()
+					while true do
+						local head = socket.read(id, 4)
+						if not head then
+							break
+						end
+						local body = socket.read(id, string.unpack("<I4", head))
+						socket.write(id, head .. body)
+					end
+					socket.close(id)
+				end)
+			end)
+		end
+	end)
+
+else
+
+	size = tonumber(round) or 64
+	round = tonumber(mode) or 20000
+
+	local function bench(addr)
+		local id = socket.open(addr)
+		while not id do
+			service.sleep(1)
+			id = socket.open(addr)
+		end
+		local req = string.pack("<s4", string.rep("x", size))
+		local start = service.now()
+		for i=1, round do
+			socket.write(id, req)
+			assert(socket.read(id, #req) == req)
+		end
+		local ti = math.max(service.now() - start, 1)
+		socket.close(id)
+		return round / ti * 100
+	end
+
+	service.start(function()
+		service.create(SERVICE_NAME, "server")
+		local unix = bench(UNIX)
+		local tcp = bench(HOST)
+		print(string.format("%d round trips of %d bytes: unix %d/s, tcp %d/s", round, size, unix, tcp))
+		os.remove(UNIX)
+	end)
+
+end
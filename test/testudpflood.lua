@@ -0,0 +1,46 @@
+local service = require "service"
+local socket = require "socket"
+
+-- udp flood over loopback: the client fires small datagrams in bursts and
+-- the server echoes every burst it receives back with one sendto_batch.
+local n, burst = ...
+n = tonumber(n) or 100000
+burst = tonumber(burst) or 64
+
+local HOST = "127.0.0.1"
+local PORT = 8766
+local PACKET = string.rep("u", 32)
+
+service.start(function()
+	local host
+	local pending = {}
+	host = socket.udp(function(str, from)
+		pending[#pending+1] = from
+		pending[#pending+1] = str
+		if #pending == 2 then
+			service.fork(function()
+				local batch = pending
+				pending = {}
+				socket.sendto_batch(host, batch)
+			end)
+		end
+	end, HOST, PORT)
+
+	local recv = 0
+	local start = service.now()
+	local c = socket.udp(function(str, from)
+		recv = recv + 1
+	end)
+	socket.udp_open(c, HOST, PORT)
+	local sent = 0
+	while sent < n do
+		for i=1, burst do
+			socket.write(c, PACKET)
+		end
+		sent = sent + burst
+		service.sleep(0)
+	end
+	service.sleep(100)
+	local ti = math.max(service.now() - start, 1)
+	print(string.format("udp flood: sent %d, echoed %d, %d packets/s", sent, recv, recv / ti * 100))
+end)